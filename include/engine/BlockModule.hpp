@@ -0,0 +1,51 @@
+/*
+ * DISTRHO Cardinal Plugin
+ * Copyright (C) 2021-2024 Filipe Coelho <falktx@falktx.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of
+ * the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * For a full copy of the GNU General Public License see the LICENSE file.
+ */
+
+#pragma once
+
+#include <engine/Module.hpp>
+
+namespace rack {
+namespace engine {
+
+/** Maximum number of frames given to a single block call, longer engine blocks are split. */
+static constexpr const int BLOCK_MAX_FRAMES = 64;
+
+struct BlockProcessArgs : Module::ProcessArgs {
+    /** Number of frames to process, between 1 and BLOCK_MAX_FRAMES.
+    `frame` is the engine frame of the first one.
+    */
+    int frames;
+    /** Voltages of each input and output port, with PORT_MAX_CHANNELS floats per frame.
+    Use the channel count of the port itself, it stays the same for the whole block.
+    */
+    const float* const* inputs;
+    float* const* outputs;
+};
+
+/** A module that can process a whole block of frames at once.
+The engine calls processBlock() instead of process() only when every connected input comes from another block module,
+so there are no per-frame dependencies on the rest of the patch.
+Otherwise, and while bypassed, process() is called once per frame as usual, so both must behave the same.
+Output channel counts are set with `outputs[i].setChannels()` as in process().
+*/
+struct BlockModule : Module {
+    virtual void processBlock(const BlockProcessArgs& args) = 0;
+};
+
+}
+}
@@ -241,7 +241,9 @@ struct Port {
 
 
 struct Output : Port {
-	/** List of cables connected to this port. */
+	/** List of cables connected to this port.
+	Only used when the patch changes, the engine steps cables from its own flat schedule.
+	*/
 	std::list<Cable*> cables;
 };
 
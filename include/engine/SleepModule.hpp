@@ -0,0 +1,45 @@
+/*
+ * DISTRHO Cardinal Plugin
+ * Copyright (C) 2021-2024 Filipe Coelho <falktx@falktx.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of
+ * the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * For a full copy of the GNU General Public License see the LICENSE file.
+ */
+
+#pragma once
+
+#include <engine/Module.hpp>
+
+namespace rack {
+namespace engine {
+
+/** Number of consecutive silent frames after which a module that is not a SleepModule is put to sleep. */
+static constexpr const int SLEEP_FRAMES = 4096;
+
+/** Interface for modules that know when they have nothing left to output, inherited along with Module.
+A module that is allowed to sleep stops being processed while all its inputs are zero and its params are unchanged.
+Its outputs are zeroed, and it wakes up by processing the first frame where an input or param changes.
+Modules implementing this are allowed to sleep by default, as soon as isQuiescent() returns true.
+Others can only be allowed by the user, and only sleep once their outputs stayed at zero for SLEEP_FRAMES frames.
+Terminal modules never sleep.
+*/
+struct SleepModule {
+    virtual ~SleepModule() {}
+    /** Returns whether the outputs stay at zero from now on, as long as inputs are zero and params are unchanged.
+    Called from the audio thread right after process(), only while all inputs are zero.
+    For example, a reverb returns true once its tail has decayed.
+    */
+    virtual bool isQuiescent() = 0;
+};
+
+}
+}
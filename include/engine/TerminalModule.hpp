@@ -17,7 +17,7 @@
 
 #pragma once
 
-#include <engine/Module.hpp>
+#include <engine/BlockModule.hpp>
 
 namespace rack {
 namespace engine {
@@ -27,5 +27,14 @@ struct TerminalModule : Module {
     virtual void processTerminalOutput(const ProcessArgs& args) = 0;
 };
 
+/** A terminal module that can also exchange a whole block of host data at once, see BlockModule.
+Its outputs can feed block modules directly, while its inputs are collected frame by frame.
+The engine only uses the block calls, but the per-frame ones must behave the same.
+*/
+struct BlockTerminalModule : TerminalModule {
+    virtual void processTerminalInputBlock(const BlockProcessArgs& args) = 0;
+    virtual void processTerminalOutputBlock(const BlockProcessArgs& args) = 0;
+};
+
 }
 }
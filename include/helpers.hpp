@@ -37,6 +37,10 @@
 namespace rack {
 
 struct CardinalPluginModelHelper : plugin::Model {
+    // whether modules can be created and loaded on patch loader threads, next to other modules.
+    // off by default, some modules (such as plugin hosts) expect to be created one at a time on the loading thread
+    bool parallelLoading = false;
+
     virtual app::ModuleWidget* createModuleWidgetFromEngineLoad(engine::Module* m) = 0;
     virtual void removeCachedModuleWidget(engine::Module* m) = 0;
 };
@@ -113,12 +113,59 @@ struct Message {
 };
 
 
+/** A MIDI message read in place, without copying its bytes. Cardinal specific.
+The bytes belong to the host or the module that produced them, and are only valid during the current engine block.
+Has the same accessors as Message, so code reading messages can take either.
+*/
+struct MessageView {
+	const uint8_t* bytes = nullptr;
+	uint32_t size = 0;
+	/** Frame of the message within the current engine block. */
+	uint32_t frame = 0;
+
+	MessageView() {}
+	MessageView(const uint8_t* bytes, uint32_t size, uint32_t frame) : bytes(bytes), size(size), frame(frame) {}
+
+	int getSize() const {
+		return size;
+	}
+	uint8_t getChannel() const {
+		if (size < 1)
+			return 0;
+		return bytes[0] & 0xf;
+	}
+	uint8_t getStatus() const {
+		if (size < 1)
+			return 0;
+		return bytes[0] >> 4;
+	}
+	uint8_t getNote() const {
+		if (size < 2)
+			return 0;
+		return bytes[1];
+	}
+	uint8_t getValue() const {
+		if (size < 3)
+			return 0;
+		return bytes[2];
+	}
+	int64_t getFrame() const {
+		return frame;
+	}
+};
+
+
 struct InputQueue {
 	struct Internal;
 	Internal* internal;
 
 	InputQueue();
 	~InputQueue();
+	/** Reads the next host MIDI message due by `maxFrame`, in place and without allocating, SysEx included. Cardinal specific. */
+	bool tryPop(MessageView* const viewOut, int64_t maxFrame);
+	/** Same as above, copying the message into `messageOut`.
+	Messages longer than what `messageOut` can already hold, like SysEx, make it allocate.
+	*/
 	bool tryPop(Message* const messageOut, int64_t maxFrame);
 	json_t* toJson() const;
 	void fromJson(json_t* rootJ);
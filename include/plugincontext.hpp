@@ -6,6 +6,8 @@
 
 #pragma once
 
+#include <atomic>
+
 #ifdef BUILDING_PLUGIN_MODULES
 #include "rack.hpp"
 #endif
@@ -70,6 +72,30 @@ using CardinalDGL::IdleCallback;
 
 static constexpr const uint32_t kModuleParameterCount = 24;
 
+// how long audio terminal modules take to fade out the current patch, and fade in the next one, in seconds
+static constexpr const float kPatchFadeTime = 0.01f;
+
+// how many patches can be preloaded, selected by host programs or MIDI program changes
+static constexpr const uint32_t kPatchBankSize = 16;
+
+// how many midi events modules can send to the host per host buffer, and how many bytes longer ones (like SysEx) can use
+static constexpr const uint32_t kMidiOutputEventCount = 1024;
+static constexpr const uint32_t kMidiOutputDataSize = 65536;
+
+// midi events sent by modules during the current host buffer, given to the host in frame order at the end of it.
+// events longer than MidiEvent::kDataSize point into data, so nothing is allocated on the audio thread.
+struct CardinalMidiOutput {
+    CardinalDISTRHO::MidiEvent events[kMidiOutputEventCount];
+    uint8_t data[kMidiOutputDataSize];
+    uint32_t eventCount;
+    uint32_t dataSize;
+    // host buffer frame where the current engine block starts
+    uint32_t frameOffset;
+    // event budget use since activation, for diagnostics: most events in a host buffer, and events dropped over budget
+    uint32_t peakEventCount;
+    uint32_t droppedEventCount;
+};
+
 enum CardinalVariant {
     kCardinalVariantMain,
     kCardinalVariantMini,
@@ -93,6 +119,15 @@ struct CardinalPluginContext : rack::Context {
     float** dataOuts;
     const CardinalDISTRHO::MidiEvent* midiEvents;
     uint32_t midiEventCount;
+    // host midi events that did not fit the blocks a host buffer was split into, since activation, for diagnostics
+    uint32_t midiInputDroppedEventCount;
+    uint32_t patchFadeCounter;
+    // frames by which modules processed on the worker thread lag behind the rest of the patch, 0 if none.
+    // updated after every host buffer, so modules mixing offloaded and direct signals can compensate for it
+    uint32_t offloadLatency;
+    CardinalMidiOutput* midiOutput;
+    // bank program to switch to, set from any thread and applied outside of the audio thread, -1 if none
+    std::atomic<int32_t> pendingProgram;
     CardinalDISTRHO::Plugin* const plugin;
     CardinalDGL::NanoTopLevelWidget* tlw;
     CardinalDISTRHO::UI* ui;
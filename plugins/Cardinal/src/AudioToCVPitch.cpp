@@ -19,6 +19,7 @@
 #include "plugin.hpp"
 #include "ModuleWidgets.hpp"
 #include "Widgets.hpp"
+#include "engine/SleepModule.hpp"
 
 extern "C" {
 #include "aubio.h"
@@ -41,7 +42,7 @@ static_assert(kAubioBufferSize % kAubioHopSize == 0, "kAubioBufferSize / kAubioH
 
 // --------------------------------------------------------------------------------------------------------------------
 
-struct AudioToCVPitch : Module {
+struct AudioToCVPitch : Module, SleepModule {
     enum ParamIds {
         PARAM_SENSITIVITY,
         PARAM_CONFIDENCETHRESHOLD,
@@ -76,6 +77,8 @@ struct AudioToCVPitch : Module {
     fvec_t* const detectedPitch = new_fvec(1);
     fvec_t* const inputBuffer = new_fvec(kAubioBufferSize);
     uint32_t inputBufferPos = 0;
+    // number of consecutive silent input samples, the pitch detector only sees silence once it covers the whole buffer
+    uint32_t silentSamples = 0;
 
     aubio_pitch_t* pitchDetector = nullptr;
 
@@ -109,6 +112,16 @@ struct AudioToCVPitch : Module {
         inputBuffer->data[inputBufferPos] = inputs[AUDIO_INPUT].getVoltage() * 0.1f
                                           * params[PARAM_SENSITIVITY].getValue();
 
+        if (d_isZero(inputBuffer->data[inputBufferPos]))
+        {
+            if (silentSamples < kAubioBufferSize)
+                ++silentSamples;
+        }
+        else
+        {
+            silentSamples = 0;
+        }
+
         if (++inputBufferPos == kAubioBufferSize)
         {
             inputBufferPos = 0;
@@ -148,6 +161,15 @@ struct AudioToCVPitch : Module {
         outputs[CV_GATE].setVoltage(cvSignal);
     }
 
+    // silent input only keeps the outputs at zero once no pitch is held and the detector buffer is all silence
+    bool isQuiescent() override
+    {
+        return silentSamples == kAubioBufferSize
+            && d_isZero(lastUsedOutputPitch)
+            && d_isZero(lastUsedOutputSignal)
+            && (! smooth || d_isZero(smoothOutputSignal.out));
+    }
+
     void onReset() override
     {
         inputBufferPos = 0;
@@ -56,7 +56,6 @@ struct CardinalExpanderForOutputMIDI : CardinalExpanderFromCarlaMIDIToCV {
     uint32_t midiEventFrame;
     uint8_t channel;
     Module* lastConnectedModule;
-    midi::Message converterMsg;
 
     // stuff from Rack
     bool smooth;
@@ -204,10 +203,7 @@ struct CardinalExpanderForOutputMIDI : CardinalExpanderFromCarlaMIDIToCV {
                     continue;
             }
 
-            converterMsg.frame = midiEventFrame;
-            std::memcpy(converterMsg.bytes.data(), data, midiEvent.size);
-
-            processMessage(converterMsg);
+            processMessage(midi::MessageView(data, midiEvent.size, midiEventFrame));
         }
 
         ++midiEventFrame;
@@ -247,7 +243,7 @@ struct CardinalExpanderForOutputMIDI : CardinalExpanderFromCarlaMIDIToCV {
         }
     }
 
-    void processMessage(const midi::Message& msg)
+    void processMessage(const midi::MessageView& msg)
     {
         // DEBUG("MIDI: %ld %s", msg.getFrame(), msg.toString().c_str());
 
@@ -303,7 +299,7 @@ struct CardinalExpanderForOutputMIDI : CardinalExpanderFromCarlaMIDIToCV {
         }
     }
 
-    void processCC(const midi::Message& msg) {
+    void processCC(const midi::MessageView& msg) {
         switch (msg.getNote()) {
             // mod
             case 0x01: {
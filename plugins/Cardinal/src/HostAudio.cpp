@@ -25,8 +25,16 @@
 
 USE_NAMESPACE_DISTRHO;
 
+static inline float getBlockVoltageSum(const float* const voltages, const int channels)
+{
+    float sum = 0.0f;
+    for (int c=0; c<channels; ++c)
+        sum += voltages[c];
+    return sum;
+}
+
 template<int numIO>
-struct HostAudio : TerminalModule {
+struct HostAudio : BlockTerminalModule {
     CardinalPluginContext* const pcontext;
     const int numParams;
     const int numInputs;
@@ -41,6 +49,12 @@ struct HostAudio : TerminalModule {
     dsp::RCFilter dcFilters[numIO];
     bool dcFilterEnabled = (numIO == 2);
 
+    // fade in when added, and out when loading a new patch that replaces this one
+    bool patchFadeEnabled = true;
+    uint32_t patchFadeCounter = 0;
+    float patchFadeGain = 1.0f;
+    float patchFadeStep = 1.0f;
+
     HostAudio()
         : pcontext(static_cast<CardinalPluginContext*>(APP)),
           numParams(numIO == 2 ? 1 : 0),
@@ -58,25 +72,50 @@ struct HostAudio : TerminalModule {
         const float sampleTime = pcontext->engine->getSampleTime();
         for (int i=0; i<numIO; ++i)
             dcFilters[i].setCutoffFreq(10.f * sampleTime);
+
+        patchFadeStep = sampleTime / kPatchFadeTime;
+    }
+
+    void onAdd(const AddEvent&) override
+    {
+        patchFadeCounter = pcontext->patchFadeCounter;
+        patchFadeGain = patchFadeEnabled ? 0.0f : 1.0f;
     }
 
     void onReset() override
     {
         dcFilterEnabled = (numIO == 2);
+        patchFadeEnabled = true;
     }
 
     void onSampleRateChange(const SampleRateChangeEvent& e) override
     {
         for (int i=0; i<numIO; ++i)
             dcFilters[i].setCutoffFreq(10.f * e.sampleTime);
+
+        patchFadeStep = e.sampleTime / kPatchFadeTime;
     }
 
-    void processTerminalInput(const ProcessArgs&) override
+    // gain for the next output frame, fading out once a new patch is about to replace this one
+    float stepPatchFade()
+    {
+        if (!patchFadeEnabled)
+            return 1.0f;
+
+        if (patchFadeCounter != pcontext->patchFadeCounter)
+            return patchFadeGain = std::max(0.0f, patchFadeGain - patchFadeStep);
+
+        if (patchFadeGain < 1.0f)
+            return patchFadeGain = std::min(1.0f, patchFadeGain + patchFadeStep);
+
+        return 1.0f;
+    }
+
+    // only checked on input
+    void checkProcessCounter()
     {
-        const uint32_t bufferSize = pcontext->bufferSize;
         const uint32_t processCounter = pcontext->processCounter;
 
-        // only checked on input
         if (lastProcessCounter != processCounter)
         {
             bypassed = isBypassed();
@@ -89,6 +128,13 @@ struct HostAudio : TerminalModule {
                 in2connected = inputs[1].isConnected();
             }
         }
+    }
+
+    void processTerminalInput(const ProcessArgs&) override
+    {
+        const uint32_t bufferSize = pcontext->bufferSize;
+
+        checkProcessCounter();
 
         // only incremented on output
         const uint32_t k = dataFrame;
@@ -107,17 +153,47 @@ struct HostAudio : TerminalModule {
         }
     }
 
+    void processTerminalInputBlock(const BlockProcessArgs& args) override
+    {
+        const uint32_t bufferSize = pcontext->bufferSize;
+        const uint32_t frames = args.frames;
+
+        checkProcessCounter();
+
+        // only incremented on output
+        const uint32_t k = dataFrame;
+        DISTRHO_SAFE_ASSERT_INT2_RETURN(k + frames <= bufferSize, k + frames, bufferSize,);
+
+        // from host into cardinal, shows as output plug
+        if (bypassed)
+        {
+            for (int i=0; i<numOutputs; ++i)
+                for (uint32_t f=0; f<frames; ++f)
+                    args.outputs[i][f * PORT_MAX_CHANNELS] = 0.0f;
+        }
+        else if (const float* const* const dataIns = pcontext->dataIns)
+        {
+            for (int i=0; i<numOutputs; ++i)
+                for (uint32_t f=0; f<frames; ++f)
+                    args.outputs[i][f * PORT_MAX_CHANNELS] = dataIns[i][k + f] * 10.0f;
+        }
+    }
+
     json_t* dataToJson() override
     {
         json_t* const rootJ = json_object();
         DISTRHO_SAFE_ASSERT_RETURN(rootJ != nullptr, nullptr);
 
         json_object_set_new(rootJ, "dcFilter", json_boolean(dcFilterEnabled));
+        json_object_set_new(rootJ, "patchFade", json_boolean(patchFadeEnabled));
         return rootJ;
     }
 
     void dataFromJson(json_t* const rootJ) override
     {
+        if (json_t* const patchFadeJ = json_object_get(rootJ, "patchFade"))
+            patchFadeEnabled = json_boolean_value(patchFadeJ);
+
         json_t* const dcFilterJ = json_object_get(rootJ, "dcFilter");
         DISTRHO_SAFE_ASSERT_RETURN(dcFilterJ != nullptr,);
 
@@ -150,7 +226,8 @@ struct HostAudio2 : HostAudio<2> {
     }
 #endif
 
-    void processTerminalOutput(const ProcessArgs&) override
+    // returns false when there is nothing to output, resetting meters if needed
+    bool checkOutputActive()
     {
         if (pcontext->bypassed || (!in1connected && !in2connected))
         {
@@ -162,32 +239,21 @@ struct HostAudio2 : HostAudio<2> {
                 resetMeters = false;
             }
 #endif
-            return;
+            return false;
         }
 
-        const uint32_t bufferSize = pcontext->bufferSize;
-
-        // only incremented on output
-        const uint32_t k = dataFrame++;
-        DISTRHO_SAFE_ASSERT_INT2_RETURN(k < bufferSize, k, bufferSize,);
-
-        if (bypassed)
-            return;
-
-        float** const dataOuts = pcontext->dataOuts;
-
-        // gain (stereo variant only)
-        const float gain = std::pow(params[0].getValue(), 2.f);
-
-        // read stereo values
-        float valueL, valueR;
+        return true;
+    }
 
+    // takes the voltage sum of each input
+    void processOutputFrame(float** const dataOuts, const uint32_t k, const float gain, float valueL, float valueR)
+    {
         if (in1connected)
         {
             if (!std::isfinite(dataOuts[0][k]))
                 __builtin_unreachable();
 
-            valueL = inputs[0].getVoltageSum() * 0.1f;
+            valueL *= 0.1f;
 
             if (dcFilterEnabled)
             {
@@ -208,7 +274,7 @@ struct HostAudio2 : HostAudio<2> {
             if (!std::isfinite(dataOuts[1][k]))
                 __builtin_unreachable();
 
-            valueR = inputs[1].getVoltageSum() * 0.1f;
+            valueR *= 0.1f;
 
             if (dcFilterEnabled)
             {
@@ -278,6 +344,58 @@ struct HostAudio2 : HostAudio<2> {
         }
 #endif
     }
+
+    void processTerminalOutput(const ProcessArgs&) override
+    {
+        if (!checkOutputActive())
+            return;
+
+        const uint32_t bufferSize = pcontext->bufferSize;
+
+        // only incremented on output
+        const uint32_t k = dataFrame++;
+        DISTRHO_SAFE_ASSERT_INT2_RETURN(k < bufferSize, k, bufferSize,);
+
+        if (bypassed)
+            return;
+
+        // gain (stereo variant only)
+        const float gain = std::pow(params[0].getValue(), 2.f) * stepPatchFade();
+
+        processOutputFrame(pcontext->dataOuts, k, gain, inputs[0].getVoltageSum(), inputs[1].getVoltageSum());
+    }
+
+    void processTerminalOutputBlock(const BlockProcessArgs& args) override
+    {
+        if (!checkOutputActive())
+            return;
+
+        const uint32_t bufferSize = pcontext->bufferSize;
+        const uint32_t frames = args.frames;
+
+        // only incremented on output
+        const uint32_t k = dataFrame;
+        dataFrame += frames;
+        DISTRHO_SAFE_ASSERT_INT2_RETURN(k + frames <= bufferSize, k + frames, bufferSize,);
+
+        if (bypassed)
+            return;
+
+        float** const dataOuts = pcontext->dataOuts;
+
+        // gain (stereo variant only)
+        const float gain = std::pow(params[0].getValue(), 2.f);
+
+        const int channelsL = inputs[0].getChannels();
+        const int channelsR = inputs[1].getChannels();
+
+        for (uint32_t f=0; f<frames; ++f)
+        {
+            processOutputFrame(dataOuts, k + f, gain * stepPatchFade(),
+                               getBlockVoltageSum(args.inputs[0] + f * PORT_MAX_CHANNELS, channelsL),
+                               getBlockVoltageSum(args.inputs[1] + f * PORT_MAX_CHANNELS, channelsR));
+        }
+    }
 };
 
 struct HostAudio8 : HostAudio<8> {
@@ -298,6 +416,7 @@ struct HostAudio8 : HostAudio<8> {
             return;
 
         float** const dataOuts = pcontext->dataOuts;
+        const float fade = stepPatchFade();
 
         for (int i=0; i<numInputs; ++i)
         {
@@ -309,10 +428,51 @@ struct HostAudio8 : HostAudio<8> {
                 v = dcFilters[i].highpass();
             }
 
-            dataOuts[i][k] += clamp(v, -1.0f, 1.0f);
+            dataOuts[i][k] += clamp(v, -1.0f, 1.0f) * fade;
         }
     }
 
+    void processTerminalOutputBlock(const BlockProcessArgs& args) override
+    {
+        if (pcontext->bypassed)
+            return;
+
+        const uint32_t bufferSize = pcontext->bufferSize;
+        const uint32_t frames = args.frames;
+
+        // only incremented on output
+        const uint32_t k = dataFrame;
+        dataFrame += frames;
+        DISTRHO_SAFE_ASSERT_INT2_RETURN(k + frames <= bufferSize, k + frames, bufferSize,);
+
+        if (bypassed)
+            return;
+
+        float** const dataOuts = pcontext->dataOuts;
+
+        float fades[BLOCK_MAX_FRAMES];
+        for (uint32_t f=0; f<frames; ++f)
+            fades[f] = stepPatchFade();
+
+        for (int i=0; i<numInputs; ++i)
+        {
+            const float* const voltages = args.inputs[i];
+            const int channels = inputs[i].getChannels();
+
+            for (uint32_t f=0; f<frames; ++f)
+            {
+                float v = getBlockVoltageSum(voltages + f * PORT_MAX_CHANNELS, channels) * 0.1f;
+
+                if (dcFilterEnabled)
+                {
+                    dcFilters[i].process(v);
+                    v = dcFilters[i].highpass();
+                }
+
+                dataOuts[i][k + f] += clamp(v, -1.0f, 1.0f) * fades[f];
+            }
+        }
+    }
 };
 
 #ifndef HEADLESS
@@ -344,6 +504,7 @@ struct HostAudioWidget : ModuleWidgetWith8HP {
     void appendContextMenu(Menu* const menu) override {
         menu->addChild(new MenuSeparator);
         menu->addChild(createBoolPtrMenuItem("DC blocker", "", &module->dcFilterEnabled));
+        menu->addChild(createBoolPtrMenuItem("Fade on patch change", "", &module->patchFadeEnabled));
     }
 };
 
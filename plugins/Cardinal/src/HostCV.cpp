@@ -24,7 +24,7 @@
 
 USE_NAMESPACE_DISTRHO;
 
-struct HostCV : TerminalModule {
+struct HostCV : BlockTerminalModule {
     CardinalPluginContext* const pcontext;
     bool bypassed = false;
     int dataFrame = 0;
@@ -70,22 +70,28 @@ struct HostCV : TerminalModule {
         configParam<SwitchQuantity>(BIPOLAR_OUTPUTS_6_10, 0.f, 1.f, 0.f, "Bipolar Outputs 6-10")->randomizeEnabled = false;
     }
 
-    void processTerminalInput(const ProcessArgs&) override
+    // only checked on input
+    void checkProcessCounter()
     {
-        if (pcontext->variant != kCardinalVariantMain && pcontext->variant != kCardinalVariantMini)
-            return;
-
-        const uint8_t ioOffset = pcontext->variant == kCardinalVariantMini ? 2 : 8;
-        const uint32_t bufferSize = pcontext->bufferSize;
         const uint32_t processCounter = pcontext->processCounter;
 
-        // only checked on input
         if (lastProcessCounter != processCounter)
         {
             bypassed = isBypassed();
             dataFrame = 0;
             lastProcessCounter = processCounter;
         }
+    }
+
+    void processTerminalInput(const ProcessArgs&) override
+    {
+        if (pcontext->variant != kCardinalVariantMain && pcontext->variant != kCardinalVariantMini)
+            return;
+
+        const uint8_t ioOffset = pcontext->variant == kCardinalVariantMini ? 2 : 8;
+        const uint32_t bufferSize = pcontext->bufferSize;
+
+        checkProcessCounter();
 
         // only incremented on output
         const uint32_t k = dataFrame;
@@ -166,6 +172,95 @@ struct HostCV : TerminalModule {
             }
         }
     }
+
+    void processTerminalInputBlock(const BlockProcessArgs& args) override
+    {
+        if (pcontext->variant != kCardinalVariantMain && pcontext->variant != kCardinalVariantMini)
+            return;
+
+        const uint8_t ioOffset = pcontext->variant == kCardinalVariantMini ? 2 : 8;
+        const uint32_t bufferSize = pcontext->bufferSize;
+        const uint32_t frames = args.frames;
+
+        checkProcessCounter();
+
+        // only incremented on output
+        const uint32_t k = dataFrame;
+        DISTRHO_SAFE_ASSERT_INT2_RETURN(k + frames <= bufferSize, k + frames, bufferSize,);
+
+        if (bypassed)
+        {
+            for (int i=0; i<10; ++i)
+                for (uint32_t f=0; f<frames; ++f)
+                    args.outputs[i][f * PORT_MAX_CHANNELS] = 0.0f;
+        }
+        else if (const float* const* const dataIns = pcontext->dataIns)
+        {
+            if (dataIns[ioOffset] == nullptr)
+                return;
+
+            float outputOffset;
+            outputOffset = params[BIPOLAR_OUTPUTS_1_5].getValue() > 0.1f ? 5.f : 0.f;
+
+            for (int i=0; i<5; ++i)
+                for (uint32_t f=0; f<frames; ++f)
+                    args.outputs[i][f * PORT_MAX_CHANNELS] = dataIns[i+ioOffset][k + f] - outputOffset;
+
+            if (pcontext->variant == kCardinalVariantMain)
+            {
+                outputOffset = params[BIPOLAR_OUTPUTS_6_10].getValue() > 0.1f ? 5.f : 0.f;
+
+                for (int i=5; i<10; ++i)
+                    for (uint32_t f=0; f<frames; ++f)
+                        args.outputs[i][f * PORT_MAX_CHANNELS] = dataIns[i+ioOffset][k + f] - outputOffset;
+            }
+            else
+            {
+                for (int i=5; i<10; ++i)
+                    for (uint32_t f=0; f<frames; ++f)
+                        args.outputs[i][f * PORT_MAX_CHANNELS] = 0.0f;
+            }
+        }
+    }
+
+    void processTerminalOutputBlock(const BlockProcessArgs& args) override
+    {
+        if (pcontext->variant != kCardinalVariantMain && pcontext->variant != kCardinalVariantMini)
+            return;
+        if (pcontext->bypassed)
+            return;
+
+        const uint8_t ioOffset = pcontext->variant == kCardinalVariantMini ? 2 : 8;
+        const uint32_t bufferSize = pcontext->bufferSize;
+        const uint32_t frames = args.frames;
+
+        // only incremented on output
+        const uint32_t k = dataFrame;
+        dataFrame += frames;
+        DISTRHO_SAFE_ASSERT_INT2_RETURN(k + frames <= bufferSize, k + frames, bufferSize,);
+
+        if (bypassed)
+            return;
+
+        float** const dataOuts = pcontext->dataOuts;
+
+        if (dataOuts[ioOffset] == nullptr)
+            return;
+
+        const int numInputs = pcontext->variant == kCardinalVariantMain ? 10 : 5;
+
+        for (int i=0; i<numInputs; ++i)
+        {
+            const float inputOffset = params[i < 5 ? BIPOLAR_INPUTS_1_5 : BIPOLAR_INPUTS_6_10].getValue() > 0.1f ? 5.0f : 0.0f;
+
+            for (uint32_t f=0; f<frames; ++f)
+            {
+                if (!std::isfinite(dataOuts[i+ioOffset][k + f]))
+                    __builtin_unreachable();
+                dataOuts[i+ioOffset][k + f] += args.inputs[i][f * PORT_MAX_CHANNELS] + inputOffset;
+            }
+        }
+    }
 };
 
 #ifndef HEADLESS
@@ -79,12 +79,12 @@ struct HostMIDI : TerminalModule {
     struct MidiInput {
         // Cardinal specific
         CardinalPluginContext* const pcontext;
-        midi::Message converterMsg;
         const MidiEvent* midiEvents;
         uint32_t midiEventsLeft;
         uint32_t midiEventFrame;
         uint32_t lastProcessCounter;
         bool wasPlaying;
+        bool programChanges;
         uint8_t channel;
 
         // stuff from Rack
@@ -131,7 +131,6 @@ struct HostMIDI : TerminalModule {
         MidiInput(CardinalPluginContext* const pc)
             : pcontext(pc)
         {
-            converterMsg.bytes.resize(0xff);
             heldNotes.reserve(128);
             for (int c = 0; c < 16; c++) {
                 pwFilters[c].setTau(1 / 30.f);
@@ -147,6 +146,7 @@ struct HostMIDI : TerminalModule {
             midiEventFrame = 0;
             lastProcessCounter = 0;
             wasPlaying = false;
+            programChanges = false;
             channel = 0;
             smooth = false;
             channels = 1;
@@ -234,17 +234,9 @@ struct HostMIDI : TerminalModule {
                 ++midiEvents;
                 --midiEventsLeft;
 
-                const uint8_t* data;
-
-                if (midiEvent.size > MidiEvent::kDataSize)
-                {
-                    data = midiEvent.dataExt;
-                    converterMsg.bytes.resize(midiEvent.size);
-                }
-                else
-                {
-                    data = midiEvent.data;
-                }
+                const uint8_t* const data = midiEvent.size > MidiEvent::kDataSize
+                                          ? midiEvent.dataExt
+                                          : midiEvent.data;
 
                 if (channel != 0 && data[0] < 0xF0)
                 {
@@ -252,10 +244,8 @@ struct HostMIDI : TerminalModule {
                         continue;
                 }
 
-                converterMsg.frame = midiEventFrame;
-                std::memcpy(converterMsg.bytes.data(), data, midiEvent.size);
-
-                processMessage(converterMsg);
+                // read in place, SysEx included, nothing is copied or allocated here
+                processMessage(midi::MessageView(data, midiEvent.size, midiEventFrame));
             }
 
             ++midiEventFrame;
@@ -310,7 +300,7 @@ struct HostMIDI : TerminalModule {
             return processCounterChanged;
         }
 
-        void processMessage(const midi::Message& msg)
+        void processMessage(const midi::MessageView& msg)
         {
             // DEBUG("MIDI: %ld %s", msg.getFrame(), msg.toString().c_str());
 
@@ -344,6 +334,11 @@ struct HostMIDI : TerminalModule {
                 case 0xb: {
                     processCC(msg);
                 } break;
+                // program change, selects a preloaded patch
+                case 0xc: {
+                    if (programChanges)
+                        pcontext->pendingProgram = msg.getNote();
+                } break;
                 // channel pressure
                 case 0xd: {
                     if (polyMode == MPE_MODE) {
@@ -369,7 +364,7 @@ struct HostMIDI : TerminalModule {
             }
         }
 
-        void processCC(const midi::Message& msg) {
+        void processCC(const midi::MessageView& msg) {
             switch (msg.getNote()) {
                 // mod
                 case 0x01: {
@@ -393,7 +388,7 @@ struct HostMIDI : TerminalModule {
             }
         }
 
-        void processSystem(const midi::Message& msg)
+        void processSystem(const midi::MessageView& msg)
         {
             switch (msg.getChannel())
             {
@@ -731,6 +726,7 @@ struct HostMIDI : TerminalModule {
         }
 
         json_object_set_new(rootJ, "inputChannel", json_integer(midiInput.channel));
+        json_object_set_new(rootJ, "programChanges", json_boolean(midiInput.programChanges));
         json_object_set_new(rootJ, "outputChannel", json_integer(midiOutput.channel));
 
         return rootJ;
@@ -765,6 +761,9 @@ struct HostMIDI : TerminalModule {
         if (json_t* const inputChannelJ = json_object_get(rootJ, "inputChannel"))
             midiInput.channel = json_integer_value(inputChannelJ);
 
+        if (json_t* const programChangesJ = json_object_get(rootJ, "programChanges"))
+            midiInput.programChanges = json_boolean_value(programChangesJ);
+
         if (json_t* const outputChannelJ = json_object_get(rootJ, "outputChannel"))
             midiOutput.channel = json_integer_value(outputChannelJ) & 0x0F;
     }
@@ -835,6 +834,8 @@ struct HostMIDIWidget : ModuleWidgetWith9HP {
 
         menu->addChild(createBoolPtrMenuItem("Smooth pitch/mod wheel", "", &module->midiInput.smooth));
 
+        menu->addChild(createBoolPtrMenuItem("Program changes select patch bank", "", &module->midiInput.programChanges));
+
         static const std::vector<float> pwRanges = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 24, 36, 48};
         menu->addChild(createSubmenuItem("Pitch bend range", string::f("%g", module->midiInput.pwRange), [=](Menu* menu) {
             for (size_t i = 0; i < pwRanges.size(); i++) {
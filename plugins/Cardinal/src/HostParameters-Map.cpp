@@ -70,6 +70,7 @@ struct HostParametersMap : TerminalModule {
     bool bypassed = false;
     bool firstRun = true;
     uint32_t lastProcessCounter = 0;
+    uint32_t framesSinceUpdate = 0;
 
     HostParametersMap()
         : pcontext(static_cast<CardinalPluginContext*>(APP))
@@ -129,13 +130,20 @@ struct HostParametersMap : TerminalModule {
     {
         const uint32_t processCounter = pcontext->processCounter;
 
+        // mapped params are updated once per block, smoothing by the time since the previous one
         if (lastProcessCounter == processCounter)
+        {
+            ++framesSinceUpdate;
             return;
+        }
 
         lastProcessCounter = processCounter;
 
         if (isBypassed())
+        {
+            ++framesSinceUpdate;
             return;
+        }
 
         for (uint32_t i = 0; i < kModuleParameterCount; ++i)
         {
@@ -146,6 +154,12 @@ struct HostParametersMap : TerminalModule {
             parametersChanged[i] = true;
         }
 
+        updateMappedParameters(args.sampleTime * framesSinceUpdate);
+        framesSinceUpdate = 1;
+    }
+
+    void updateMappedParameters(const float deltaTime)
+    {
         for (uint id = 0; id < numMappedParmeters; ++id)
         {
             ParamHandle& paramHandle(mappings[id].paramHandle);
@@ -187,7 +201,7 @@ struct HostParametersMap : TerminalModule {
             if (mappings[id].smooth && std::fabs(valueFilters[id].out - value) < 1.f)
             {
                 // Smooth value with filter
-                if (d_isEqual(valueFilters[id].process(args.sampleTime * pcontext->bufferSize, value), value))
+                if (d_isEqual(valueFilters[id].process(deltaTime, value), value))
                 {
                     valueReached[id] = true;
                     continue;
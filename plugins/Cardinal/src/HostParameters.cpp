@@ -37,7 +37,10 @@ struct HostParameters : TerminalModule {
     };
 
     CardinalPluginContext* const pcontext;
-    rack::dsp::SlewLimiter parameters[kModuleParameterCount];
+    float values[kModuleParameterCount];
+    float targets[kModuleParameterCount];
+    float rampSteps[kModuleParameterCount] = {};
+    uint32_t rampFramesLeft[kModuleParameterCount] = {};
     bool parametersConnected[kModuleParameterCount] = {};
     bool bypassed = false;
     bool smooth = true;
@@ -50,12 +53,34 @@ struct HostParameters : TerminalModule {
             throw rack::Exception("Plugin context is null.");
 
         config(NUM_PARAMS, NUM_INPUTS, NUM_OUTPUTS, NUM_LIGHTS);
+
+        std::memcpy(values, pcontext->parameters, sizeof(values));
+        std::memcpy(targets, pcontext->parameters, sizeof(targets));
+    }
+
+    // when smoothing, ramp linearly towards the new value over the length of one host buffer
+    void setTarget(const uint32_t i, const float value)
+    {
+        const uint32_t rampFrames = smooth ? pcontext->bufferSize : 0;
+
+        targets[i] = value;
+
+        if (rampFrames == 0)
+        {
+            values[i] = value;
+            rampFramesLeft[i] = 0;
+            return;
+        }
+
+        rampSteps[i] = (value - values[i]) / rampFrames;
+        rampFramesLeft[i] = rampFrames;
     }
 
-    void processTerminalInput(const ProcessArgs& args) override
+    void processTerminalInput(const ProcessArgs&) override
     {
         const uint32_t processCounter = pcontext->processCounter;
 
+        // host parameter changes are picked up once per block
         if (lastProcessCounter != processCounter)
         {
             bypassed = isBypassed();
@@ -68,36 +93,39 @@ struct HostParameters : TerminalModule {
                 if (parametersConnected[i] != connected)
                 {
                     parametersConnected[i] = connected;
-                    parameters[i].reset();
+                    values[i] = targets[i];
+                    rampFramesLeft[i] = 0;
                 }
+
+                if (d_isNotEqual(pcontext->parameters[i], targets[i]))
+                    setTarget(i, pcontext->parameters[i]);
             }
         }
 
+        for (uint32_t i=0; i<kModuleParameterCount; ++i)
+        {
+            if (rampFramesLeft[i] == 0)
+                continue;
+
+            if (--rampFramesLeft[i] == 0)
+                values[i] = targets[i];
+            else
+                values[i] += rampSteps[i];
+        }
+
         if (bypassed)
             return;
 
         for (uint32_t i=0; i<kModuleParameterCount; ++i)
         {
             if (parametersConnected[i])
-                outputs[i].setVoltage(smooth ? parameters[i].process(args.sampleTime, pcontext->parameters[i])
-                                             : pcontext->parameters[i]);
+                outputs[i].setVoltage(values[i]);
         }
     }
 
     void processTerminalOutput(const ProcessArgs&) override
     {}
 
-    void onSampleRateChange(const SampleRateChangeEvent& e) override
-    {
-        const double fall = 1.0 / (double(pcontext->bufferSize) / e.sampleRate);
-
-        for (uint32_t i=0; i<kModuleParameterCount; ++i)
-        {
-            parameters[i].reset();
-            parameters[i].setRiseFall(fall, fall);
-        }
-    }
-
     // ----------------------------------------------------------------------------------------------------------------
     // save and load json stuff
 
@@ -1370,6 +1370,11 @@ static void initStatic__Fundamental()
         p->addModel(modelSHASR);
         p->addModel(modelUnity);
         p->addModel(modelViz);
+
+        // these only touch their own state while being created and loaded
+        for (Model* const model : p->models)
+            if (CardinalPluginModelHelper* const helper = dynamic_cast<CardinalPluginModelHelper*>(model))
+                helper->parallelLoading = true;
     }
 }
 
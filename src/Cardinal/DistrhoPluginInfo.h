@@ -57,6 +57,7 @@
 #define DISTRHO_PLUGIN_WANT_MIDI_INPUT    1
 #define DISTRHO_PLUGIN_WANT_MIDI_OUTPUT   1
 #define DISTRHO_PLUGIN_WANT_FULL_STATE    1
+#define DISTRHO_PLUGIN_WANT_PROGRAMS      1
 #define DISTRHO_PLUGIN_WANT_STATE         1
 #define DISTRHO_PLUGIN_WANT_TIMEPOS       1
 #define DISTRHO_PLUGIN_USES_CUSTOM_MODGUI 1
@@ -0,0 +1,916 @@
+/*
+ * DISTRHO Cardinal Plugin
+ * Copyright (C) 2021-2024 Filipe Coelho <falktx@falktx.com>
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* Benchmarks the process() call of every module model, one at a time and outside of the engine.
+ * Inputs are fed deterministic test signals, first mono and then with 16 polyphonic channels.
+ * The headless plugin is hosted the same way plugin formats do, so modules find the context they expect.
+ * With --lookups, it instead measures how long the engine takes to find modules, expanders, cables and param handles by ID.
+ * With --patch, it instead runs a generated patch through the engine, timing it along with its cache misses.
+ */
+
+#include <engine/Engine.hpp>
+#include <engine/TerminalModule.hpp>
+#include <plugin.hpp>
+#include <random.hpp>
+#include <system.hpp>
+
+#ifdef NDEBUG
+# undef DEBUG
+#endif
+
+#include "CardinalPluginContext.hpp"
+#include "src/DistrhoPluginInternal.hpp"
+
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <new>
+#include <tuple>
+#include <vector>
+
+#ifdef ARCH_WIN
+# include <windows.h>
+# include <psapi.h>
+#elif defined(ARCH_MAC)
+# include <mach/mach.h>
+#else
+# include <unistd.h>
+#endif
+
+#ifdef ARCH_LIN
+# include <linux/perf_event.h>
+# include <sys/ioctl.h>
+# include <sys/syscall.h>
+#endif
+
+#ifndef HEADLESS
+# error the benchmark is meant for headless builds
+#endif
+
+namespace rack {
+namespace engine {
+void Engine_beginTopologyBatch(Engine*);
+void Engine_endTopologyBatch(Engine*);
+Module* Engine_getScheduledModule(Engine*, int64_t moduleId);
+}
+}
+
+// -----------------------------------------------------------------------------------------------------------
+// Count allocations made through operator new while a module is measured
+
+static std::atomic<bool> gCountAllocations(false);
+static std::atomic<uint64_t> gAllocationCount(0);
+
+void* operator new(const std::size_t size)
+{
+    if (gCountAllocations.load(std::memory_order_relaxed))
+        gAllocationCount.fetch_add(1, std::memory_order_relaxed);
+
+    if (void* const ptr = std::malloc(size != 0 ? size : 1))
+        return ptr;
+
+    throw std::bad_alloc();
+}
+
+void* operator new[](const std::size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void* const ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete[](void* const ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void* const ptr, std::size_t) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete[](void* const ptr, std::size_t) noexcept
+{
+    std::free(ptr);
+}
+
+START_NAMESPACE_DISTRHO
+
+CardinalPluginContext* getRackContextFromPlugin(void* ptr);
+
+// -----------------------------------------------------------------------------------------------------------
+
+/* Current resident memory of the whole process, in KiB. 0 if unknown.
+ * Unlike the peak, it goes down again when a model frees its memory, so the difference around a model is its own.
+ */
+static uint64_t getCurrentRss()
+{
+   #if defined(ARCH_WIN)
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return counters.WorkingSetSize / 1024;
+   #elif defined(ARCH_MAC)
+    mach_task_basic_info_data_t info;
+    mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+    if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, reinterpret_cast<task_info_t>(&info), &count) == KERN_SUCCESS)
+        return info.resident_size / 1024;
+   #else
+    if (FILE* const f = std::fopen("/proc/self/statm", "r"))
+    {
+        unsigned long long size = 0, resident = 0;
+        const int ret = std::fscanf(f, "%llu %llu", &size, &resident);
+        std::fclose(f);
+
+        if (ret == 2)
+            return resident * static_cast<uint64_t>(sysconf(_SC_PAGESIZE)) / 1024;
+    }
+   #endif
+    return 0;
+}
+
+/* Models that talk to the host through the plugin context without being terminal modules.
+ * Like host I/O, what they cost depends on the host and on what is loaded in them rather than on the module.
+ */
+static const char* const kHostDependentModels[] = {
+    "Cardinal/AudioFile",
+    "Cardinal/Carla",
+    "Cardinal/Ildaeil",
+    "Cardinal/MPV",
+};
+
+static bool isHostDependent(rack::plugin::Model* const model)
+{
+    const std::string slug = model->plugin->slug + "/" + model->slug;
+
+    // known ones are not even created, their constructor might already need the host
+    for (const char* const hostSlug : kHostDependentModels)
+        if (slug == hostSlug)
+            return true;
+
+    rack::engine::Module* const module = model->createModule();
+    const bool isTerminal = dynamic_cast<rack::engine::TerminalModule*>(module) != nullptr;
+    delete module;
+
+    return isTerminal;
+}
+
+/* Writes the test signal of an input channel at `frame`.
+ * Inputs cycle through an audio rate sine, a gate and a slow triangle, each channel a little higher than the previous one.
+ */
+static float getTestSignal(const int input, const int channel, const int64_t frame, const float sampleTime)
+{
+    const double time = frame * static_cast<double>(sampleTime);
+    const double detune = 1.0 + channel / 16.0;
+
+    switch (input % 3)
+    {
+    case 0:
+        return 5.f * std::sin(2.0 * M_PI * 220.0 * detune * time);
+    case 1:
+        return std::fmod(4.0 * detune * time, 1.0) < 0.5 ? 10.f : 0.f;
+    default:
+        return 10.f * std::fabs(2.0 * std::fmod(0.5 * detune * time, 1.0) - 1.0) - 5.f;
+    }
+}
+
+// -----------------------------------------------------------------------------------------------------------
+
+struct BenchOptions {
+    const char* outputPath = nullptr;
+    const char* filter = nullptr;
+    bool json = false;
+    double sampleRate = 48000.0;
+    double duration = 1.0;
+    int repeats = 5;
+    int lookups = 0;
+    int patch = 0;
+};
+
+struct BenchResult {
+    std::string plugin;
+    std::string model;
+    int channels;
+    double nsPerFrame;
+    uint64_t allocations;
+    int64_t rssGrowth;
+};
+
+/* Runs a model for `options.duration` seconds of audio, split in repeats.
+ * The fastest repeat is kept, which is the most stable figure between runs.
+ */
+static BenchResult benchmarkModel(rack::plugin::Model* const model, const int channels, const BenchOptions& options)
+{
+    BenchResult result = { model->plugin->slug, model->slug, channels, 0.0, 0, 0 };
+
+    // same random sequence on every run
+    rack::random::local().seed(1, 2);
+
+    const uint64_t rssBefore = getCurrentRss();
+
+    rack::engine::Module* const module = model->createModule();
+    DISTRHO_SAFE_ASSERT_RETURN(module != nullptr, result);
+
+    rack::engine::Module::AddEvent addEvent;
+    module->onAdd(addEvent);
+
+    rack::engine::Module::SampleRateChangeEvent sampleRateEvent;
+    sampleRateEvent.sampleRate = options.sampleRate;
+    sampleRateEvent.sampleTime = 1.f / options.sampleRate;
+    module->onSampleRateChange(sampleRateEvent);
+
+    for (rack::engine::Input& input : module->inputs)
+        input.setChannels(channels);
+
+    rack::engine::Module::ProcessArgs args;
+    args.sampleRate = options.sampleRate;
+    args.sampleTime = 1.f / options.sampleRate;
+    args.frame = 0;
+
+    const auto processFrames = [&](const int64_t frames) {
+        for (int64_t i = 0; i < frames; ++i, ++args.frame)
+        {
+            for (size_t j = 0; j < module->inputs.size(); ++j)
+                for (int c = 0; c < channels; ++c)
+                    module->inputs[j].setVoltage(getTestSignal(j, c, args.frame, args.sampleTime), c);
+
+            module->process(args);
+        }
+    };
+
+    // let modules settle and allocate lazily before measuring
+    processFrames(options.sampleRate / 10);
+
+    const int64_t frames = std::max<int64_t>(1, options.duration * options.sampleRate / options.repeats);
+    double bestTime = INFINITY;
+
+    gAllocationCount.store(0, std::memory_order_relaxed);
+    gCountAllocations.store(true, std::memory_order_relaxed);
+
+    for (int i = 0; i < options.repeats; ++i)
+    {
+        const double startTime = rack::system::getTime();
+        processFrames(frames);
+        bestTime = std::min(bestTime, rack::system::getTime() - startTime);
+    }
+
+    gCountAllocations.store(false, std::memory_order_relaxed);
+
+    result.nsPerFrame = bestTime * 1e9 / frames;
+    result.allocations = gAllocationCount.load(std::memory_order_relaxed);
+    // measured before deleting the module, so it includes whatever it allocated while processing
+    result.rssGrowth = static_cast<int64_t>(getCurrentRss()) - static_cast<int64_t>(rssBefore);
+
+    rack::engine::Module::RemoveEvent removeEvent;
+    module->onRemove(removeEvent);
+    delete module;
+
+    return result;
+}
+
+static void writeResults(FILE* const file, const std::vector<BenchResult>& results, const bool json)
+{
+    if (json)
+    {
+        json_t* const rootJ = json_array();
+
+        for (const BenchResult& result : results)
+        {
+            json_t* const resultJ = json_object();
+            json_object_set_new(resultJ, "plugin", json_string(result.plugin.c_str()));
+            json_object_set_new(resultJ, "model", json_string(result.model.c_str()));
+            json_object_set_new(resultJ, "channels", json_integer(result.channels));
+            json_object_set_new(resultJ, "nsPerFrame", json_real(result.nsPerFrame));
+            json_object_set_new(resultJ, "allocations", json_integer(result.allocations));
+            json_object_set_new(resultJ, "rssGrowthKiB", json_integer(result.rssGrowth));
+            json_array_append_new(rootJ, resultJ);
+        }
+
+        json_dumpf(rootJ, file, JSON_INDENT(2));
+        std::fputc('\n', file);
+        json_decref(rootJ);
+        return;
+    }
+
+    std::fprintf(file, "plugin,model,channels,nsPerFrame,allocations,rssGrowthKiB\n");
+
+    for (const BenchResult& result : results)
+        std::fprintf(file, "%s,%s,%d,%.1f,%llu,%lld\n",
+                     result.plugin.c_str(), result.model.c_str(), result.channels, result.nsPerFrame,
+                     static_cast<unsigned long long>(result.allocations),
+                     static_cast<long long>(result.rssGrowth));
+}
+
+// -----------------------------------------------------------------------------------------------------------
+// Engine ID lookups
+
+struct LookupResult {
+    const char* lookup;
+    size_t entries;
+    double nsPerLookup;
+    double stdMapNsPerLookup;
+};
+
+/* Times `find(key)` over all `keys`, in a shuffled order so that consecutive lookups do not share cache lines.
+ * The fastest of `options.repeats` runs is kept.
+ */
+template <typename Key, typename Find>
+static double benchmarkLookups(std::vector<Key> keys, const Find& find, const BenchOptions& options)
+{
+    if (keys.empty())
+        return 0.0;
+
+    for (size_t i = keys.size(); i > 1; --i)
+        std::swap(keys[i - 1], keys[rack::random::u32() % i]);
+
+    // enough passes for the timer resolution to not matter
+    const int passes = std::max<int>(1, 1000000 / keys.size());
+    double bestTime = INFINITY;
+    uintptr_t found = 0;
+
+    for (int i = 0; i < options.repeats; ++i)
+    {
+        const double startTime = rack::system::getTime();
+
+        for (int j = 0; j < passes; ++j)
+            for (const Key& key : keys)
+                found += reinterpret_cast<uintptr_t>(find(key));
+
+        bestTime = std::min(bestTime, rack::system::getTime() - startTime);
+    }
+
+    // keeps lookups from being optimized away
+    if (found == 1)
+        std::fputc('\0', stderr);
+
+    return bestTime * 1e9 / (static_cast<double>(passes) * keys.size());
+}
+
+/* Adds `options.lookups` modules of `model` to the engine, chained by cables and each with a mapped param,
+ * then compares engine lookups against a std::map holding the same IDs.
+ */
+static std::vector<LookupResult> benchmarkEngineLookups(rack::engine::Engine* const engine,
+                                                        rack::plugin::Model* const model,
+                                                        const BenchOptions& options)
+{
+    std::vector<rack::engine::Module*> modules;
+    std::vector<rack::engine::Cable*> cables;
+    std::vector<rack::engine::ParamHandle*> paramHandles;
+
+    rack::engine::Engine_beginTopologyBatch(engine);
+
+    for (int i = 0; i < options.lookups; ++i)
+    {
+        rack::engine::Module* const module = model->createModule();
+        engine->addModule(module);
+
+        rack::engine::ParamHandle* const paramHandle = new rack::engine::ParamHandle;
+        engine->addParamHandle(paramHandle);
+        engine->updateParamHandle(paramHandle, module->id, 0, true);
+
+        if (! modules.empty())
+        {
+            rack::engine::Cable* const cable = new rack::engine::Cable;
+            cable->outputModule = modules.back();
+            cable->outputId = 0;
+            cable->inputModule = module;
+            cable->inputId = 0;
+            engine->addCable(cable);
+            cables.push_back(cable);
+        }
+
+        modules.push_back(module);
+        paramHandles.push_back(paramHandle);
+    }
+
+    rack::engine::Engine_endTopologyBatch(engine);
+
+    std::vector<int64_t> moduleIds, cableIds;
+    std::vector<std::tuple<int64_t, int>> paramKeys;
+    std::map<int64_t, rack::engine::Module*> moduleMap;
+    std::map<int64_t, rack::engine::Cable*> cableMap;
+    std::map<std::tuple<int64_t, int>, rack::engine::ParamHandle*> paramMap;
+
+    for (rack::engine::Module* const module : modules)
+    {
+        moduleIds.push_back(module->id);
+        paramKeys.push_back(std::make_tuple(module->id, 0));
+        moduleMap[module->id] = module;
+    }
+
+    for (rack::engine::Cable* const cable : cables)
+    {
+        cableIds.push_back(cable->id);
+        cableMap[cable->id] = cable;
+    }
+
+    for (rack::engine::ParamHandle* const paramHandle : paramHandles)
+        paramMap[std::make_tuple(paramHandle->moduleId, paramHandle->paramId)] = paramHandle;
+
+    std::vector<LookupResult> results;
+
+    results.push_back({ "module", moduleIds.size(),
+        benchmarkLookups(moduleIds, [engine](const int64_t id) {
+            return engine->getModule_NoLock(id);
+        }, options),
+        benchmarkLookups(moduleIds, [&moduleMap](const int64_t id) {
+            return moduleMap.find(id)->second;
+        }, options) });
+
+    // what the audio thread does when an expander changes, through the schedule instead of the engine
+    results.push_back({ "expander", moduleIds.size(),
+        benchmarkLookups(moduleIds, [engine](const int64_t id) {
+            return rack::engine::Engine_getScheduledModule(engine, id);
+        }, options),
+        benchmarkLookups(moduleIds, [&moduleMap](const int64_t id) {
+            return moduleMap.find(id)->second;
+        }, options) });
+
+    // getCable() always takes the engine lock, so it costs more than the lookup alone
+    results.push_back({ "cable", cableIds.size(),
+        benchmarkLookups(cableIds, [engine](const int64_t id) {
+            return engine->getCable(id);
+        }, options),
+        benchmarkLookups(cableIds, [&cableMap](const int64_t id) {
+            return cableMap.find(id)->second;
+        }, options) });
+
+    results.push_back({ "paramHandle", paramKeys.size(),
+        benchmarkLookups(paramKeys, [engine](const std::tuple<int64_t, int>& key) {
+            return engine->getParamHandle_NoLock(std::get<0>(key), std::get<1>(key));
+        }, options),
+        benchmarkLookups(paramKeys, [&paramMap](const std::tuple<int64_t, int>& key) {
+            return paramMap.find(key)->second;
+        }, options) });
+
+    rack::engine::Engine_beginTopologyBatch(engine);
+
+    for (rack::engine::ParamHandle* const paramHandle : paramHandles)
+    {
+        engine->removeParamHandle(paramHandle);
+        delete paramHandle;
+    }
+
+    for (rack::engine::Cable* const cable : cables)
+    {
+        engine->removeCable(cable);
+        delete cable;
+    }
+
+    for (rack::engine::Module* const module : modules)
+    {
+        engine->removeModule(module);
+        delete module;
+    }
+
+    rack::engine::Engine_endTopologyBatch(engine);
+
+    return results;
+}
+
+static void writeLookupResults(FILE* const file, const std::vector<LookupResult>& results, const bool json)
+{
+    if (json)
+    {
+        json_t* const rootJ = json_array();
+
+        for (const LookupResult& result : results)
+        {
+            json_t* const resultJ = json_object();
+            json_object_set_new(resultJ, "lookup", json_string(result.lookup));
+            json_object_set_new(resultJ, "entries", json_integer(result.entries));
+            json_object_set_new(resultJ, "nsPerLookup", json_real(result.nsPerLookup));
+            json_object_set_new(resultJ, "stdMapNsPerLookup", json_real(result.stdMapNsPerLookup));
+            json_array_append_new(rootJ, resultJ);
+        }
+
+        json_dumpf(rootJ, file, JSON_INDENT(2));
+        std::fputc('\n', file);
+        json_decref(rootJ);
+        return;
+    }
+
+    std::fprintf(file, "lookup,entries,nsPerLookup,stdMapNsPerLookup\n");
+
+    for (const LookupResult& result : results)
+        std::fprintf(file, "%s,%llu,%.1f,%.1f\n",
+                     result.lookup, static_cast<unsigned long long>(result.entries),
+                     result.nsPerLookup, result.stdMapNsPerLookup);
+}
+
+// -----------------------------------------------------------------------------------------------------------
+// Generated patch
+
+struct PatchResult {
+    std::string plugin;
+    std::string model;
+    int modules;
+    double nsPerFrame;
+    // -1 if hardware counters are not available
+    double cacheMissesPerFrame;
+};
+
+/* Counts the cache misses of the calling thread through Linux perf events.
+ * Not available on other systems, nor where perf events are restricted, see /proc/sys/kernel/perf_event_paranoid.
+ */
+struct CacheMissCounter {
+   #ifdef ARCH_LIN
+    int fd;
+
+    CacheMissCounter()
+    {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+
+    ~CacheMissCounter()
+    {
+        if (fd >= 0)
+            close(fd);
+    }
+
+    bool isValid() const
+    {
+        return fd >= 0;
+    }
+
+    void start()
+    {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+
+    int64_t stop()
+    {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        int64_t count = 0;
+        return read(fd, &count, sizeof(count)) == sizeof(count) ? count : -1;
+    }
+   #else
+    bool isValid() const { return false; }
+    void start() {}
+    int64_t stop() { return -1; }
+   #endif
+};
+
+/* Adds `options.patch` modules of `model` to the engine and chains them by cables in a shuffled order,
+ * so that, like in a patch edited over time, the order they are processed in has nothing to do with where they were allocated.
+ * Then steps the engine in blocks of 256 frames, keeping the fastest repeat.
+ */
+static PatchResult benchmarkEnginePatch(rack::engine::Engine* const engine,
+                                        rack::plugin::Model* const model,
+                                        const BenchOptions& options)
+{
+    PatchResult result = { model->plugin->slug, model->slug, options.patch, 0.0, -1.0 };
+
+    // same patch on every run
+    rack::random::local().seed(1, 2);
+
+    std::vector<rack::engine::Module*> modules;
+    std::vector<rack::engine::Cable*> cables;
+
+    rack::engine::Engine_beginTopologyBatch(engine);
+
+    for (int i = 0; i < options.patch; ++i)
+    {
+        rack::engine::Module* const module = model->createModule();
+        engine->addModule(module);
+        modules.push_back(module);
+    }
+
+    std::vector<rack::engine::Module*> chain = modules;
+
+    for (size_t i = chain.size(); i > 1; --i)
+        std::swap(chain[i - 1], chain[rack::random::u32() % i]);
+
+    for (size_t i = 1; i < chain.size(); ++i)
+    {
+        rack::engine::Cable* const cable = new rack::engine::Cable;
+        cable->outputModule = chain[i - 1];
+        cable->outputId = 0;
+        cable->inputModule = chain[i];
+        cable->inputId = 0;
+        engine->addCable(cable);
+        cables.push_back(cable);
+    }
+
+    rack::engine::Engine_endTopologyBatch(engine);
+
+    static constexpr const int blockFrames = 256;
+
+    // let modules settle and allocate lazily before measuring
+    for (int64_t i = 0; i < options.sampleRate / 10; i += blockFrames)
+        engine->stepBlock(blockFrames);
+
+    const int64_t blocks = std::max<int64_t>(1, options.duration * options.sampleRate / options.repeats / blockFrames);
+    const int64_t frames = blocks * blockFrames;
+    CacheMissCounter cacheMissCounter;
+    double bestTime = INFINITY;
+
+    for (int i = 0; i < options.repeats; ++i)
+    {
+        if (cacheMissCounter.isValid())
+            cacheMissCounter.start();
+
+        const double startTime = rack::system::getTime();
+
+        for (int64_t j = 0; j < blocks; ++j)
+            engine->stepBlock(blockFrames);
+
+        const double time = rack::system::getTime() - startTime;
+
+        if (cacheMissCounter.isValid())
+        {
+            const int64_t cacheMisses = cacheMissCounter.stop();
+
+            if (cacheMisses >= 0 && (result.cacheMissesPerFrame < 0.0 || cacheMisses < result.cacheMissesPerFrame * frames))
+                result.cacheMissesPerFrame = static_cast<double>(cacheMisses) / frames;
+        }
+
+        bestTime = std::min(bestTime, time);
+    }
+
+    result.nsPerFrame = bestTime * 1e9 / frames;
+
+    rack::engine::Engine_beginTopologyBatch(engine);
+
+    for (rack::engine::Cable* const cable : cables)
+    {
+        engine->removeCable(cable);
+        delete cable;
+    }
+
+    for (rack::engine::Module* const module : modules)
+    {
+        engine->removeModule(module);
+        delete module;
+    }
+
+    rack::engine::Engine_endTopologyBatch(engine);
+
+    return result;
+}
+
+static void writePatchResult(FILE* const file, const PatchResult& result, const bool json)
+{
+    if (json)
+    {
+        json_t* const resultJ = json_object();
+        json_object_set_new(resultJ, "plugin", json_string(result.plugin.c_str()));
+        json_object_set_new(resultJ, "model", json_string(result.model.c_str()));
+        json_object_set_new(resultJ, "modules", json_integer(result.modules));
+        json_object_set_new(resultJ, "nsPerFrame", json_real(result.nsPerFrame));
+
+        if (result.cacheMissesPerFrame >= 0.0)
+            json_object_set_new(resultJ, "cacheMissesPerFrame", json_real(result.cacheMissesPerFrame));
+        else
+            json_object_set_new(resultJ, "cacheMissesPerFrame", json_null());
+
+        json_dumpf(resultJ, file, JSON_INDENT(2));
+        std::fputc('\n', file);
+        json_decref(resultJ);
+        return;
+    }
+
+    std::fprintf(file, "plugin,model,modules,nsPerFrame,cacheMissesPerFrame\n");
+
+    if (result.cacheMissesPerFrame >= 0.0)
+        std::fprintf(file, "%s,%s,%d,%.1f,%.2f\n",
+                     result.plugin.c_str(), result.model.c_str(), result.modules, result.nsPerFrame, result.cacheMissesPerFrame);
+    else
+        std::fprintf(file, "%s,%s,%d,%.1f,\n",
+                     result.plugin.c_str(), result.model.c_str(), result.modules, result.nsPerFrame);
+}
+
+// -----------------------------------------------------------------------------------------------------------
+// Plugin callbacks, nothing is processed through the plugin itself
+
+static bool writeMidiCallback(void*, const MidiEvent&)
+{
+    return true;
+}
+
+static bool requestParameterValueChangeCallback(void*, uint32_t, float)
+{
+    return false;
+}
+
+static bool updateStateValueCallback(void*, const char*, const char*)
+{
+    return false;
+}
+
+// -----------------------------------------------------------------------------------------------------------
+
+static void printUsage(const char* const name)
+{
+    std::printf("Usage: %s [options]\n"
+                "\n"
+                "Measures the process() call of every module, with mono and then 16 channel polyphonic inputs.\n"
+                "Results are written as CSV or JSON, with the time per frame of the fastest repeat,\n"
+                "the number of allocations made through operator new while measuring\n"
+                "and how much the resident memory of the process grew from creating the module to the end of its measurement.\n"
+                "Modules exchanging data with the host or hosting plugins (Carla, Ildaeil...) are skipped.\n"
+                "\n"
+                "  -o, --output <file>          write results there instead of the standard output\n"
+                "  -j, --json                   write results as JSON instead of CSV\n"
+                "  -m, --model <text>           only run models whose \"plugin/model\" slug contains it\n"
+                "  -r, --sample-rate <Hz>       sample rate, defaults to 48000\n"
+                "  -d, --duration <seconds>     audio measured per model and channel count, defaults to 1\n"
+                "  -n, --repeats <count>        number of runs the duration is split in, defaults to 5\n"
+                "  -l, --lookups <count>        instead time engine lookups with that many modules, cables and param handles,\n"
+                "                               using the first model matching --model that has an input, an output and a param\n"
+                "  -p, --patch <count>          instead run a generated patch of that many modules of the same model, chained by cables,\n"
+                "                               and report its time per frame and cache misses per frame (Linux only)\n"
+                "  -h, --help                   show this help\n",
+                name);
+}
+
+static bool parseOptions(const int argc, char* argv[], BenchOptions& options)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        const char* const arg = argv[i];
+        const char* const value = i + 1 < argc ? argv[i + 1] : nullptr;
+
+        const auto matches = [arg](const char* const shortName, const char* const longName) {
+            return std::strcmp(arg, shortName) == 0 || std::strcmp(arg, longName) == 0;
+        };
+
+        if (matches("-h", "--help"))
+            return false;
+
+        if (matches("-j", "--json"))
+        {
+            options.json = true;
+            continue;
+        }
+
+        if (value == nullptr)
+            return false;
+        ++i;
+
+        if (matches("-o", "--output"))
+            options.outputPath = value;
+        else if (matches("-m", "--model"))
+            options.filter = value;
+        else if (matches("-r", "--sample-rate"))
+            options.sampleRate = std::atof(value);
+        else if (matches("-d", "--duration"))
+            options.duration = std::atof(value);
+        else if (matches("-n", "--repeats"))
+            options.repeats = std::atoi(value);
+        else if (matches("-l", "--lookups"))
+            options.lookups = std::atoi(value);
+        else if (matches("-p", "--patch"))
+            options.patch = std::atoi(value);
+        else
+            return false;
+    }
+
+    return options.sampleRate > 0.0 && options.duration > 0.0 && options.repeats > 0 && options.lookups >= 0 && options.patch >= 0;
+}
+
+static int benchmark(const BenchOptions& options)
+{
+    d_nextBufferSize = 256;
+    d_nextSampleRate = options.sampleRate;
+
+    // sets up the context and registers all static plugins
+    PluginExporter plugin(nullptr, writeMidiCallback, requestParameterValueChangeCallback, updateStateValueCallback);
+    CardinalPluginContext* const context = getRackContextFromPlugin(plugin.getInstancePointer());
+
+    FILE* const file = options.outputPath != nullptr ? std::fopen(options.outputPath, "w") : stdout;
+
+    if (file == nullptr)
+    {
+        d_stderr("Could not write output file %s", options.outputPath);
+        return 1;
+    }
+
+    rack::contextSet(context);
+
+    if (options.lookups != 0 || options.patch != 0)
+    {
+        // first model that can be chained by cables and mapped
+        rack::plugin::Model* chainModel = nullptr;
+        std::string slug;
+
+        for (rack::plugin::Plugin* const p : rack::plugin::plugins)
+        {
+            for (rack::plugin::Model* const model : p->models)
+            {
+                slug = p->slug + "/" + model->slug;
+
+                if (options.filter != nullptr && slug.find(options.filter) == std::string::npos)
+                    continue;
+
+                if (isHostDependent(model))
+                    continue;
+
+                rack::engine::Module* const module = model->createModule();
+                const bool usable = !module->inputs.empty() && !module->outputs.empty() && !module->params.empty();
+                delete module;
+
+                if (usable)
+                {
+                    chainModel = model;
+                    break;
+                }
+            }
+
+            if (chainModel != nullptr)
+                break;
+        }
+
+        if (chainModel == nullptr)
+        {
+            d_stderr("No model matches");
+        }
+        else if (options.lookups != 0)
+        {
+            d_stderr("Running lookups with %d %s modules", options.lookups, slug.c_str());
+            writeLookupResults(file, benchmarkEngineLookups(context->engine, chainModel, options), options.json);
+        }
+        else
+        {
+            d_stderr("Running a patch of %d %s modules", options.patch, slug.c_str());
+            writePatchResult(file, benchmarkEnginePatch(context->engine, chainModel, options), options.json);
+        }
+
+        rack::contextSet(nullptr);
+
+        if (file != stdout)
+            std::fclose(file);
+
+        return chainModel != nullptr ? 0 : 1;
+    }
+
+    std::vector<BenchResult> results;
+
+    for (rack::plugin::Plugin* const p : rack::plugin::plugins)
+    {
+        for (rack::plugin::Model* const model : p->models)
+        {
+            const std::string slug = p->slug + "/" + model->slug;
+
+            if (options.filter != nullptr && slug.find(options.filter) == std::string::npos)
+                continue;
+
+            // skip host I/O and plugin hosts, their cost depends on the host rather than on the module
+            if (isHostDependent(model))
+            {
+                d_stderr("Skipping %s", slug.c_str());
+                continue;
+            }
+
+            d_stderr("Running %s", slug.c_str());
+
+            results.push_back(benchmarkModel(model, 1, options));
+            results.push_back(benchmarkModel(model, 16, options));
+        }
+    }
+
+    rack::contextSet(nullptr);
+
+    writeResults(file, results, options.json);
+
+    if (file != stdout)
+        std::fclose(file);
+
+    return 0;
+}
+
+// -----------------------------------------------------------------------------------------------------------
+
+END_NAMESPACE_DISTRHO
+
+int main(int argc, char* argv[])
+{
+    USE_NAMESPACE_DISTRHO;
+
+    BenchOptions options;
+
+    if (! parseOptions(argc, argv, options))
+    {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    return benchmark(options);
+}
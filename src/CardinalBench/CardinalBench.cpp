@@ -0,0 +1 @@
+../CardinalBench.cpp
\ No newline at end of file
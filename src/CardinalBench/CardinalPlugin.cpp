@@ -0,0 +1 @@
+../CardinalPlugin.cpp
\ No newline at end of file
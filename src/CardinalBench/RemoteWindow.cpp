@@ -0,0 +1 @@
+../custom/RemoteWindow.cpp
\ No newline at end of file
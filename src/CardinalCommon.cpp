@@ -19,6 +19,7 @@
 #include "AsyncDialog.hpp"
 #include "CardinalPluginContext.hpp"
 #include "DistrhoPluginUtils.hpp"
+#include "extra/Sleep.hpp"
 
 #include <asset.hpp>
 #include <context.hpp>
@@ -56,6 +57,10 @@
 # include <fstream>
 #endif
 
+// for in-memory patch archives
+#include <archive.h>
+#include <archive_entry.h>
+
 #ifdef HAVE_LIBLO
 # include <lo/lo.h>
 #endif
@@ -97,6 +102,11 @@ namespace plugin {
 void initStaticPlugins();
 void destroyStaticPlugins();
 }
+namespace engine {
+void Engine_stagePatch(Engine* engine, json_t* rootJ);
+void Engine_discardStagedPatch(Engine* engine, json_t* rootJ);
+bool Engine_isPatchStaged(Engine* engine, json_t* rootJ);
+}
 }
 
 const std::string CARDINAL_VERSION = "24.12";
@@ -162,6 +172,11 @@ CardinalPluginContext::CardinalPluginContext(Plugin* const p)
       dataOuts(nullptr),
       midiEvents(nullptr),
       midiEventCount(0),
+      midiInputDroppedEventCount(0),
+      patchFadeCounter(0),
+      offloadLatency(0),
+      midiOutput(nullptr),
+      pendingProgram(-1),
       plugin(p),
       tlw(nullptr),
       ui(nullptr)
@@ -204,9 +219,9 @@ void CardinalPluginContext::writeMidiMessage(const rack::midi::Message& message,
     const size_t size = message.bytes.size();
     DISTRHO_SAFE_ASSERT_RETURN(size > 0,);
     DISTRHO_SAFE_ASSERT_RETURN(message.frame >= 0,);
+    DISTRHO_SAFE_ASSERT_RETURN(midiOutput != nullptr,);
 
-    MidiEvent event;
-    event.frame = message.frame;
+    uint32_t eventSize;
 
     switch (message.bytes[0] & 0xF0)
     {
@@ -215,11 +230,11 @@ void CardinalPluginContext::writeMidiMessage(const rack::midi::Message& message,
     case 0xA0:
     case 0xB0:
     case 0xE0:
-        event.size = 3;
+        eventSize = 3;
         break;
     case 0xC0:
     case 0xD0:
-        event.size = 2;
+        eventSize = 2;
         break;
     case 0xF0:
         switch (message.bytes[0] & 0x0F)
@@ -228,23 +243,25 @@ void CardinalPluginContext::writeMidiMessage(const rack::midi::Message& message,
         case 0x4:
         case 0x5:
         case 0x7:
-        case 0x9:
-        case 0xD:
-            // unsupported
-            return;
+            // SysEx, its continuation packets and undefined system common messages, sent as they are
+            DISTRHO_SAFE_ASSERT_RETURN(size <= kMidiOutputDataSize,);
+            eventSize = static_cast<uint32_t>(size);
+            break;
         case 0x1:
         case 0x2:
         case 0x3:
         case 0xE:
-            event.size = 3;
+            eventSize = 3;
             break;
         case 0x6:
         case 0x8:
+        case 0x9:
         case 0xA:
         case 0xB:
         case 0xC:
+        case 0xD:
         case 0xF:
-            event.size = 1;
+            eventSize = 1;
             break;
         }
         break;
@@ -253,14 +270,42 @@ void CardinalPluginContext::writeMidiMessage(const rack::midi::Message& message,
         return;
     }
 
-    DISTRHO_SAFE_ASSERT_RETURN(size >= event.size,);
+    DISTRHO_SAFE_ASSERT_RETURN(size >= eventSize,);
+
+    // the output arena is full for this host buffer, drop the message
+    if (midiOutput->eventCount == kMidiOutputEventCount)
+    {
+        ++midiOutput->droppedEventCount;
+        return;
+    }
+
+    MidiEvent& event(midiOutput->events[midiOutput->eventCount]);
+
+    if (eventSize > MidiEvent::kDataSize)
+    {
+        if (midiOutput->dataSize + eventSize > kMidiOutputDataSize)
+        {
+            ++midiOutput->droppedEventCount;
+            return;
+        }
 
-    std::memcpy(event.data, message.bytes.data(), event.size);
+        uint8_t* const data = midiOutput->data + midiOutput->dataSize;
+        std::memcpy(data, message.bytes.data(), eventSize);
+        event.dataExt = data;
+        midiOutput->dataSize += eventSize;
+    }
+    else
+    {
+        std::memcpy(event.data, message.bytes.data(), eventSize);
+        event.dataExt = nullptr;
 
-    if (channel != 0 && event.data[0] < 0xF0)
-        event.data[0] |= channel & 0x0F;
+        if (channel != 0 && event.data[0] < 0xF0)
+            event.data[0] |= channel & 0x0F;
+    }
 
-    plugin->writeMidiEvent(event);
+    event.frame = midiOutput->frameOffset + static_cast<uint32_t>(message.frame);
+    event.size = eventSize;
+    ++midiOutput->eventCount;
 }
 
 // -----------------------------------------------------------------------------------------------------------
@@ -284,7 +329,7 @@ InputQueue::~InputQueue() {
     delete internal;
 }
 
-bool InputQueue::tryPop(Message* const messageOut, int64_t maxFrame)
+bool InputQueue::tryPop(MessageView* const viewOut, int64_t maxFrame)
 {
     const uint32_t processCounter = internal->pcontext->processCounter;
     const bool processCounterChanged = internal->lastProcessCounter != processCounter;
@@ -302,31 +347,34 @@ bool InputQueue::tryPop(Message* const messageOut, int64_t maxFrame)
         return false;
 
     const uint32_t frame = maxFrame - internal->lastBlockFrame;
-
-    if (frame > internal->midiEvents->frame)
-        return false;
-
     const CardinalDISTRHO::MidiEvent& midiEvent(*internal->midiEvents);
 
-    const uint8_t* data;
-    if (midiEvent.size > CardinalDISTRHO::MidiEvent::kDataSize)
-    {
-        data = midiEvent.dataExt;
-        messageOut->bytes.resize(midiEvent.size);
-    }
-    else
-    {
-        data = midiEvent.data;
-    }
+    // not due yet
+    if (midiEvent.frame > frame)
+        return false;
 
-    messageOut->frame = frame;
-    std::memcpy(messageOut->bytes.data(), data, midiEvent.size);
+    viewOut->bytes = midiEvent.size > CardinalDISTRHO::MidiEvent::kDataSize ? midiEvent.dataExt : midiEvent.data;
+    viewOut->size = midiEvent.size;
+    viewOut->frame = midiEvent.frame;
 
     ++internal->midiEvents;
     --internal->midiEventsLeft;
     return true;
 }
 
+bool InputQueue::tryPop(Message* const messageOut, int64_t maxFrame)
+{
+    MessageView view;
+
+    if (! tryPop(&view, maxFrame))
+        return false;
+
+    messageOut->frame = view.frame;
+    messageOut->bytes.resize(view.size);
+    std::memcpy(messageOut->bytes.data(), view.bytes, view.size);
+    return true;
+}
+
 json_t* InputQueue::toJson() const
 {
     return nullptr;
@@ -1036,11 +1084,30 @@ void loadDialog()
 #endif
 }
 
+#ifndef HEADLESS_BEHAVIOUR
+// same as rack::patch::Manager::loadAction, but with the new patch built before it replaces the current one
+static void loadPathAction(const std::string& path)
+{
+    try {
+        loadFromFile(path);
+    }
+    catch (Exception& e) {
+        WARN("Could not load patch: %s", e.what());
+        asyncDialog::create(string::f("Could not load patch: %s", e.what()).c_str());
+        return;
+    }
+
+    APP->patch->path = path;
+    APP->history->setSaved();
+    APP->patch->pushRecentPath(path);
+}
+#endif
+
 void loadPathDialog(const std::string& path, const bool asTemplate)
 {
 #ifndef HEADLESS_BEHAVIOUR
     promptClear("The current patch is unsaved. Clear it and open the new patch?", [path, asTemplate]() {
-        APP->patch->loadAction(path);
+        loadPathAction(path);
 
         if (asTemplate)
         {
@@ -1094,7 +1161,7 @@ void loadSelectionDialog()
 void loadTemplate(const bool factory)
 {
     try {
-        APP->patch->load(factory ? APP->patch->factoryTemplatePath : APP->patch->templatePath);
+        loadFromFile(factory ? APP->patch->factoryTemplatePath : APP->patch->templatePath);
     }
     catch (Exception& e) {
         // if user template failed, try the factory one
@@ -1137,7 +1204,7 @@ void revertDialog()
     if (APP->patch->path.empty())
         return;
     promptClear("Revert patch to the last saved state?", []{
-        APP->patch->loadAction(APP->patch->path);
+        loadPathAction(APP->patch->path);
 
        #ifdef DISTRHO_OS_WASM
         syncfs();
@@ -1252,6 +1319,320 @@ void openBrowser(const std::string& url)
 #endif
 }
 
+static la_ssize_t archiveWriteCallback(struct archive*, void* const userData, const void* const buffer, const size_t length)
+{
+    std::vector<uint8_t>& data(*static_cast<std::vector<uint8_t>*>(userData));
+    const uint8_t* const bytes = static_cast<const uint8_t*>(buffer);
+    data.insert(data.end(), bytes, bytes + length);
+    return length;
+}
+
+static void archiveWriteEntry(struct archive* const a, const std::string& path, const uint8_t* const data, const size_t size)
+{
+    struct archive_entry* const entry = archive_entry_new();
+    DEFER({
+        archive_entry_free(entry);
+    });
+
+    archive_entry_set_pathname(entry, path.c_str());
+
+    if (data != nullptr)
+    {
+        archive_entry_set_filetype(entry, AE_IFREG);
+        archive_entry_set_perm(entry, 0644);
+        archive_entry_set_size(entry, size);
+    }
+    else
+    {
+        archive_entry_set_filetype(entry, AE_IFDIR);
+        archive_entry_set_perm(entry, 0755);
+    }
+
+    if (archive_write_header(a, entry) < ARCHIVE_OK)
+        throw Exception("Could not write patch archive entry %s: %s", path.c_str(), archive_error_string(a));
+
+    if (size != 0 && archive_write_data(a, data, size) != static_cast<la_ssize_t>(size))
+        throw Exception("Could not write patch archive entry %s: %s", path.c_str(), archive_error_string(a));
+}
+
+std::vector<uint8_t> saveToMemory(const int compressionLevel)
+{
+    json_t* const rootJ = APP->patch->toJson();
+    if (rootJ == nullptr)
+        throw Exception("Could not serialize patch");
+
+    DEFER({
+        json_decref(rootJ);
+    });
+
+    char* const patchJson = json_dumps(rootJ, JSON_INDENT(2));
+    if (patchJson == nullptr)
+        throw Exception("Could not serialize patch");
+
+    DEFER({
+        std::free(patchJson);
+    });
+
+    std::vector<uint8_t> data;
+
+    struct archive* const a = archive_write_new();
+    DEFER({
+        archive_write_free(a);
+    });
+
+    // same format as system::archiveDirectory, so both can read each other's output
+    archive_write_set_bytes_per_block(a, 0);
+    archive_write_set_format_ustar(a);
+    archive_write_add_filter_zstd(a);
+
+    if (archive_write_set_filter_option(a, nullptr, "compression-level", std::to_string(compressionLevel).c_str()) < ARCHIVE_OK)
+        throw Exception("Could not set patch archive compression level: %s", archive_error_string(a));
+
+    if (archive_write_open(a, &data, nullptr, archiveWriteCallback, nullptr) < ARCHIVE_OK)
+        throw Exception("Could not open patch archive: %s", archive_error_string(a));
+
+    archiveWriteEntry(a, "patch.json", reinterpret_cast<const uint8_t*>(patchJson), std::strlen(patchJson));
+
+    // files attached to modules only exist on disk, embed them as-is
+    const std::string modulesDir = system::join(APP->patch->autosavePath, "modules");
+
+    if (system::isDirectory(modulesDir))
+    {
+        archiveWriteEntry(a, "modules", nullptr, 0);
+
+        for (const std::string& entryPath : system::getEntries(modulesDir, -1))
+        {
+            const std::string path = "modules/" + entryPath.substr(modulesDir.size() + 1);
+
+            if (system::isDirectory(entryPath))
+            {
+                archiveWriteEntry(a, path, nullptr, 0);
+            }
+            else
+            {
+                const std::vector<uint8_t> fileData = system::readFile(entryPath);
+                archiveWriteEntry(a, path, fileData.data(), fileData.size());
+            }
+        }
+    }
+
+    if (archive_write_close(a) < ARCHIVE_OK)
+        throw Exception("Could not close patch archive: %s", archive_error_string(a));
+
+    return data;
+}
+
+// lets audio terminal modules fade out the current patch, if the audio thread is running
+static void fadeOutPatch()
+{
+   #ifndef DISTRHO_OS_WASM
+    CardinalPluginContext* const pcontext = static_cast<CardinalPluginContext*>(APP);
+    DISTRHO_SAFE_ASSERT_RETURN(pcontext != nullptr,);
+
+    ++pcontext->patchFadeCounter;
+
+    if (pcontext->bufferSize == 0 || pcontext->sampleRate <= 0.0)
+        return;
+
+    const double bufferTime = pcontext->bufferSize / pcontext->sampleRate;
+    const double startTime = system::getTime();
+
+    // nothing to wait for if the host is not processing right now
+    if (startTime - pcontext->engine->getBlockTime() > bufferTime * 4 + 0.05)
+        return;
+
+    // one more block in case the current one started before the request
+    const uint32_t processCounter = pcontext->processCounter;
+    const uint32_t fadeBlocks = 2 + static_cast<uint32_t>(kPatchFadeTime / bufferTime);
+    const double timeout = startTime + fadeBlocks * bufferTime * 2 + 0.05;
+
+    while (pcontext->processCounter - processCounter < fadeBlocks && system::getTime() < timeout)
+        DISTRHO_NAMESPACE::d_msleep(1);
+   #endif
+}
+
+// lets audio terminal modules fade the current patch back in, after replacing it failed
+static void restorePatchFade()
+{
+   #ifndef DISTRHO_OS_WASM
+    CardinalPluginContext* const pcontext = static_cast<CardinalPluginContext*>(APP);
+    DISTRHO_SAFE_ASSERT_RETURN(pcontext != nullptr,);
+
+    --pcontext->patchFadeCounter;
+   #endif
+}
+
+// reads a patch archive or plain json, parsing the patch json if requested
+// and writing module-attached files into extractPath if not empty. returns a new reference or null.
+static json_t* readFromMemory(const uint8_t* const data, const size_t size, const std::string& extractPath, const bool parse)
+{
+    static constexpr const char zstdMagic[] = "\x28\xb5\x2f\xfd";
+
+    json_error_t error = {};
+    json_t* rootJ = nullptr;
+
+    // plain json, as saved by older versions
+    if (size < 4 || std::memcmp(data, zstdMagic, 4) != 0)
+    {
+        if (! parse)
+            return nullptr;
+
+        rootJ = json_loadb(reinterpret_cast<const char*>(data), size, 0, &error);
+    }
+    else
+    {
+        struct archive* const a = archive_read_new();
+        DEFER({
+            archive_read_free(a);
+        });
+
+        archive_read_support_filter_zstd(a);
+        archive_read_support_format_tar(a);
+
+        if (archive_read_open_memory(a, data, size) < ARCHIVE_OK)
+            throw Exception("Could not open patch archive: %s", archive_error_string(a));
+
+        std::vector<uint8_t> entryData;
+        struct archive_entry* entry;
+        bool hasPatch = false;
+        int r;
+
+        while ((r = archive_read_next_header(a, &entry)) == ARCHIVE_OK)
+        {
+            std::string path = archive_entry_pathname(entry);
+
+            if (string::startsWith(path, "./"))
+                path = path.substr(2);
+            if (path.empty() || path.find("..") != std::string::npos)
+                continue;
+
+            // the patch itself is loaded straight from memory, everything else belongs to modules
+            const bool isPatch = path == "patch.json";
+            hasPatch |= isPatch;
+
+            if (isPatch ? (! parse || rootJ != nullptr) : extractPath.empty())
+                continue;
+
+            if (archive_entry_filetype(entry) == AE_IFDIR)
+            {
+                system::createDirectories(system::join(extractPath, path));
+                continue;
+            }
+
+            if (archive_entry_filetype(entry) != AE_IFREG)
+                continue;
+
+            entryData.resize(archive_entry_size(entry));
+
+            if (! entryData.empty() && archive_read_data(a, entryData.data(), entryData.size()) != static_cast<la_ssize_t>(entryData.size()))
+            {
+                if (rootJ != nullptr)
+                    json_decref(rootJ);
+                throw Exception("Could not read patch archive entry %s: %s", path.c_str(), archive_error_string(a));
+            }
+
+            if (isPatch)
+            {
+                rootJ = json_loadb(reinterpret_cast<const char*>(entryData.data()), entryData.size(), 0, &error);
+                continue;
+            }
+
+            const std::string filePath = system::join(extractPath, path);
+            system::createDirectories(system::getDirectory(filePath));
+            system::writeFile(filePath, entryData);
+        }
+
+        if (r != ARCHIVE_EOF)
+        {
+            if (rootJ != nullptr)
+                json_decref(rootJ);
+            throw Exception("Could not read patch archive: %s", archive_error_string(a));
+        }
+
+        if (! hasPatch)
+            throw Exception("Patch archive does not contain a patch.json file");
+    }
+
+    if (parse && rootJ == nullptr)
+        throw Exception("Failed to load patch. JSON parsing error at %s %d:%d %s",
+                        error.source, error.line, error.column, error.text);
+
+    return rootJ;
+}
+
+json_t* parseFromMemory(const uint8_t* const data, const size_t size)
+{
+    return readFromMemory(data, size, std::string(), true);
+}
+
+void loadFromMemory(const uint8_t* const data, const size_t size, json_t* rootJ)
+{
+    const std::string autosavePath = APP->patch->autosavePath;
+
+    // the current patch keeps its files until it is replaced, the new ones go next to them
+    const std::string nextAutosavePath = autosavePath + ".next";
+    system::removeRecursively(nextAutosavePath);
+    system::createDirectories(nextAutosavePath);
+
+    if (rootJ != nullptr)
+    {
+        readFromMemory(data, size, nextAutosavePath, false);
+        json_incref(rootJ);
+    }
+    else
+    {
+        rootJ = readFromMemory(data, size, nextAutosavePath, true);
+    }
+
+    DEFER({
+        json_decref(rootJ);
+    });
+
+    // build the new modules while the current patch keeps playing, so that replacing it is quick.
+    // modules find their files through the autosave path, so point it to the new ones meanwhile
+    if (! engine::Engine_isPatchStaged(APP->engine, rootJ))
+    {
+        APP->patch->autosavePath = nextAutosavePath;
+        DEFER({
+            APP->patch->autosavePath = autosavePath;
+        });
+        engine::Engine_stagePatch(APP->engine, rootJ);
+    }
+
+    DEFER({
+        engine::Engine_discardStagedPatch(APP->engine, rootJ);
+    });
+
+    fadeOutPatch();
+
+    // swap the files right before the modules, which may look for them when added.
+    // the current ones are only deleted once the new patch is loaded, and put back if that fails
+    const std::string prevAutosavePath = autosavePath + ".prev";
+    system::removeRecursively(prevAutosavePath);
+    system::rename(autosavePath, prevAutosavePath);
+    system::rename(nextAutosavePath, autosavePath);
+
+    try {
+        APP->patch->fromJson(rootJ);
+    }
+    catch (...) {
+        system::removeRecursively(autosavePath);
+        system::rename(prevAutosavePath, autosavePath);
+        restorePatchFade();
+        throw;
+    }
+
+    system::removeRecursively(prevAutosavePath);
+}
+
+void loadFromFile(const std::string& path)
+{
+    INFO("Loading patch %s", path.c_str());
+
+    const std::vector<uint8_t> data = system::readFile(path);
+    loadFromMemory(data.data(), data.size());
+}
+
 }
 
 // --------------------------------------------------------------------------------------------------------------------
@@ -9,10 +9,12 @@
 #include "DistrhoUtils.hpp"
 
 #include <string>
+#include <vector>
 
 extern const std::string CARDINAL_VERSION;
 
 struct CardinalPluginContext;
+struct json_t;
 
 // -----------------------------------------------------------------------------------------------------------
 
@@ -70,6 +72,23 @@ void saveTemplateDialog();
 void appendSelectionContextMenu(rack::ui::Menu* menu);
 void openBrowser(const std::string& url);
 
+// serialize the current patch into a zstd compressed archive, same format as rack::system::archiveDirectory.
+// the patch json never touches the disk, only module-attached files are read from the autosave directory.
+std::vector<uint8_t> saveToMemory(int compressionLevel);
+
+// parse the patch json from an archive or plain json, without touching the disk.
+// returns a new reference, throws on error.
+json_t* parseFromMemory(const uint8_t* data, size_t size);
+
+// load a patch from an archive or plain json, replacing the autosave directory once its modules are built.
+// only module-attached files are written to disk, the patch json is parsed from memory.
+// rootJ can be passed if already parsed from the same data, in which case it is reused along with its staged modules.
+void loadFromMemory(const uint8_t* data, size_t size, json_t* rootJ = nullptr);
+
+// load a patch file through loadFromMemory, in place of rack::patch::Manager::load.
+// throws on error.
+void loadFromFile(const std::string& path);
+
 } // namespace patchUtils
 
 // -----------------------------------------------------------------------------------------------------------
@@ -47,6 +47,15 @@
 # include "extra/ScopedValueSetter.hpp"
 #endif
 
+#if DISTRHO_PLUGIN_WANT_PROGRAMS
+# include "extra/Mutex.hpp"
+# include "extra/Sleep.hpp"
+# include "extra/Thread.hpp"
+# ifdef DISTRHO_OS_LINUX
+#  include <unistd.h>
+# endif
+#endif
+
 extern const std::string CARDINAL_VERSION;
 
 namespace rack {
@@ -62,6 +71,13 @@ std::string patchesPath();
 #endif
 namespace engine {
 void Engine_setAboutToClose(Engine*);
+int Engine_getBlockSize(Engine*);
+int Engine_getOffloadLatency(Engine*);
+#if DISTRHO_PLUGIN_WANT_PROGRAMS
+void Engine_stagePatch(Engine*, json_t*);
+void Engine_discardStagedPatch(Engine*, json_t*);
+bool Engine_isPatchStaged(Engine*, json_t*);
+#endif
 }
 }
 
@@ -144,6 +160,28 @@ float RackKnobModeToFloat(const rack::settings::KnobMode knobMode) noexcept
 
 // -----------------------------------------------------------------------------------------------------------
 
+#if DISTRHO_PLUGIN_WANT_PROGRAMS
+// resident memory of the whole process, used to estimate how much a preloaded patch takes. 0 if unknown
+static size_t getProcessMemoryUsage()
+{
+   #ifdef DISTRHO_OS_LINUX
+    if (FILE* const f = std::fopen("/proc/self/statm", "r"))
+    {
+        unsigned long size = 0, resident = 0;
+        const int ret = std::fscanf(f, "%lu %lu", &size, &resident);
+        std::fclose(f);
+
+        if (ret == 2)
+            return static_cast<size_t>(resident) * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    }
+   #endif
+
+    return 0;
+}
+#endif
+
+// -----------------------------------------------------------------------------------------------------------
+
 struct ScopedContext {
     ScopedContext(const CardinalBasePlugin* const plugin)
     {
@@ -188,6 +226,60 @@ class CardinalPlugin : public CardinalBasePlugin
     bool fWasBypassed;
     MidiEvent bypassMidiEvents[16];
 
+   #if DISTRHO_PLUGIN_WANT_PROGRAMS
+    // patches kept staged in the engine, so that switching to one of them only swaps modules in
+    struct BankProgram {
+        std::string name;
+        std::vector<uint8_t> data;
+        json_t* rootJ = nullptr;
+        size_t memoryUsage = 0;
+    } fBank[kPatchBankSize];
+    Mutex fBankMutex;
+
+    // switches bank programs while there is no UI, which otherwise does it from its idle callback
+    class BankThread : public Thread
+    {
+        CardinalPlugin* const plugin;
+
+    public:
+        BankThread(CardinalPlugin* const p)
+            : Thread("Cardinal bank"),
+              plugin(p) {}
+
+    protected:
+        void run() override
+        {
+            rack::contextSet(plugin->context);
+
+            while (! shouldThreadExit())
+            {
+                if (plugin->context->pendingProgram >= 0)
+                {
+                    const MutexLocker cml(plugin->bankSwitchMutex);
+
+                    if (plugin->context->ui == nullptr)
+                        plugin->stepBankProgram();
+                }
+
+                d_msleep(5);
+            }
+        }
+    } fBankThread;
+   #endif
+
+    // host buffers split into fixed size blocks, with their own audio pointers and rebased midi events.
+    // as many events as the DPF wrappers give to a single run, so the last block normally takes all of the remaining ones
+    static constexpr const uint32_t kMaxSliceMidiEvents = 512;
+   #if DISTRHO_PLUGIN_NUM_INPUTS != 0
+    const float* fSliceInputs[DISTRHO_PLUGIN_NUM_INPUTS];
+   #endif
+    float* fSliceOutputs[DISTRHO_PLUGIN_NUM_OUTPUTS];
+    MidiEvent fSliceMidiEvents[kMaxSliceMidiEvents];
+
+    // midi output from modules, sent at the end of each host buffer
+    CardinalMidiOutput fMidiOutput;
+    MidiEvent fMidiOutputSorted[kMidiOutputEventCount];
+
    #if CARDINAL_VARIANT_MINI || !defined(HEADLESS)
     // real values, not VCV interpreted ones
     float fWindowParameters[kWindowParameterCount];
@@ -206,7 +298,11 @@ class CardinalPlugin : public CardinalBasePlugin
 
 public:
     CardinalPlugin()
+       #if DISTRHO_PLUGIN_WANT_PROGRAMS
+        : CardinalBasePlugin(kCardinalParameterCount, kPatchBankSize, kCardinalStateCount),
+       #else
         : CardinalBasePlugin(kCardinalParameterCount, 0, kCardinalStateCount),
+       #endif
          #ifdef DISTRHO_OS_WASM
           fInitializer(new Initializer(this, static_cast<const CardinalBaseUI*>(nullptr))),
          #else
@@ -216,7 +312,11 @@ public:
           fAudioBufferCopy(nullptr),
          #endif
           fNextExpectedFrame(0),
-          fWasBypassed(false)
+          fWasBypassed(false),
+         #if DISTRHO_PLUGIN_WANT_PROGRAMS
+          fBankThread(this),
+         #endif
+          fMidiOutput()
     {
         // check if first time loading a real instance
         if (!fInitializer->shouldSaveSettings && !isDummyInstance())
@@ -269,6 +369,9 @@ public:
             }
         } DISTRHO_SAFE_EXCEPTION("create unique temporary path");
 
+        // midi output arena, written by modules through the context
+        context->midiOutput = &fMidiOutput;
+
         // initialize midi events used when entering bypassed state
         std::memset(bypassMidiEvents, 0, sizeof(bypassMidiEvents));
 
@@ -316,6 +419,11 @@ public:
        #ifdef CARDINAL_INIT_OSC_THREAD
         fInitializer->remotePluginInstance = this;
        #endif
+
+       #if DISTRHO_PLUGIN_WANT_PROGRAMS && ! defined(DISTRHO_OS_WASM)
+        if (! isDummyInstance())
+            fBankThread.startThread();
+       #endif
     }
 
     ~CardinalPlugin() override
@@ -325,8 +433,16 @@ public:
             fInitializer->remotePluginInstance = nullptr;
        #endif
 
+       #if DISTRHO_PLUGIN_WANT_PROGRAMS
+        fBankThread.stopThread(5000);
+       #endif
+
         {
             const ScopedContext sc(this);
+           #if DISTRHO_PLUGIN_WANT_PROGRAMS
+            for (BankProgram& bankProgram : fBank)
+                resetBankProgram(bankProgram);
+           #endif
             context->patch->clear();
 
             // do a little dance to prevent context scene deletion from saving to temp dir
@@ -377,6 +493,78 @@ public:
     }
    #endif
 
+   #if DISTRHO_PLUGIN_WANT_PROGRAMS
+    bool getBankProgram(const uint32_t index, std::string& name, size_t& memoryUsage) override
+    {
+        DISTRHO_SAFE_ASSERT_RETURN(index < kPatchBankSize, false);
+
+        const MutexLocker cml(fBankMutex);
+        const BankProgram& bankProgram(fBank[index]);
+
+        if (bankProgram.rootJ == nullptr)
+            return false;
+
+        name = bankProgram.name;
+        memoryUsage = bankProgram.memoryUsage;
+        return true;
+    }
+
+    void storeBankProgram(const uint32_t index, const char* const name) override
+    {
+        DISTRHO_SAFE_ASSERT_RETURN(index < kPatchBankSize,);
+
+        std::vector<uint8_t> data;
+
+        context->engine->prepareSave();
+        context->patch->cleanAutosave();
+
+        try {
+            data = patchUtils::saveToMemory(1);
+        } catch (const rack::Exception& e) {
+            d_stderr(e.what());
+            return;
+        } DISTRHO_SAFE_EXCEPTION_RETURN("storeBankProgram saveToMemory",);
+
+        setBankProgram(index, name, data);
+    }
+
+    void clearBankProgram(const uint32_t index) override
+    {
+        DISTRHO_SAFE_ASSERT_RETURN(index < kPatchBankSize,);
+
+        const MutexLocker cml(fBankMutex);
+        resetBankProgram(fBank[index]);
+    }
+
+    void stepBankProgram() override
+    {
+        const int32_t program = context->pendingProgram.exchange(-1);
+
+        if (program < 0)
+            return;
+
+        if (static_cast<uint32_t>(program) >= kPatchBankSize)
+            return;
+
+        const MutexLocker cml(fBankMutex);
+        BankProgram& bankProgram(fBank[program]);
+
+        if (bankProgram.rootJ == nullptr)
+            return;
+
+        // the engine takes the staged modules, so this only has to fade and swap them in
+        try {
+            patchUtils::loadFromMemory(bankProgram.data.data(), bankProgram.data.size(), bankProgram.rootJ);
+        } catch (const rack::Exception& e) {
+            d_stderr(e.what());
+        } DISTRHO_SAFE_EXCEPTION("stepBankProgram loadFromMemory");
+
+        // build the program again while it plays, ready for the next time it is selected
+        if (! rack::engine::Engine_isPatchStaged(context->engine, bankProgram.rootJ))
+            rack::engine::Engine_stagePatch(context->engine, bankProgram.rootJ);
+    }
+   #endif
+
 protected:
    /* --------------------------------------------------------------------------------------------------------
     * Information */
@@ -930,10 +1118,25 @@ protected:
             state.key = "param";
             state.label = "ParamChange";
             break;
+       #endif
+       #if DISTRHO_PLUGIN_WANT_PROGRAMS
+        case kCardinalStateBank:
+            state.hints = kStateIsOnlyForDSP;
+            state.key = "bank";
+            state.label = "Patch bank";
+            break;
        #endif
         }
     }
 
+   #if DISTRHO_PLUGIN_WANT_PROGRAMS
+    void initProgramName(const uint32_t index, String& programName) override
+    {
+        programName = "Bank program ";
+        programName += String(index + 1).buffer();
+    }
+   #endif
+
    /* --------------------------------------------------------------------------------------------------------
     * Internal data */
 
@@ -960,6 +1163,14 @@ protected:
         return 0.0f;
     }
 
+   #if DISTRHO_PLUGIN_WANT_PROGRAMS
+    void loadProgram(const uint32_t index) override
+    {
+        // hosts may call this from the audio thread, the switch happens later in stepBankProgram()
+        context->pendingProgram = static_cast<int32_t>(index);
+    }
+   #endif
+
     void setParameterValue(uint32_t index, float value) override
     {
         // host mapped parameters
@@ -997,6 +1208,11 @@ protected:
         if (std::strcmp(key, "screenshot") == 0)
             return fState.screenshot;
 
+       #if DISTRHO_PLUGIN_WANT_PROGRAMS
+        if (std::strcmp(key, "bank") == 0)
+            return getBankState();
+       #endif
+
         if (std::strcmp(key, "patch") != 0)
             return String();
         if (fAutosavePath.empty())
@@ -1005,9 +1221,27 @@ protected:
         std::vector<uint8_t> data;
 
         {
+           #if DISTRHO_PLUGIN_WANT_PROGRAMS
+            const MutexLocker cml(fBankMutex);
+           #endif
             const ScopedContext sc(this);
 
             context->engine->prepareSave();
+
+           #if !(CARDINAL_VARIANT_MINI && ! DISTRHO_PLUGIN_WANT_DIRECT_ACCESS)
+            // serialize in memory, skipping the autosave round-trip through the filesystem
+            context->patch->cleanAutosave();
+
+            try {
+                data = patchUtils::saveToMemory(1);
+            } catch (const rack::Exception& e) {
+                d_stderr(e.what());
+            } DISTRHO_SAFE_EXCEPTION("getState saveToMemory");
+
+            if (! data.empty())
+                return String::asBase64(data.data(), data.size());
+           #endif
+
             context->patch->saveAutosave();
             context->patch->cleanAutosave();
             // context->history->setSaved();
@@ -1082,11 +1316,24 @@ protected:
             return;
         }
 
+       #if DISTRHO_PLUGIN_WANT_PROGRAMS
+        if (std::strcmp(key, "bank") == 0)
+        {
+            const ScopedContext sc(this);
+            setBankState(value);
+            return;
+        }
+       #endif
+
         if (std::strcmp(key, "patch") != 0)
             return;
         if (fAutosavePath.empty())
             return;
 
+       #if DISTRHO_PLUGIN_WANT_PROGRAMS
+        const MutexLocker cml(fBankMutex);
+       #endif
+
        #if CARDINAL_VARIANT_MINI && ! DISTRHO_PLUGIN_WANT_DIRECT_ACCESS
         rack::system::removeRecursively(fAutosavePath);
         rack::system::createDirectories(fAutosavePath);
@@ -1101,6 +1348,18 @@ protected:
 
         DISTRHO_SAFE_ASSERT_RETURN(data.size() >= 4,);
 
+        // load from memory, only falling back to the autosave directory if that fails
+        {
+            const ScopedContext sc(this);
+
+            try {
+                patchUtils::loadFromMemory(data.data(), data.size());
+                return;
+            } catch (const rack::Exception& e) {
+                d_stderr(e.what());
+            } DISTRHO_SAFE_EXCEPTION("setState loadFromMemory");
+        }
+
         rack::system::removeRecursively(fAutosavePath);
         rack::system::createDirectories(fAutosavePath);
 
@@ -1133,22 +1392,141 @@ protected:
         // context->history->setSaved();
     }
 
+   #if DISTRHO_PLUGIN_WANT_PROGRAMS
+    // bank state is a json object with a "programs" array, each entry either null or a name and base64 encoded patch
+    String getBankState() const
+    {
+        const MutexLocker cml(fBankMutex);
+
+        json_t* const programsJ = json_array();
+        bool empty = true;
+
+        for (const BankProgram& bankProgram : fBank)
+        {
+            if (bankProgram.rootJ == nullptr)
+            {
+                json_array_append_new(programsJ, json_null());
+                continue;
+            }
+
+            const String patch(String::asBase64(bankProgram.data.data(), bankProgram.data.size()));
+
+            json_t* const programJ = json_object();
+            json_object_set_new(programJ, "name", json_string(bankProgram.name.c_str()));
+            json_object_set_new(programJ, "patch", json_string(patch.buffer()));
+            json_array_append_new(programsJ, programJ);
+            empty = false;
+        }
+
+        if (empty)
+        {
+            json_decref(programsJ);
+            return String();
+        }
+
+        json_t* const rootJ = json_object();
+        json_object_set_new(rootJ, "programs", programsJ);
+
+        char* const bank = json_dumps(rootJ, JSON_COMPACT);
+        json_decref(rootJ);
+        DISTRHO_SAFE_ASSERT_RETURN(bank != nullptr, String());
+
+        return String(bank, false);
+    }
+
+    void setBankState(const char* const value)
+    {
+        json_error_t error;
+        json_t* const rootJ = value[0] != '\0' ? json_loads(value, 0, &error) : nullptr;
+        json_t* const programsJ = json_object_get(rootJ, "programs");
+
+        for (uint32_t i = 0; i < kPatchBankSize; ++i)
+        {
+            json_t* const programJ = json_array_get(programsJ, i);
+            json_t* const patchJ = json_object_get(programJ, "patch");
+
+            if (! json_is_string(patchJ))
+            {
+                clearBankProgram(i);
+                continue;
+            }
+
+            const char* const name = json_string_value(json_object_get(programJ, "name"));
+            setBankProgram(i, name != nullptr ? name : "", d_getChunkFromBase64String(json_string_value(patchJ)));
+        }
+
+        if (rootJ != nullptr)
+            json_decref(rootJ);
+    }
+
+    void setBankProgram(const uint32_t index, const char* const name, const std::vector<uint8_t>& data)
+    {
+        json_t* rootJ = nullptr;
+
+        try {
+            rootJ = patchUtils::parseFromMemory(data.data(), data.size());
+        } catch (const rack::Exception& e) {
+            d_stderr(e.what());
+        } DISTRHO_SAFE_EXCEPTION("setBankProgram parseFromMemory");
+
+        const MutexLocker cml(fBankMutex);
+        BankProgram& bankProgram(fBank[index]);
+        resetBankProgram(bankProgram);
+
+        if (rootJ == nullptr)
+            return;
+
+        bankProgram.name = name;
+        bankProgram.data = data;
+        bankProgram.rootJ = rootJ;
+
+        // measure what the staged modules take, falling back to the size of the patch itself
+        const size_t memoryBefore = getProcessMemoryUsage();
+        rack::engine::Engine_stagePatch(context->engine, rootJ);
+        const size_t memoryAfter = getProcessMemoryUsage();
+
+        bankProgram.memoryUsage = memoryAfter > memoryBefore ? memoryAfter - memoryBefore : data.size();
+
+        d_stdout("Preloaded bank program %u \"%s\", using about %lu KiB",
+                 index + 1, name, static_cast<ulong>(bankProgram.memoryUsage / 1024));
+    }
+
+    void resetBankProgram(BankProgram& bankProgram)
+    {
+        if (bankProgram.rootJ != nullptr)
+        {
+            rack::engine::Engine_discardStagedPatch(context->engine, bankProgram.rootJ);
+            json_decref(bankProgram.rootJ);
+            bankProgram.rootJ = nullptr;
+        }
+
+        bankProgram.name.clear();
+        bankProgram.data.clear();
+        bankProgram.memoryUsage = 0;
+    }
+   #endif
+
    /* --------------------------------------------------------------------------------------------------------
     * Process */
 
     void activate() override
     {
-        context->bufferSize = getBufferSize();
+        const uint32_t bufferSize = getBufferSize();
+        const uint32_t blockSize = static_cast<uint32_t>(rack::engine::Engine_getBlockSize(context->engine));
+        context->bufferSize = getEngineBufferSize(bufferSize, blockSize);
 
        #if DISTRHO_PLUGIN_NUM_INPUTS != 0
         fAudioBufferCopy = new float*[DISTRHO_PLUGIN_NUM_INPUTS];
         for (int i=0; i<DISTRHO_PLUGIN_NUM_INPUTS; ++i)
         {
-            fAudioBufferCopy[i] = new float[context->bufferSize];
-            std::memset(fAudioBufferCopy[i], 0, sizeof(float) * context->bufferSize);
+            fAudioBufferCopy[i] = new float[bufferSize];
+            std::memset(fAudioBufferCopy[i], 0, sizeof(float) * bufferSize);
         }
        #endif
 
+        fMidiOutput.peakEventCount = 0;
+        fMidiOutput.droppedEventCount = 0;
+        context->midiInputDroppedEventCount = 0;
         fNextExpectedFrame = 0;
     }
 
@@ -1285,12 +1663,198 @@ protected:
             context->midiEventCount = midiEventCount;
         }
 
-        ++context->processCounter;
-        context->engine->stepBlock(frames);
+        const uint32_t blockSize = static_cast<uint32_t>(rack::engine::Engine_getBlockSize(context->engine));
+        const uint32_t bufferSize = getEngineBufferSize(getBufferSize(), blockSize);
+
+        if (context->bufferSize != bufferSize)
+            context->bufferSize = bufferSize;
+
+        if (blockSize == 0 || frames <= blockSize)
+        {
+            ++context->processCounter;
+            context->engine->stepBlock(frames);
+        }
+        else
+        {
+            runSlices(frames, blockSize);
+        }
+
+        context->offloadLatency = static_cast<uint32_t>(rack::engine::Engine_getOffloadLatency(context->engine));
+
+        flushMidiOutput(frames);
 
         fWasBypassed = bypassed;
     }
 
+    // process the host buffer set in the context as several blocks of blockSize frames, the last one may be shorter.
+    // each block sees its own part of the audio buffers, its midi events and the time position at its start.
+    void runSlices(const uint32_t frames, const uint32_t blockSize)
+    {
+        const float* const* const dataIns = context->dataIns;
+        float** const dataOuts = context->dataOuts;
+        const MidiEvent* const midiEvents = context->midiEvents;
+        const uint32_t midiEventCount = context->midiEventCount;
+        uint32_t midiEventIndex = 0;
+
+       #if DISTRHO_PLUGIN_NUM_INPUTS != 0
+        context->dataIns = dataIns != nullptr ? fSliceInputs : nullptr;
+       #endif
+        context->dataOuts = fSliceOutputs;
+        context->midiEvents = fSliceMidiEvents;
+
+        for (uint32_t offset = 0; offset < frames; offset += blockSize)
+        {
+            const uint32_t sliceFrames = std::min(blockSize, frames - offset);
+            const uint32_t sliceEnd = offset + sliceFrames;
+            const bool lastSlice = sliceEnd == frames;
+
+           #if DISTRHO_PLUGIN_NUM_INPUTS != 0
+            if (dataIns != nullptr)
+            {
+                for (int i=0; i<DISTRHO_PLUGIN_NUM_INPUTS; ++i)
+                    fSliceInputs[i] = dataIns[i] != nullptr ? dataIns[i] + offset : nullptr;
+            }
+           #endif
+            for (int i=0; i<DISTRHO_PLUGIN_NUM_OUTPUTS; ++i)
+                fSliceOutputs[i] = dataOuts[i] != nullptr ? dataOuts[i] + offset : nullptr;
+
+            // events past the capacity of a slice are delayed to the start of the next one.
+            // the last slice takes everything left, anything still over its capacity is dropped and counted
+            uint32_t sliceMidiEventCount = 0;
+            while (midiEventIndex < midiEventCount && sliceMidiEventCount < kMaxSliceMidiEvents
+                   && (lastSlice || midiEvents[midiEventIndex].frame < sliceEnd))
+            {
+                MidiEvent& midiEvent(fSliceMidiEvents[sliceMidiEventCount++]);
+                midiEvent = midiEvents[midiEventIndex++];
+                midiEvent.frame = midiEvent.frame > offset ? std::min(midiEvent.frame - offset, sliceFrames - 1) : 0;
+            }
+            context->midiEventCount = sliceMidiEventCount;
+
+            if (lastSlice && midiEventIndex < midiEventCount)
+                context->midiInputDroppedEventCount += midiEventCount - midiEventIndex;
+
+            fMidiOutput.frameOffset = offset;
+
+            ++context->processCounter;
+            context->engine->stepBlock(sliceFrames);
+
+            if (! lastSlice)
+                advanceTimePosition(sliceFrames);
+        }
+
+        context->dataIns = dataIns;
+        context->dataOuts = dataOuts;
+        fMidiOutput.frameOffset = 0;
+    }
+
+    // send the midi output of modules to the host, in frame order.
+    // several modules write during the same block, each in frame order, so their events come interleaved by module.
+    void flushMidiOutput(const uint32_t frames)
+    {
+        const MidiEvent* events = fMidiOutput.events;
+        const uint32_t eventCount = fMidiOutput.eventCount;
+        bool sorted = true;
+
+        if (fMidiOutput.peakEventCount < eventCount)
+            fMidiOutput.peakEventCount = eventCount;
+
+        for (uint32_t i = 0; i < eventCount; ++i)
+        {
+            MidiEvent& event(fMidiOutput.events[i]);
+
+            if (event.frame >= frames)
+                event.frame = frames != 0 ? frames - 1 : 0;
+
+            if (i != 0 && event.frame < fMidiOutput.events[i - 1].frame)
+                sorted = false;
+        }
+
+        if (! sorted)
+            events = sortMidiOutput(frames);
+
+        for (uint32_t i = 0; i < eventCount; ++i)
+        {
+            // host output buffer is full
+            if (! writeMidiEvent(events[i]))
+            {
+                fMidiOutput.droppedEventCount += eventCount - i;
+                break;
+            }
+        }
+
+        fMidiOutput.eventCount = 0;
+        fMidiOutput.dataSize = 0;
+    }
+
+    // stable radix sort of the midi output by frame, one byte at a time and only for as many bytes as frames need.
+    // linear in the event count, which matters for dense output like clock or SysEx from many modules at once.
+    const MidiEvent* sortMidiOutput(const uint32_t frames)
+    {
+        MidiEvent* src = fMidiOutput.events;
+        MidiEvent* dst = fMidiOutputSorted;
+        const uint32_t eventCount = fMidiOutput.eventCount;
+
+        for (uint32_t shift = 0; shift < 32 && ((frames - 1) >> shift) != 0; shift += 8)
+        {
+            uint32_t offsets[256] = {};
+
+            for (uint32_t i = 0; i < eventCount; ++i)
+                ++offsets[(src[i].frame >> shift) & 0xff];
+
+            for (uint32_t i = 0, offset = 0; i < 256; ++i)
+            {
+                const uint32_t count = offsets[i];
+                offsets[i] = offset;
+                offset += count;
+            }
+
+            for (uint32_t i = 0; i < eventCount; ++i)
+                dst[offsets[(src[i].frame >> shift) & 0xff]++] = src[i];
+
+            std::swap(src, dst);
+        }
+
+        return src;
+    }
+
+    // move the time position forward as the host would for a block starting frames later.
+    // beats wrap with the same tolerance as the Host Time module, so it keeps counting in step.
+    void advanceTimePosition(const uint32_t frames)
+    {
+        context->reset = false;
+
+        if (! context->playing)
+            return;
+
+        context->frame += frames;
+
+        if (! context->bbtValid || context->ticksPerBeat <= 0.0 || context->ticksPerClock <= 0.0)
+            return;
+
+        const double ticks = context->ticksPerFrame * frames;
+
+        context->tick += ticks;
+        context->tickClock = std::fmod(context->tickClock + ticks, context->ticksPerClock);
+
+        while (context->tick + 0.0001 >= context->ticksPerBeat)
+        {
+            context->tick -= context->ticksPerBeat;
+
+            if (++context->beat > context->beatsPerBar)
+            {
+                context->beat = 1;
+                ++context->bar;
+                context->barStartTick += context->ticksPerBeat * context->beatsPerBar;
+            }
+        }
+    }
+
+    // the most frames processed per engine block, which is what modules see as the buffer size
+    static uint32_t getEngineBufferSize(const uint32_t bufferSize, const uint32_t blockSize) noexcept
+    {
+        return blockSize != 0 ? std::min(blockSize, bufferSize) : bufferSize;
+    }
+
     void sampleRateChanged(const double newSampleRate) override
     {
         rack::contextSet(context);
@@ -40,6 +40,10 @@
 
 #include "plugincontext.hpp"
 
+#if DISTRHO_PLUGIN_WANT_PROGRAMS
+# include "extra/Mutex.hpp"
+#endif
+
 START_NAMESPACE_DISTRHO
 
 // -----------------------------------------------------------------------------------------------------------
@@ -92,6 +96,9 @@ enum CardinalStates {
    #endif
    #if CARDINAL_VARIANT_MINI
     kCardinalStateParamChange,
+   #endif
+   #if DISTRHO_PLUGIN_WANT_PROGRAMS
+    kCardinalStateBank,
    #endif
     kCardinalStateCount
 };
@@ -132,6 +139,18 @@ public:
     virtual void stepRemoteServer() = 0;
    #endif
 
+   #if DISTRHO_PLUGIN_WANT_PROGRAMS
+    // patch bank, these must be called with the rack context set, from the thread that loads patches
+    virtual bool getBankProgram(uint32_t index, std::string& name, size_t& memoryUsage) = 0;
+    virtual void storeBankProgram(uint32_t index, const char* name) = 0;
+    virtual void clearBankProgram(uint32_t index) = 0;
+    virtual void stepBankProgram() = 0;
+
+    // bank programs are switched by the UI while it is open, and by a plugin thread otherwise.
+    // held by that thread during a switch, and by the UI while it attaches to or detaches from the context.
+    Mutex bankSwitchMutex;
+   #endif
+
    #ifndef HEADLESS
     friend class CardinalUI;
    #endif
@@ -171,6 +190,10 @@ public:
           filebrowseraction(),
           filebrowserhandle(nullptr)
     {
+       #if DISTRHO_PLUGIN_WANT_PROGRAMS && DISTRHO_PLUGIN_WANT_DIRECT_ACCESS
+        // wait for a bank program switch done without UI, the UI takes them over from here
+        const MutexLocker cml(static_cast<CardinalBasePlugin*>(context->plugin)->bankSwitchMutex);
+       #endif
         context->tlw = this;
         context->ui = this;
     }
@@ -0,0 +1,686 @@
+/*
+ * DISTRHO Cardinal Plugin
+ * Copyright (C) 2021-2024 Filipe Coelho <falktx@falktx.com>
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* Offline renderer, plays a patch as fast as possible and writes the host audio outputs to a WAV file.
+ * The headless plugin is hosted the same way plugin formats do, so patches run exactly as they would in a host.
+ */
+
+#include <engine/Engine.hpp>
+#include <patch.hpp>
+#include <plugin/Model.hpp>
+#include <system.hpp>
+
+#ifdef NDEBUG
+# undef DEBUG
+#endif
+
+#include <random.hpp>
+
+#include "CardinalPluginContext.hpp"
+#include "src/DistrhoPluginInternal.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <vector>
+
+#ifndef HEADLESS
+# error the offline renderer is meant for headless builds
+#endif
+
+namespace rack {
+namespace engine {
+void Engine_setThreadCount(Engine*, int);
+void Engine_setRandomSeed(Engine*, uint64_t);
+void Engine_setTracing(Engine*, bool);
+double Engine_accumulateTrace(Engine*, uint64_t& position, std::map<int64_t, double>& moduleTimes);
+std::vector<std::vector<int64_t>> Engine_getFeedbackLoops(Engine*);
+}
+}
+
+START_NAMESPACE_DISTRHO
+
+CardinalPluginContext* getRackContextFromPlugin(void* ptr);
+
+// -----------------------------------------------------------------------------------------------------------
+
+static uint16_t readLE16(const uint8_t* const p)
+{
+    return p[0] | p[1] << 8;
+}
+
+static uint32_t readLE32(const uint8_t* const p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | static_cast<uint32_t>(p[3]) << 24;
+}
+
+static uint32_t readBE32(const uint8_t* const p)
+{
+    return static_cast<uint32_t>(p[0]) << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void writeLE16(uint8_t* const p, const uint16_t value)
+{
+    p[0] = value & 0xff;
+    p[1] = value >> 8;
+}
+
+static void writeLE32(uint8_t* const p, const uint32_t value)
+{
+    p[0] = value & 0xff;
+    p[1] = (value >> 8) & 0xff;
+    p[2] = (value >> 16) & 0xff;
+    p[3] = value >> 24;
+}
+
+static std::vector<uint8_t> readFile(const char* const path)
+{
+    std::vector<uint8_t> data;
+
+    FILE* const f = std::fopen(path, "rb");
+    DISTRHO_SAFE_ASSERT_RETURN(f != nullptr, data);
+
+    std::fseek(f, 0, SEEK_END);
+    const long fileSize = std::ftell(f);
+    std::fseek(f, 0, SEEK_SET);
+
+    if (fileSize > 0)
+    {
+        data.resize(fileSize);
+        if (std::fread(data.data(), fileSize, 1, f) != 1)
+            data.clear();
+    }
+
+    std::fclose(f);
+    return data;
+}
+
+// -----------------------------------------------------------------------------------------------------------
+// WAV files
+
+/* Reads a 16, 24 or 32 bit integer or 32 bit float WAV file, as interleaved samples. */
+static bool readWavFile(const char* const path, std::vector<float>& samples, uint16_t& channels, uint32_t& sampleRate)
+{
+    const std::vector<uint8_t> data(readFile(path));
+
+    if (data.size() < 12 || std::memcmp(data.data(), "RIFF", 4) != 0 || std::memcmp(data.data() + 8, "WAVE", 4) != 0)
+        return false;
+
+    uint16_t format = 0;
+    uint16_t bits = 0;
+    channels = 0;
+
+    for (size_t pos = 12; pos + 8 <= data.size();)
+    {
+        const uint8_t* const chunk = data.data() + pos;
+        const uint32_t chunkSize = std::min<size_t>(readLE32(chunk + 4), data.size() - pos - 8);
+
+        if (std::memcmp(chunk, "fmt ", 4) == 0 && chunkSize >= 16)
+        {
+            format = readLE16(chunk + 8);
+            channels = readLE16(chunk + 10);
+            sampleRate = readLE32(chunk + 12);
+            bits = readLE16(chunk + 22);
+
+            // WAVE_FORMAT_EXTENSIBLE, the actual format starts its subformat GUID
+            if (format == 0xfffe && chunkSize >= 26)
+                format = readLE16(chunk + 32);
+        }
+        else if (std::memcmp(chunk, "data", 4) == 0)
+        {
+            const uint32_t sampleSize = bits / 8;
+            const bool isFloat = format == 3 && bits == 32;
+            const bool isInteger = format == 1 && (bits == 16 || bits == 24 || bits == 32);
+            DISTRHO_SAFE_ASSERT_RETURN(channels != 0 && (isFloat || isInteger), false);
+
+            const uint8_t* p = chunk + 8;
+            samples.resize(chunkSize / sampleSize / channels * channels);
+
+            for (float& sample : samples)
+            {
+                if (isFloat)
+                {
+                    const uint32_t value = readLE32(p);
+                    std::memcpy(&sample, &value, sizeof(float));
+                }
+                else if (bits == 16)
+                {
+                    sample = static_cast<int16_t>(readLE16(p)) / 32768.f;
+                }
+                else if (bits == 24)
+                {
+                    // shift into the top bytes to sign-extend
+                    sample = static_cast<int32_t>(readLE32(p - 1) & 0xffffff00) / 2147483648.f;
+                }
+                else
+                {
+                    sample = static_cast<int32_t>(readLE32(p)) / 2147483648.f;
+                }
+
+                p += sampleSize;
+            }
+
+            return true;
+        }
+
+        pos += 8 + chunkSize + (chunkSize & 1);
+    }
+
+    return false;
+}
+
+/* Writes a 32 bit float WAV file as it is rendered, sizes are filled in when closed. */
+struct WavWriter {
+    FILE* file = nullptr;
+    uint16_t channels = 0;
+    uint32_t dataSize = 0;
+
+    bool open(const char* const path, const uint16_t numChannels, const uint32_t sampleRate)
+    {
+        file = std::fopen(path, "wb");
+        DISTRHO_SAFE_ASSERT_RETURN(file != nullptr, false);
+
+        channels = numChannels;
+        dataSize = 0;
+
+        uint8_t header[44] = {};
+        std::memcpy(header, "RIFF", 4);
+        std::memcpy(header + 8, "WAVEfmt ", 8);
+        writeLE32(header + 16, 16);
+        writeLE16(header + 20, 3);
+        writeLE16(header + 22, channels);
+        writeLE32(header + 24, sampleRate);
+        writeLE32(header + 28, sampleRate * channels * sizeof(float));
+        writeLE16(header + 32, channels * sizeof(float));
+        writeLE16(header + 34, 32);
+        std::memcpy(header + 36, "data", 4);
+
+        return std::fwrite(header, sizeof(header), 1, file) == 1;
+    }
+
+    void write(const float* const interleaved, const uint32_t frames)
+    {
+        const uint32_t size = frames * channels * sizeof(float);
+        if (std::fwrite(interleaved, size, 1, file) == 1)
+            dataSize += size;
+    }
+
+    void close()
+    {
+        if (file == nullptr)
+            return;
+
+        uint8_t size[4];
+        writeLE32(size, 36 + dataSize);
+        std::fseek(file, 4, SEEK_SET);
+        std::fwrite(size, sizeof(size), 1, file);
+
+        writeLE32(size, dataSize);
+        std::fseek(file, 40, SEEK_SET);
+        std::fwrite(size, sizeof(size), 1, file);
+
+        std::fclose(file);
+        file = nullptr;
+    }
+};
+
+// -----------------------------------------------------------------------------------------------------------
+// Standard MIDI files
+
+struct RenderMidiEvent {
+    uint64_t frame;
+    uint8_t size;
+    uint8_t data[3];
+};
+
+static bool readVarLen(const std::vector<uint8_t>& data, size_t& pos, const size_t end, uint32_t& value)
+{
+    value = 0;
+
+    for (int i = 0; i < 4 && pos < end; ++i)
+    {
+        const uint8_t byte = data[pos++];
+        value = (value << 7) | (byte & 0x7f);
+        if ((byte & 0x80) == 0)
+            return true;
+    }
+
+    return false;
+}
+
+/* Reads the channel messages of all tracks of a MIDI file, following its tempo changes.
+ * SysEx and meta events are skipped.
+ */
+static bool readMidiFile(const char* const path, const double sampleRate, std::vector<RenderMidiEvent>& events)
+{
+    const std::vector<uint8_t> data(readFile(path));
+
+    if (data.size() < 14 || std::memcmp(data.data(), "MThd", 4) != 0 || readBE32(data.data() + 4) < 6)
+        return false;
+
+    const uint16_t division = data[12] << 8 | data[13];
+    DISTRHO_SAFE_ASSERT_RETURN(division != 0, false);
+
+    struct TickEvent {
+        uint64_t tick;
+        // microseconds per quarter note for tempo changes, 0 otherwise
+        uint32_t tempo;
+        uint8_t size;
+        uint8_t data[3];
+    };
+    std::vector<TickEvent> tickEvents;
+
+    for (size_t pos = 8 + readBE32(data.data() + 4); pos + 8 <= data.size();)
+    {
+        const size_t begin = pos + 8;
+        const size_t end = std::min<size_t>(begin + readBE32(data.data() + pos + 4), data.size());
+        const bool isTrack = std::memcmp(data.data() + pos, "MTrk", 4) == 0;
+        pos = end;
+
+        if (! isTrack)
+            continue;
+
+        uint64_t tick = 0;
+        uint8_t runningStatus = 0;
+
+        for (size_t i = begin; i < end;)
+        {
+            uint32_t delta, length;
+            if (! readVarLen(data, i, end, delta) || i >= end)
+                break;
+            tick += delta;
+
+            uint8_t status = data[i];
+            if (status & 0x80)
+                ++i;
+            else if (runningStatus != 0)
+                status = runningStatus;
+            else
+                break;
+
+            if (status == 0xff)
+            {
+                if (i >= end)
+                    break;
+                const uint8_t type = data[i++];
+                if (! readVarLen(data, i, end, length) || i + length > end)
+                    break;
+                if (type == 0x51 && length == 3)
+                    tickEvents.push_back({ tick, static_cast<uint32_t>(data[i] << 16 | data[i + 1] << 8 | data[i + 2]), 0, {} });
+                i += length;
+                runningStatus = 0;
+            }
+            else if (status == 0xf0 || status == 0xf7)
+            {
+                if (! readVarLen(data, i, end, length) || i + length > end)
+                    break;
+                i += length;
+                runningStatus = 0;
+            }
+            else
+            {
+                const uint8_t size = (status & 0xf0) == 0xc0 || (status & 0xf0) == 0xd0 ? 2 : 3;
+                if (i + size - 1 > end)
+                    break;
+                TickEvent event = { tick, 0, size, { status, data[i], 0 } };
+                if (size == 3)
+                    event.data[2] = data[i + 1];
+                tickEvents.push_back(event);
+                i += size - 1;
+                runningStatus = status;
+            }
+        }
+    }
+
+    // tracks are merged, keeping tempo changes of earlier tracks before events at the same tick
+    std::stable_sort(tickEvents.begin(), tickEvents.end(), [](const TickEvent& a, const TickEvent& b) {
+        return a.tick < b.tick;
+    });
+
+    double seconds = 0.0;
+    double secondsPerTick;
+    uint64_t lastTick = 0;
+
+    if (division & 0x8000)
+        secondsPerTick = 1.0 / (-static_cast<int8_t>(division >> 8) * (division & 0xff));
+    else
+        secondsPerTick = 0.5 / division;
+
+    for (const TickEvent& event : tickEvents)
+    {
+        seconds += (event.tick - lastTick) * secondsPerTick;
+        lastTick = event.tick;
+
+        if (event.tempo != 0)
+        {
+            if ((division & 0x8000) == 0)
+                secondsPerTick = event.tempo * 1e-6 / division;
+            continue;
+        }
+
+        events.push_back({ static_cast<uint64_t>(seconds * sampleRate + 0.5), event.size,
+                           { event.data[0], event.data[1], event.data[2] } });
+    }
+
+    return true;
+}
+
+// -----------------------------------------------------------------------------------------------------------
+// Plugin callbacks, MIDI output and host requests are not used
+
+static bool writeMidiCallback(void*, const MidiEvent&)
+{
+    return true;
+}
+
+static bool requestParameterValueChangeCallback(void*, uint32_t, float)
+{
+    return false;
+}
+
+static bool updateStateValueCallback(void*, const char*, const char*)
+{
+    return false;
+}
+
+// -----------------------------------------------------------------------------------------------------------
+
+struct RenderOptions {
+    const char* patchPath = nullptr;
+    const char* outputPath = nullptr;
+    const char* midiPath = nullptr;
+    const char* inputPath = nullptr;
+    double sampleRate = 0.0;
+    uint32_t bufferSize = 256;
+    double duration = 0.0;
+    uint16_t channels = 2;
+    int threads = 0;
+    uint64_t seed = 1;
+    bool profile = true;
+};
+
+static void printUsage(const char* const name)
+{
+    std::printf("Usage: %s [options] <patch.vcv> <output.wav>\n"
+                "\n"
+                "Renders a patch offline, as fast as possible, and writes the Audio outputs to a 32 bit float WAV file.\n"
+                "\n"
+                "  -r, --sample-rate <Hz>       sample rate, defaults to the input file one or 48000\n"
+                "  -b, --buffer-size <frames>   host buffer size, defaults to 256\n"
+                "  -d, --duration <seconds>     length to render, defaults to the input file one or 10\n"
+                "  -c, --channels <count>       number of outputs to write, up to %u, defaults to 2\n"
+                "  -i, --input <file.wav>       audio sent to the Audio inputs\n"
+                "  -m, --midi <file.mid>        MIDI file sent to the MIDI input\n"
+                "  -t, --threads <count>        engine threads, defaults to the one saved in the patch\n"
+                "  -s, --seed <number>          seed of random modules, the same seed renders the same file, defaults to 1\n"
+                "  -n, --no-profile             skip measuring the time spent on each module\n"
+                "  -h, --help                   show this help\n",
+                name, DISTRHO_PLUGIN_NUM_OUTPUTS);
+}
+
+static bool parseOptions(const int argc, char* argv[], RenderOptions& options)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        const char* const arg = argv[i];
+        const char* const value = i + 1 < argc ? argv[i + 1] : nullptr;
+
+        const auto matches = [arg](const char* const shortName, const char* const longName) {
+            return std::strcmp(arg, shortName) == 0 || std::strcmp(arg, longName) == 0;
+        };
+
+        if (matches("-h", "--help"))
+            return false;
+
+        if (matches("-n", "--no-profile"))
+        {
+            options.profile = false;
+            continue;
+        }
+
+        if (arg[0] != '-')
+        {
+            if (options.patchPath == nullptr)
+                options.patchPath = arg;
+            else if (options.outputPath == nullptr)
+                options.outputPath = arg;
+            else
+                return false;
+            continue;
+        }
+
+        if (value == nullptr)
+            return false;
+        ++i;
+
+        if (matches("-r", "--sample-rate"))
+            options.sampleRate = std::atof(value);
+        else if (matches("-b", "--buffer-size"))
+            options.bufferSize = std::atoi(value);
+        else if (matches("-d", "--duration"))
+            options.duration = std::atof(value);
+        else if (matches("-c", "--channels"))
+            options.channels = std::atoi(value);
+        else if (matches("-i", "--input"))
+            options.inputPath = value;
+        else if (matches("-m", "--midi"))
+            options.midiPath = value;
+        else if (matches("-t", "--threads"))
+            options.threads = std::atoi(value);
+        else if (matches("-s", "--seed"))
+            options.seed = std::strtoull(value, nullptr, 10);
+        else
+            return false;
+    }
+
+    return options.patchPath != nullptr && options.outputPath != nullptr
+        && options.bufferSize != 0
+        && options.channels != 0 && options.channels <= DISTRHO_PLUGIN_NUM_OUTPUTS;
+}
+
+static int render(const RenderOptions& options)
+{
+    std::vector<float> inputSamples;
+    uint16_t inputChannels = 0;
+    uint32_t inputSampleRate = 0;
+
+    if (options.inputPath != nullptr && ! readWavFile(options.inputPath, inputSamples, inputChannels, inputSampleRate))
+    {
+        d_stderr("Could not read input file %s", options.inputPath);
+        return 1;
+    }
+
+    const double sampleRate = options.sampleRate > 0.0 ? options.sampleRate
+                            : inputSampleRate != 0 ? inputSampleRate
+                            : 48000.0;
+
+    if (inputSampleRate != 0 && inputSampleRate != sampleRate)
+    {
+        d_stderr("Input file sample rate %u does not match the render sample rate %g", inputSampleRate, sampleRate);
+        return 1;
+    }
+
+    const uint64_t inputFrames = inputChannels != 0 ? inputSamples.size() / inputChannels : 0;
+    const uint64_t totalFrames = options.duration > 0.0 ? static_cast<uint64_t>(options.duration * sampleRate + 0.5)
+                               : inputFrames != 0 ? inputFrames
+                               : static_cast<uint64_t>(10 * sampleRate);
+
+    std::vector<RenderMidiEvent> midiEvents;
+
+    if (options.midiPath != nullptr && ! readMidiFile(options.midiPath, sampleRate, midiEvents))
+    {
+        d_stderr("Could not read MIDI file %s", options.midiPath);
+        return 1;
+    }
+
+    d_nextBufferSize = options.bufferSize;
+    d_nextSampleRate = sampleRate;
+
+    PluginExporter plugin(nullptr, writeMidiCallback, requestParameterValueChangeCallback, updateStateValueCallback);
+    CardinalPluginContext* const context = getRackContextFromPlugin(plugin.getInstancePointer());
+
+    {
+        rack::contextSet(context);
+
+        // modules draw random numbers when created and while processing, on this thread and on engine threads
+        rack::random::local().seed(options.seed, 0);
+        rack::engine::Engine_setRandomSeed(context->engine, options.seed);
+
+        try {
+            context->patch->load(options.patchPath);
+        } catch (const rack::Exception& e) {
+            d_stderr("Could not load patch %s: %s", options.patchPath, e.what());
+            rack::contextSet(nullptr);
+            return 1;
+        }
+
+        // loading a patch restores its thread count
+        if (options.threads > 0)
+            rack::engine::Engine_setThreadCount(context->engine, options.threads);
+
+        if (options.profile)
+            rack::engine::Engine_setTracing(context->engine, true);
+
+        // cables closing a loop add a frame of delay, worth knowing when comparing renders
+        for (const std::vector<int64_t>& loop : rack::engine::Engine_getFeedbackLoops(context->engine))
+        {
+            std::printf("Feedback loop:");
+            for (const int64_t moduleId : loop)
+            {
+                rack::engine::Module* const module = context->engine->getModule(moduleId);
+                std::printf(" %s (%lld)", module->model->getFullName().c_str(), static_cast<long long>(moduleId));
+            }
+            std::printf("\n");
+        }
+
+        rack::contextSet(nullptr);
+    }
+
+    WavWriter writer;
+
+    if (! writer.open(options.outputPath, options.channels, sampleRate))
+    {
+        d_stderr("Could not write output file %s", options.outputPath);
+        return 1;
+    }
+
+    const uint32_t bufferSize = options.bufferSize;
+    const uint16_t audioInputs = std::min<uint16_t>(inputChannels, CARDINAL_NUM_AUDIO_INPUTS);
+
+    std::vector<float> inputBuffers(DISTRHO_PLUGIN_NUM_INPUTS * bufferSize);
+    std::vector<float> outputBuffers(DISTRHO_PLUGIN_NUM_OUTPUTS * bufferSize);
+    const float* inputs[DISTRHO_PLUGIN_NUM_INPUTS];
+    float* outputs[DISTRHO_PLUGIN_NUM_OUTPUTS];
+
+    for (uint32_t i = 0; i < DISTRHO_PLUGIN_NUM_INPUTS; ++i)
+        inputs[i] = inputBuffers.data() + i * bufferSize;
+    for (uint32_t i = 0; i < DISTRHO_PLUGIN_NUM_OUTPUTS; ++i)
+        outputs[i] = outputBuffers.data() + i * bufferSize;
+
+    std::vector<float> interleaved(bufferSize * options.channels);
+    std::vector<MidiEvent> blockMidiEvents;
+    size_t nextMidiEvent = 0;
+
+    TimePosition timePosition;
+    timePosition.playing = true;
+
+    uint64_t tracePosition = 0;
+    std::map<int64_t, double> moduleTimes;
+
+    plugin.activate();
+
+    const double startTime = rack::system::getTime();
+
+    for (uint64_t frame = 0; frame < totalFrames;)
+    {
+        const uint32_t frames = std::min<uint64_t>(bufferSize, totalFrames - frame);
+
+        for (uint16_t c = 0; c < audioInputs; ++c)
+        {
+            float* const buffer = inputBuffers.data() + c * bufferSize;
+            for (uint32_t i = 0; i < frames; ++i)
+                buffer[i] = frame + i < inputFrames ? inputSamples[(frame + i) * inputChannels + c] : 0.f;
+        }
+
+        blockMidiEvents.clear();
+        for (; nextMidiEvent < midiEvents.size() && midiEvents[nextMidiEvent].frame < frame + frames; ++nextMidiEvent)
+        {
+            const RenderMidiEvent& event = midiEvents[nextMidiEvent];
+            MidiEvent midiEvent = {};
+            midiEvent.frame = event.frame > frame ? event.frame - frame : 0;
+            midiEvent.size = event.size;
+            std::memcpy(midiEvent.data, event.data, event.size);
+            blockMidiEvents.push_back(midiEvent);
+        }
+
+        timePosition.frame = frame;
+        plugin.setTimePosition(timePosition);
+        plugin.run(inputs, outputs, frames, blockMidiEvents.data(), blockMidiEvents.size());
+
+        // the engine trace keeps a limited number of events, so collect them as they come
+        if (options.profile)
+            rack::engine::Engine_accumulateTrace(context->engine, tracePosition, moduleTimes);
+
+        for (uint32_t i = 0; i < frames; ++i)
+            for (uint16_t c = 0; c < options.channels; ++c)
+                interleaved[i * options.channels + c] = outputs[c][i];
+
+        writer.write(interleaved.data(), frames);
+        frame += frames;
+    }
+
+    const double renderTime = rack::system::getTime() - startTime;
+    const double audioTime = totalFrames / sampleRate;
+
+    plugin.deactivate();
+    writer.close();
+
+    std::printf("Rendered %.3f s in %.3f s, %.2fx realtime\n", audioTime, renderTime, audioTime / renderTime);
+
+    if (options.profile && ! moduleTimes.empty())
+    {
+        std::vector<std::pair<double, int64_t>> sortedTimes;
+        for (const auto& pair : moduleTimes)
+            sortedTimes.push_back({ pair.second, pair.first });
+        std::sort(sortedTimes.rbegin(), sortedTimes.rend());
+
+        std::printf("\nCPU per module, as a percentage of realtime:\n");
+
+        rack::contextSet(context);
+        for (const auto& pair : sortedTimes)
+        {
+            rack::engine::Module* const module = context->engine->getModule(pair.second);
+            std::printf("%8.3f%%  %s (%lld)\n",
+                        pair.first / audioTime * 100.0,
+                        module != nullptr ? module->model->getFullName().c_str() : "Removed module",
+                        static_cast<long long>(pair.second));
+        }
+        rack::contextSet(nullptr);
+    }
+
+    return 0;
+}
+
+// -----------------------------------------------------------------------------------------------------------
+
+END_NAMESPACE_DISTRHO
+
+int main(int argc, char* argv[])
+{
+    USE_NAMESPACE_DISTRHO;
+
+    RenderOptions options;
+
+    if (! parseOptions(argc, argv, options))
+    {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    return render(options);
+}
@@ -0,0 +1 @@
+../CardinalRemote.cpp
\ No newline at end of file
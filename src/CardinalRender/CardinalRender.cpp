@@ -0,0 +1 @@
+../CardinalRender.cpp
\ No newline at end of file
@@ -500,8 +500,14 @@ public:
 
         rack::window::WindowSetPluginUI(context->window, nullptr);
 
-        context->tlw = nullptr;
-        context->ui = nullptr;
+        {
+           #if DISTRHO_PLUGIN_WANT_PROGRAMS && DISTRHO_PLUGIN_WANT_DIRECT_ACCESS
+            // hand bank program switches back to the plugin thread
+            const MutexLocker cml(static_cast<CardinalBasePlugin*>(context->plugin)->bankSwitchMutex);
+           #endif
+            context->tlw = nullptr;
+            context->ui = nullptr;
+        }
 
        #if CARDINAL_VARIANT_MINI && ! DISTRHO_PLUGIN_WANT_DIRECT_ACCESS
         {
@@ -627,6 +633,15 @@ public:
         }
        #endif
 
+       #if DISTRHO_PLUGIN_WANT_PROGRAMS
+        // bank program switches happen here while the UI is open, so the rack widgets are only touched from this thread
+        if (context->pendingProgram >= 0)
+        {
+            const ScopedContext sc(this);
+            static_cast<CardinalBasePlugin*>(context->plugin)->stepBankProgram();
+        }
+       #endif
+
         if (filebrowserhandle != nullptr && fileBrowserIdle(filebrowserhandle))
         {
             {
@@ -1240,7 +1255,7 @@ protected:
         else
         {
             try {
-                context->patch->load(sfilename);
+                patchUtils::loadFromFile(sfilename);
             } catch (rack::Exception& e) {
                 std::string message = rack::string::f("Could not load patch: %s", e.what());
                 asyncDialog::create(message.c_str());
@@ -21,6 +21,12 @@ else ifeq ($(NAME),CardinalNative)
 CARDINAL_VARIANT = native
 else ifeq ($(NAME),CardinalSynth)
 CARDINAL_VARIANT = synth
+else ifeq ($(NAME),CardinalBench)
+CARDINAL_TOOL = true
+CARDINAL_VARIANT = main
+else ifeq ($(NAME),CardinalRender)
+CARDINAL_TOOL = true
+CARDINAL_VARIANT = main
 endif
 
 # --------------------------------------------------------------
@@ -96,6 +102,11 @@ FILES_UI += MenuBar.cpp
 FILES_UI += Window.cpp
 endif
 
+# command-line tools, built against a headless main variant
+ifeq ($(CARDINAL_TOOL),true)
+FILES_DSP += $(NAME).cpp
+endif
+
 ifeq ($(WINDOWS),true)
 FILES_UI += distrho.rc
 endif
@@ -411,7 +422,9 @@ BUILD_CXX_FLAGS += -DCARDINAL_PLUGIN_PREFIX='"$(PREFIX)"'
 # --------------------------------------------------------------
 # Enable all possible plugin types and setup resources
 
-ifeq ($(CARDINAL_VARIANT),main)
+ifeq ($(CARDINAL_TOOL),true)
+TARGETS = tool
+else ifeq ($(CARDINAL_VARIANT),main)
 TARGETS = clap jack lv2 vst3
 else ifeq ($(DSP_UI_SPLIT),true)
 TARGETS = lv2_sep
@@ -437,6 +450,18 @@ vst2: $(VST2_RESOURCES)
 
 vst3: $(VST3_RESOURCES)
 
+# --------------------------------------------------------------
+# Command-line tools, host the plugin directly through DPF
+
+ifeq ($(CARDINAL_TOOL),true)
+tool: $(TARGET_DIR)/$(NAME)$(APP_EXT)
+
+$(TARGET_DIR)/$(NAME)$(APP_EXT): $(OBJS_DSP) $(BUILD_DIR)/DistrhoPluginMain_STATIC.cpp.o
+	-@mkdir -p $(shell dirname $@)
+	@echo "Creating $(NAME) tool"
+	$(SILENT)$(CXX) $^ $(BUILD_CXX_FLAGS) $(LINK_FLAGS) $(EXTRA_DSP_LIBS) -o $@
+endif
+
 # --------------------------------------------------------------
 # Extra rules for macOS app bundle
 
@@ -21,14 +21,21 @@
 #include <mutex>
 #include <atomic>
 #include <tuple>
+#include <exception>
+#include <cstring>
 #include <pmmintrin.h>
 #include <unordered_map>
+#include <unordered_set>
 
 #include <engine/Engine.hpp>
 #include <engine/TerminalModule.hpp>
+#include <engine/SleepModule.hpp>
 #include <settings.hpp>
 #include <system.hpp>
 #include <random.hpp>
+#include <string.hpp>
+#include <asset.hpp>
+#include <context.hpp>
 #include <patch.hpp>
 #include <plugin.hpp>
 #include <mutex.hpp>
@@ -40,6 +47,7 @@
 
 #include "../CardinalRemote.hpp"
 #include "DistrhoUtils.hpp"
+#include "extra/ScopedDenormalDisable.hpp"
 
 
 // known terminal modules
@@ -50,11 +58,510 @@ namespace rack {
 namespace engine {
 
 
-static constexpr const int PORT_DIVIDER = 7;
 // Arbitrary prime number so it doesn't over- or under-estimate time of buffered processors.
 static constexpr const int METER_DIVIDER = 37;
 static constexpr const int METER_BUFFER_LEN = 32;
 static constexpr const float METER_TIME = 1.f;
+// Upper limit for the per-patch engine thread count
+static constexpr const int MAX_THREAD_COUNT = 16;
+// Limits for the per-patch fixed block size
+static constexpr const int MIN_BLOCK_SIZE = 16;
+static constexpr const int MAX_BLOCK_SIZE = 4096;
+// Number of events kept by the engine trace, one per module and block plus a few per block.
+// About 9 seconds of a 300 module patch in 256 frame blocks at 48 kHz, older events get overwritten
+static constexpr const size_t TRACE_CAPACITY = 1 << 19;
+// Number of params that can be smoothed at once, more jump straight to their value
+static constexpr const int SMOOTH_CAPACITY = 64;
+// Number of port changes waiting for the audio thread, more wait for it to catch up
+static constexpr const uint32_t PORT_CHANGE_CAPACITY = 1024;
+// Longest period handed to the offload worker at once, longer blocks are split
+static constexpr const int OFFLOAD_MAX_FRAMES = 1024;
+static_assert(OFFLOAD_MAX_FRAMES % BLOCK_MAX_FRAMES == 0, "offload periods must end on a block module chunk");
+
+
+/** 2-phase barrier based on spin-locking.
+*/
+struct SpinBarrier {
+	std::atomic<int> count{0};
+	std::atomic<uint8_t> step{0};
+	int threads = 0;
+
+	/** Must be called when no threads are calling wait().
+	*/
+	void setThreads(int threads) {
+		this->threads = threads;
+	}
+
+	void wait() {
+		uint8_t s = step;
+		if (count.fetch_add(1, std::memory_order_acq_rel) + 1 >= threads) {
+			// We're the last thread. Reset next phase.
+			count = 0;
+			// Allow other threads to exit wait()
+			step++;
+			return;
+		}
+
+		// Spin until the last thread begins waiting
+		for (uint32_t spins = 1;; spins++) {
+			if (step.load(std::memory_order_acquire) != s)
+				return;
+#if defined ARCH_X64
+			__builtin_ia32_pause();
+#endif
+			// Give up the time slice every now and then, in case the host has more busy threads than cores
+			if (spins % 1024 == 0)
+				std::this_thread::yield();
+		}
+	}
+};
+
+
+/** Barrier that spin-locks until yield() is called, and then all threads switch to a mutex.
+yield() should be called if it is likely that all threads will block for a while and continuing to spin-lock is unnecessary.
+Saves CPU power after yield is called.
+*/
+struct HybridBarrier {
+	std::atomic<int> count{0};
+	std::atomic<uint8_t> step{0};
+	int threads = 0;
+
+	std::atomic<bool> yielded{false};
+	std::mutex mutex;
+	std::condition_variable cv;
+
+	void setThreads(int threads) {
+		this->threads = threads;
+	}
+
+	void yield() {
+		yielded = true;
+	}
+
+	void wait() {
+		uint8_t s = step;
+		if (count.fetch_add(1, std::memory_order_acq_rel) + 1 >= threads) {
+			// We're the last thread. Reset next phase.
+			count = 0;
+			bool wasYielded = yielded;
+			yielded = false;
+			// Allow other threads to exit wait()
+			step++;
+			if (wasYielded) {
+				std::unique_lock<std::mutex> lock(mutex);
+				cv.notify_all();
+			}
+			return;
+		}
+
+		// Spin until the last thread begins waiting
+		while (!yielded.load(std::memory_order_relaxed)) {
+			if (step.load(std::memory_order_acquire) != s)
+				return;
+#if defined ARCH_X64
+			__builtin_ia32_pause();
+#endif
+		}
+
+		// Wait on mutex CV
+		std::unique_lock<std::mutex> lock(mutex);
+		cv.wait(lock, [&] {
+			return step != s;
+		});
+	}
+};
+
+
+struct EngineWorker {
+	Engine* engine;
+	int id;
+	std::thread thread;
+	bool running = false;
+	/** Random seed generation the thread was last seeded with, see Engine_seedRandom() */
+	uint32_t randomSeedGeneration = 0;
+
+	void start() {
+		DISTRHO_SAFE_ASSERT_RETURN(!running,);
+		running = true;
+		thread = std::thread([&] {
+			run();
+		});
+	}
+
+	void requestStop() {
+		running = false;
+	}
+
+	void join() {
+		DISTRHO_SAFE_ASSERT_RETURN(thread.joinable(),);
+		thread.join();
+	}
+
+	void run();
+};
+
+
+/** A cable in the propagation schedule, see Engine_updateModuleSteps().
+*/
+struct EngineCableStep {
+	const Output* output;
+	Input* input;
+};
+
+
+/** Sleep state of a module allowed to sleep, see Module__doProcessSleep().
+Only used by the thread processing the module.
+A new schedule starts with fresh states, so publishing one wakes every module up.
+*/
+struct EngineSleep {
+	bool asleep = false;
+	/** Set if the module tells when it is quiescent */
+	SleepModule* sleepModule = nullptr;
+	/** Number of consecutive frames with silent inputs and a quiescent module */
+	int quietFrames = 0;
+	/** Param values since the module went quiet, in EngineSchedule::sleepParams */
+	float* params = nullptr;
+	uint32_t paramCount = 0;
+};
+
+
+struct EngineSchedule;
+
+
+/** A module processed by the offload worker, one period behind the rest of the patch, see Engine_setModuleOffloaded().
+Cables connect to its own ports instead of the module's, so the audio thread and the worker never share any.
+During a period, the audio thread records its inputs into one half of the buffers and plays back the outputs of the other half,
+which the worker computes at the same time from the inputs of the previous period.
+*/
+struct EngineOffload {
+	Module* module;
+	EngineSchedule* schedule;
+	std::vector<Input> inputs;
+	std::vector<Output> outputs;
+	/** Voltages and channel counts of every port for OFFLOAD_MAX_FRAMES frames, inputs then outputs, for each half.
+	In EngineSchedule::offloadVoltages and EngineSchedule::offloadChannels.
+	*/
+	float* voltages[2];
+	uint8_t* channels[2];
+	/** Position of the module in EngineSchedule::moduleIds */
+	uint32_t traceIndex;
+	/** Time spent by the worker on the current job, while tracing */
+	float traceDuration = 0.f;
+};
+
+
+/** A module in the propagation schedule, followed by the range of cable steps to run right after processing it.
+*/
+struct EngineModuleStep {
+	Module* module;
+	uint32_t cablesBegin;
+	uint32_t cablesEnd;
+	/** Position of the module in EngineSchedule::moduleIds */
+	uint32_t traceIndex;
+	/** NULL unless the module is allowed to sleep */
+	EngineSleep* sleep;
+	/** NULL unless the module is offloaded, the step then only exchanges its voltages with the worker */
+	EngineOffload* offload;
+	/** Memory of the module used on every frame, see EngineModuleStep_prefetch() */
+	const void* moduleInternal;
+	const Input* inputs;
+	const Output* outputs;
+};
+
+
+/** A module processed once per chunk of up to BLOCK_MAX_FRAMES frames, see Engine_updateBlockModules().
+*/
+struct EngineBlockModule {
+	Module* module = nullptr;
+	/** Set for regular modules */
+	BlockModule* blockModule = nullptr;
+	/** Set for terminal modules */
+	BlockTerminalModule* terminalModule = nullptr;
+	/** Output each input is connected to, for passing on its channel count */
+	std::vector<Output*> sources;
+	/** Buffer of the inputs of terminal modules, in EngineSchedule::blockVoltages */
+	float* inputBuffer = nullptr;
+	std::vector<const float*> inputs;
+	std::vector<float*> outputs;
+	/** Range of the cable steps of its outputs */
+	uint32_t cablesBegin = 0;
+	uint32_t cablesEnd = 0;
+	/** Position of the module in EngineSchedule::moduleIds */
+	uint32_t traceIndex = 0;
+};
+
+
+static const float zeroBlockVoltages[BLOCK_MAX_FRAMES * PORT_MAX_CHANNELS] = {};
+
+
+/** Mixes the bits of a module or cable ID.
+IDs are random in new patches but sequential in old ones, so their low bits cannot be used as they are.
+*/
+static inline uint64_t EngineIdMap_hash(uint64_t x) {
+	// splitmix64 finalizer
+	x ^= x >> 30;
+	x *= UINT64_C(0xbf58476d1ce4e5b9);
+	x ^= x >> 27;
+	x *= UINT64_C(0x94d049bb133111eb);
+	x ^= x >> 31;
+	return x;
+}
+
+static inline uint64_t EngineIdMap_hash(const std::tuple<int64_t, int>& key) {
+	return EngineIdMap_hash(uint64_t(std::get<0>(key)) ^ EngineIdMap_hash(uint64_t(std::get<1>(key))));
+}
+
+
+/** Open addressing hash map from IDs to non-null pointers, stored in a single array of slots.
+Uses linear probing with a load factor of at most 1/2, so most lookups touch a single cache line.
+Removals shift the following entries back instead of leaving tombstones.
+*/
+template <typename Key, typename T>
+struct EngineIdMap {
+	struct Slot {
+		Key key;
+		T* value;
+	};
+	std::vector<Slot> slots;
+	size_t count = 0;
+
+	size_t size() const {
+		return count;
+	}
+
+	bool empty() const {
+		return count == 0;
+	}
+
+	/** Returns the value at `key`, or NULL if not found */
+	T* get(const Key& key) const {
+		if (count == 0)
+			return NULL;
+		const size_t mask = slots.size() - 1;
+		for (size_t i = EngineIdMap_hash(key) & mask;; i = (i + 1) & mask) {
+			const Slot& slot = slots[i];
+			if (!slot.value)
+				return NULL;
+			if (slot.key == key)
+				return slot.value;
+		}
+	}
+
+	/** Inserts or replaces the value at `key`. `value` must not be NULL. */
+	void set(const Key& key, T* value) {
+		if ((count + 1) * 2 > slots.size())
+			resize(std::max<size_t>(16, slots.size() * 2));
+		const size_t mask = slots.size() - 1;
+		for (size_t i = EngineIdMap_hash(key) & mask;; i = (i + 1) & mask) {
+			Slot& slot = slots[i];
+			if (!slot.value) {
+				slot.key = key;
+				slot.value = value;
+				count++;
+				return;
+			}
+			if (slot.key == key) {
+				slot.value = value;
+				return;
+			}
+		}
+	}
+
+	void erase(const Key& key) {
+		if (count == 0)
+			return;
+		const size_t mask = slots.size() - 1;
+		size_t i = EngineIdMap_hash(key) & mask;
+		for (;; i = (i + 1) & mask) {
+			if (!slots[i].value)
+				return;
+			if (slots[i].key == key)
+				break;
+		}
+		// Move back each following entry of the run that can be placed in the hole
+		for (size_t j = (i + 1) & mask; slots[j].value; j = (j + 1) & mask) {
+			const size_t home = EngineIdMap_hash(slots[j].key) & mask;
+			// Entry j may move to i only if its home is not cyclically within (i, j]
+			if (((j - home) & mask) >= ((j - i) & mask)) {
+				slots[i] = slots[j];
+				i = j;
+			}
+		}
+		slots[i].value = NULL;
+		count--;
+	}
+
+	void clear() {
+		slots.clear();
+		count = 0;
+	}
+
+	/** Calls `f(key, value)` for each entry, in no particular order */
+	template <typename F>
+	void forEach(F f) const {
+		for (const Slot& slot : slots) {
+			if (slot.value)
+				f(slot.key, slot.value);
+		}
+	}
+
+private:
+	void resize(size_t capacity) {
+		std::vector<Slot> oldSlots(capacity, Slot{Key(), NULL});
+		oldSlots.swap(slots);
+		count = 0;
+		for (const Slot& slot : oldSlots) {
+			if (slot.value)
+				set(slot.key, slot.value);
+		}
+	}
+};
+
+
+/** Everything the audio thread needs to process the patch, see Engine_updateSchedule().
+Its layout is never changed once published, edits publish a new schedule instead.
+Vectors are sized before publishing; the ones documented as such hold scratch state that only the thread processing the schedule writes, without ever resizing them.
+*/
+struct EngineSchedule {
+	/** Regular modules in engine order, for expanders */
+	std::vector<Module*> modules;
+	/** Every module sorted by ID, their positions index the per-module arrays below */
+	std::vector<std::pair<int64_t, Module*>> moduleIds;
+	/** Every module by ID, a copy of Engine::Internal::modulesCache for looking up expanders on the audio thread */
+	EngineIdMap<int64_t, Module> modulesCache;
+	/** Time spent processing each module of `moduleIds` during the current block, while tracing */
+	std::vector<float> traceDurations;
+	/** Sleep state of the modules allowed to sleep, in the order they are processed.
+	Reserved up front, so the steps can point into it.
+	*/
+	std::vector<EngineSleep> sleeps;
+	std::vector<float> sleepParams;
+	/** Position in `sleeps` of each module of `moduleIds`, see EngineSchedule_getSleep() */
+	std::vector<int32_t> sleepIndexes;
+	/** Expanders of `modules` that have message buffers, cleared and gathered again by the audio thread at the start of each block.
+	Scratch state, reserved for all of them, so it never allocates.
+	*/
+	std::vector<Module::Expander*> messageExpanders;
+
+	/** Terminal modules first, then regular modules in engine order.
+	Their buffers are the only part the audio thread writes to.
+	*/
+	std::vector<EngineBlockModule> blockModules;
+	/** Buffers of all block modules, one after the other in the same order */
+	std::vector<float> blockVoltages;
+
+	/** Propagation schedule, everything processed frame by frame in execution order, see Engine_updateModuleSteps().
+	Empty while a topology batch is open, so nothing is processed until the patch is complete.
+	*/
+	std::vector<EngineCableStep> cableSteps;
+	std::vector<EngineModuleStep> terminalModuleSteps;
+	std::vector<EngineModuleStep> moduleSteps;
+
+	/** Modules grouped by topological level, see Engine_updateLevels().
+	Each level is split into `threadCount` contiguous slices, one per thread.
+	*/
+	std::vector<EngineModuleStep> levelModules;
+	/** Start of each (level, thread) slice in `levelModules`, followed by an end marker. */
+	std::vector<uint32_t> levelSlices;
+	int levelCount = 0;
+	/** Cables stepped by `levelModules`, laid out in the same order. */
+	std::vector<EngineCableStep> levelCableSteps;
+	/** Cables going to a module of the same or an earlier level, stepped after all levels are done. */
+	std::vector<EngineCableStep> feedbackCableSteps;
+
+	/** Offloaded modules in engine order, reserved up front so the steps can point into it.
+	The fields below are only written by the audio thread, between periods while the worker is idle.
+	*/
+	std::vector<EngineOffload> offloads;
+	std::vector<float> offloadVoltages;
+	std::vector<uint8_t> offloadChannels;
+	/** Half of the buffers the current period is recorded into, the worker uses the other one */
+	int offloadHalf = 0;
+	/** Frames recorded in the current period */
+	int offloadFrame = 0;
+	/** Frames and first engine frame of the period given to the worker */
+	int offloadJobFrames = 0;
+	int64_t offloadJobStart = 0;
+	bool offloadJobTraced = false;
+	/** Frames of the job the worker is done with, written by the worker */
+	std::atomic<int> offloadProgress{0};
+};
+
+
+/** A change to the state of a port, applied between two blocks, see Engine_queuePortChange().
+*/
+struct EnginePortChange {
+	enum Type : uint8_t {
+		CONNECT,
+		DISCONNECT,
+		/** Clears the outputs of `module`, after it was bypassed or unbypassed */
+		CLEAR_OUTPUTS,
+	};
+	Type type;
+	Port* port;
+	Module* module;
+};
+
+
+/** A span of time recorded by the engine trace, see Engine_saveTrace().
+*/
+struct EngineTraceEvent {
+	enum Type : uint8_t {
+		BLOCK,
+		LOCK_WAIT,
+		SMOOTHING,
+		MODULE,
+	};
+	double time;
+	float duration;
+	Type type;
+	/** Number of frames for BLOCK, module ID for MODULE */
+	int64_t value;
+};
+
+
+/** Ring buffer of the latest trace events, only written by the audio thread.
+*/
+struct EngineTrace {
+	/** Allocated the first time tracing is enabled, and kept afterwards */
+	std::vector<EngineTraceEvent> events;
+	std::atomic<uint64_t> count{0};
+	std::atomic<bool> enabled{false};
+
+	void push(EngineTraceEvent::Type type, double time, double duration, int64_t value = 0) {
+		const uint64_t n = count.load(std::memory_order_relaxed);
+		events[n % TRACE_CAPACITY] = {time, static_cast<float>(duration), type, value};
+		count.store(n + 1, std::memory_order_release);
+	}
+};
+
+
+/** A param moving towards a value, see Engine::setParamSmoothValue().
+Any thread can start or retarget a ramp, only the audio thread ends it once the param settles.
+The fields are only written while `state` is WRITING, and every state change bumps its version so that stale compare-exchanges fail.
+Starting a ramp is serialized by `Engine::Internal::smoothClaiming`, so a param has at most one ramp, ACTIVE or WRITING.
+*/
+struct EngineSmoothRamp {
+	enum State : uint64_t {
+		FREE = 0,
+		WRITING = 1,
+		ACTIVE = 2,
+		STATE_MASK = 3,
+		VERSION = 4,
+	};
+	std::atomic<uint64_t> state{FREE};
+	std::atomic<Module*> module{nullptr};
+	std::atomic<int> paramId{0};
+	std::atomic<float> value{0.f};
+
+	/** Returns `state` moved to `newState` with the next version */
+	static uint64_t next(uint64_t state, State newState) {
+		return ((state & ~uint64_t(STATE_MASK)) + VERSION) | newState;
+	}
+};
+
+
+struct EngineStagedPatch;
 
 
 struct Engine::Internal {
@@ -64,11 +571,11 @@ struct Engine::Internal {
 	std::set<ParamHandle*> paramHandles;
 
 	// moduleId
-	std::map<int64_t, Module*> modulesCache;
+	EngineIdMap<int64_t, Module> modulesCache;
 	// cableId
-	std::map<int64_t, Cable*> cablesCache;
+	EngineIdMap<int64_t, Cable> cablesCache;
 	// (moduleId, paramId)
-	std::map<std::tuple<int64_t, int>, ParamHandle*> paramHandlesCache;
+	EngineIdMap<std::tuple<int64_t, int>, ParamHandle> paramHandlesCache;
 
 	float sampleRate = 0.f;
 	float sampleTime = 0.f;
@@ -90,18 +597,111 @@ struct Engine::Internal {
 #endif
 
 	// Parameter smoothing
-	Module* smoothModule = NULL;
-	int smoothParamId = 0;
-	float smoothValue = 0.f;
+	EngineSmoothRamp smoothRamps[SMOOTH_CAPACITY];
+	/** Number of ramps claimed, never lower than the number of active ones */
+	std::atomic<int> smoothCount{0};
+	/** Held while starting a ramp, only ever tried so that the audio thread doesn't wait for it */
+	std::atomic<bool> smoothClaiming{false};
 
 	// Remote control
 	remoteUtils::RemoteDetails* remoteDetails = nullptr;
 
+	/** Modules allowed to sleep, see Engine_setModuleCanSleep(). */
+	std::unordered_set<Module*> sleepModules;
+	/** Number of modules asleep at the end of the last block */
+	std::atomic<int> sleepingCount{0};
+
+	// Offloading, see Engine_setModuleOffloaded()
+	std::unordered_set<Module*> offloadModules;
+	/** Started when the first module is offloaded */
+	std::thread offloadThread;
+	std::mutex offloadMutex;
+	std::condition_variable offloadCv;
+	/** Guarded by `offloadMutex` */
+	bool offloadRunning = false;
+	EngineSchedule* offloadJob = nullptr;
+	/** Schedule of the job the worker is processing, NULL while it is idle */
+	std::atomic<EngineSchedule*> offloadSchedule{nullptr};
+	/** Schedule of the last job, whose outputs are played back during the next period. Only written by the audio thread. */
+	std::atomic<EngineSchedule*> offloadPlaySchedule{nullptr};
+	/** Frames of the last period, by which offloaded modules lag behind */
+	std::atomic<int> offloadLatency{0};
+
+	/** Patches built ahead of Engine::fromJson(), see Engine_stagePatch(). Only used by threads loading patches. */
+	std::vector<EngineStagedPatch*> stagedPatches;
+	std::mutex stagedPatchesMutex;
+
+	// Tracing, see Engine_setTracing()
+	EngineTrace trace;
+	/** Whether the current block is traced, read by workers */
+	bool traceBlock = false;
+	float traceSmoothing = 0.f;
+	/** Set from the CARDINAL_ENGINE_TRACE environment variable, saves the trace on exit */
+	double traceSecondsOnExit = 0.0;
+
+	// Random seed, see Engine_setRandomSeed()
+	std::atomic<uint64_t> randomSeed{0};
+	/** Incremented each time the seed is set, 0 while threads keep their time based seed */
+	std::atomic<uint32_t> randomSeedGeneration{0};
+	/** Generation the audio thread was last seeded with */
+	uint32_t audioRandomSeedGeneration = 0;
+
+	// Multi-threading, opt-in per patch. 1 means everything runs serially on the audio thread.
+	int threadCount = 1;
+	/** Frames of the blocks that host buffers are split into, 0 to process each host buffer as one block.
+	Opt-in per patch, read by the plugin on the audio thread.
+	*/
+	std::atomic<int> blockSize{0};
+	std::vector<EngineWorker> workers;
+	HybridBarrier engineBarrier;
+	SpinBarrier workerBarrier;
+	// For worker threads
+	Context* context = nullptr;
+
+	// Schedules, see Engine_publishSchedule()
+	/** Latest published schedule, never NULL. */
+	std::atomic<EngineSchedule*> schedule{nullptr};
+	/** Schedule used by the block being stepped, NULL between blocks. */
+	std::atomic<EngineSchedule*> activeSchedule{nullptr};
+	/** Replaced schedules, deleted once the audio thread stops using them. */
+	std::vector<EngineSchedule*> retiredSchedules;
+	/** Whether the empty schedule of the current topology batch is published. */
+	bool batchScheduled = false;
+
+	// Port changes, see Engine_queuePortChange()
+	/** Ring buffer of changes, written under `mutex` and applied by whoever holds `portChangesBusy`. */
+	EnginePortChange portChanges[PORT_CHANGE_CAPACITY];
+	/** Changes written so far, only used under `mutex` */
+	uint32_t portChangesQueued = 0;
+	/** Changes that can be applied, published after the schedule they go with */
+	std::atomic<uint32_t> portChangesWritten{0};
+	std::atomic<uint32_t> portChangesRead{0};
+	/** Held by the audio thread while stepping a block, and by writers applying changes between blocks */
+	std::atomic<bool> portChangesBusy{false};
+
+	// Incremental topology, see Engine_orderCable()
+	/** Position of each module in `modules`. Terminal modules are not ordered. */
+	std::unordered_map<Module*, size_t> moduleIndexes;
+	/** Cable connected to each input port, an input can only have one. */
+	std::unordered_map<const Input*, Cable*> inputCables;
+	/** Cables going backwards in the module order, because they close a feedback loop. */
+	std::unordered_set<Cable*> backwardCables;
+	/** Nesting count of Engine_beginTopologyBatch(), module ordering is deferred while non-zero. */
+	int topologyBatch = 0;
+	bool topologyDirty = false;
+
 	/** Mutex that guards the Engine state, such as settings, Modules, and Cables.
-	Writers lock when mutating the engine's state or stepping the block.
+	Writers lock when mutating the engine's state.
 	Readers lock when using the engine's state.
+	The audio thread never locks it, it only uses published schedules.
 	*/
 	SharedMutex mutex;
+	/** Mutex that keeps the audio thread away while the state of modules themselves changes, such as when loading, resetting or randomizing them.
+	Read-locked while stepping the block, write-locked before `mutex` when needed.
+	Writers then also wait for the offload worker with Engine_waitForOffloads(), it can't start a new job until they are done.
+	Cables, bypassing and other edits of the patch never lock it, see Engine_queuePortChange().
+	*/
+	SharedMutex processMutex;
 };
 
 
@@ -116,13 +716,86 @@ struct Module::Internal {
 };
 
 
-static void Engine_updateExpander_NoLock(Engine* that, Module* module, bool side) {
+/** Returns the position of a module in `moduleIds`, or its size if not found.
+*/
+static size_t EngineSchedule_getModuleIndex(const EngineSchedule* schedule, int64_t moduleId) {
+	auto it = std::lower_bound(schedule->moduleIds.begin(), schedule->moduleIds.end(), moduleId, [](const std::pair<int64_t, Module*>& a, int64_t id) {
+		return a.first < id;
+	});
+	if (it == schedule->moduleIds.end() || it->first != moduleId)
+		return schedule->moduleIds.size();
+	return it - schedule->moduleIds.begin();
+}
+
+
+static constexpr const int32_t SLEEP_DISABLED = -1;
+static constexpr const int32_t SLEEP_UNPLACED = -2;
+
+
+/** Returns the sleep state of the module at `index` in `moduleIds`, or NULL if it isn't allowed to sleep.
+States are placed on first use, so they end up in the order modules are processed.
+*/
+static EngineSleep* EngineSchedule_getSleep(EngineSchedule* schedule, size_t index) {
+	int32_t& sleepIndex = schedule->sleepIndexes[index];
+	if (sleepIndex == SLEEP_DISABLED)
+		return nullptr;
+	if (sleepIndex == SLEEP_UNPLACED) {
+		Module* const module = schedule->moduleIds[index].second;
+		sleepIndex = schedule->sleeps.size();
+		schedule->sleeps.emplace_back();
+		EngineSleep& sleep = schedule->sleeps.back();
+		sleep.sleepModule = dynamic_cast<SleepModule*>(module);
+		sleep.paramCount = module->params.size();
+		sleep.params = schedule->sleepParams.data() + schedule->sleepParams.size();
+		schedule->sleepParams.resize(schedule->sleepParams.size() + sleep.paramCount);
+	}
+	return &schedule->sleeps[sleepIndex];
+}
+
+
+static EngineModuleStep EngineSchedule_makeModuleStep(EngineSchedule* schedule, Module* module, uint32_t cablesBegin, uint32_t cablesEnd, bool canSleep) {
+	const uint32_t traceIndex = EngineSchedule_getModuleIndex(schedule, module->id);
+	EngineModuleStep step;
+	step.module = module;
+	step.cablesBegin = cablesBegin;
+	step.cablesEnd = cablesEnd;
+	step.traceIndex = traceIndex;
+	step.sleep = canSleep ? EngineSchedule_getSleep(schedule, traceIndex) : nullptr;
+	step.offload = nullptr;
+	for (EngineOffload& offload : schedule->offloads) {
+		if (offload.module == module) {
+			step.sleep = nullptr;
+			step.offload = &offload;
+		}
+	}
+	step.moduleInternal = module->internal;
+	step.inputs = module->inputs.data();
+	step.outputs = module->outputs.data();
+	return step;
+}
+
+
+/** Returns the step of a cable, pointing at the ports of offloaded modules instead of their own.
+*/
+static EngineCableStep EngineSchedule_makeCableStep(EngineSchedule* schedule, Output* output, const Cable* cable) {
+	EngineCableStep step = {output, &cable->inputModule->inputs[cable->inputId]};
+	for (EngineOffload& offload : schedule->offloads) {
+		if (offload.module == cable->outputModule)
+			step.output = &offload.outputs[cable->outputId];
+		if (offload.module == cable->inputModule)
+			step.input = &offload.inputs[cable->inputId];
+	}
+	return step;
+}
+
+
+static void Engine_updateExpander(const EngineSchedule* schedule, Module* module, bool side) {
 	Module::Expander& expander = side ? module->rightExpander : module->leftExpander;
 	Module* oldExpanderModule = expander.module;
 
 	if (expander.moduleId >= 0) {
 		if (!expander.module || expander.module->id != expander.moduleId) {
-			expander.module = that->getModule_NoLock(expander.moduleId);
+			expander.module = schedule->modulesCache.get(expander.moduleId);
 		}
 	}
 	else {
@@ -140,22 +813,27 @@ static void Engine_updateExpander_NoLock(Engine* that, Module* module, bool side
 }
 
 
-static void Cable_step(Cable* that) {
-	Output* output = &that->outputModule->outputs[that->outputId];
-	Input* input = &that->inputModule->inputs[that->inputId];
-	// Match number of polyphonic channels to output port
-	const int channels = output->channels;
-	// Copy all voltages from output to input
-	for (int c = 0; c < channels; c++) {
-		if (!std::isfinite(output->voltages[c]))
-			__builtin_unreachable();
-		input->voltages[c] = output->voltages[c];
-	}
-	// Set higher channel voltages to 0
-	for (int c = channels; c < input->channels; c++) {
-		input->voltages[c] = 0.f;
+/** Copies the voltages of a cable's output to its input, zeroing channels above the output's channel count.
+All PORT_MAX_CHANNELS channels are always written with aligned vectors, which is cheaper than a loop that depends on the channel count.
+*/
+static inline void Cable_step(const EngineCableStep& step) {
+	const int channels = step.output->channels;
+	const float* const src = step.output->voltages;
+	float* const dst = step.input->voltages;
+	const __m128i count = _mm_set1_epi32(channels);
+	for (int c = 0; c < PORT_MAX_CHANNELS; c += 4) {
+		const __m128 mask = _mm_castsi128_ps(_mm_cmplt_epi32(_mm_setr_epi32(c, c + 1, c + 2, c + 3), count));
+		_mm_store_ps(dst + c, _mm_and_ps(_mm_load_ps(src + c), mask));
 	}
-	input->channels = channels;
+	step.input->channels = channels;
+}
+
+
+/** Steps the cables in `[begin, end)` of a schedule.
+*/
+static inline void Engine_stepCables(const EngineCableStep* const cableSteps, const uint32_t begin, const uint32_t end) {
+	for (uint32_t i = begin; i < end; i++)
+		Cable_step(cableSteps[i]);
 }
 
 
@@ -183,294 +861,1616 @@ static void Port_step(Port* that, float deltaTime) {
 #endif
 
 
-static void TerminalModule__doProcess(TerminalModule* const terminalModule, const Module::ProcessArgs& args, bool input) {
-	// Step module
-	if (input) {
-		terminalModule->processTerminalInput(args);
-		for (Output& output : terminalModule->outputs) {
-			for (Cable* cable : output.cables)
-				Cable_step(cable);
+static void TerminalModule__doProcess(TerminalModule* const terminalModule, const Module::ProcessArgs& args, bool input, float* const traceDuration) {
+	double startTime;
+	if (traceDuration) {
+		startTime = system::getTime();
+	}
+
+	// Step module
+	if (input)
+		terminalModule->processTerminalInput(args);
+	else
+		terminalModule->processTerminalOutput(args);
+
+	if (traceDuration) {
+		*traceDuration += system::getTime() - startTime;
+	}
+}
+
+
+#ifndef HEADLESS
+/** Adds `samples` CPU meter measurements of `duration` seconds each, one per METER_DIVIDER frames.
+*/
+static void Module__addMeterSamples(Module::Internal* const internal, float duration, int samples, float sampleTime) {
+	internal->meterSamples += samples;
+	internal->meterDurationTotal += duration * samples;
+
+	// Seconds we've been measuring
+	float meterTime = internal->meterSamples * METER_DIVIDER * sampleTime;
+
+	if (meterTime >= METER_TIME) {
+		// Push time to buffer
+		if (internal->meterSamples > 0) {
+			internal->meterIndex++;
+			internal->meterIndex %= METER_BUFFER_LEN;
+			internal->meterBuffer[internal->meterIndex] = internal->meterDurationTotal / internal->meterSamples;
+		}
+		// Reset total
+		internal->meterSamples = 0;
+		internal->meterDurationTotal = 0.f;
+	}
+}
+#endif
+
+
+/** Returns whether every channel of these ports is at zero.
+*/
+template <class TPort>
+static inline bool Ports_areSilent(const std::vector<TPort>& ports) {
+	for (const TPort& port : ports) {
+		for (int c = 0; c < port.channels; c++) {
+			if (port.voltages[c] != 0.f)
+				return false;
+		}
+	}
+	return true;
+}
+
+
+static inline bool EngineSleep_paramsChanged(const EngineSleep* sleep, const Module* module) {
+	for (uint32_t i = 0; i < sleep->paramCount; i++) {
+		if (module->params[i].value != sleep->params[i])
+			return true;
+	}
+	return false;
+}
+
+
+/** Processes a module for one frame.
+`traceDuration` is NULL unless tracing, in which case the time spent is added to it.
+*/
+static void Module__doProcess(Module* const module, const Module::ProcessArgs& args, float* const traceDuration) {
+	Module::Internal* const internal = module->internal;
+
+#ifndef HEADLESS
+	// This global setting can change while the function is running, so use a local variable.
+	bool meterEnabled = settings::cpuMeter && (args.frame % METER_DIVIDER == 0);
+#else
+	const bool meterEnabled = false;
+#endif
+
+	// Start CPU timer
+	double startTime;
+	if (meterEnabled || traceDuration) {
+		startTime = system::getTime();
+	}
+
+	// Step module
+	if (!internal->bypassed)
+		module->process(args);
+	else
+		module->processBypass(args);
+
+	// Stop CPU timer
+	if (meterEnabled || traceDuration) {
+		double endTime = system::getTime();
+		// Subtract call time of getTime() itself, since we only want to measure process() time.
+		double endTime2 = system::getTime();
+		float duration = (endTime - startTime) - (endTime2 - endTime);
+
+#ifndef HEADLESS
+		if (meterEnabled)
+			Module__addMeterSamples(internal, duration, 1, args.sampleTime);
+#endif
+		if (traceDuration)
+			*traceDuration += duration;
+	}
+}
+
+
+/** Processes a module allowed to sleep for one frame, see SleepModule.
+While asleep, only checks whether it should wake up.
+*/
+static void Module__doProcessSleep(Module* const module, EngineSleep* const sleep, const Module::ProcessArgs& args, float* const traceDuration) {
+	if (sleep->asleep) {
+		if (Ports_areSilent(module->inputs) && !EngineSleep_paramsChanged(sleep, module))
+			return;
+		sleep->asleep = false;
+		sleep->quietFrames = 0;
+	}
+
+	Module__doProcess(module, args, traceDuration);
+
+	// Bypassed modules only pass their inputs through
+	if (module->internal->bypassed || !Ports_areSilent(module->inputs)) {
+		sleep->quietFrames = 0;
+		return;
+	}
+	if (!(sleep->sleepModule ? sleep->sleepModule->isQuiescent() : Ports_areSilent(module->outputs))) {
+		sleep->quietFrames = 0;
+		return;
+	}
+
+	if (sleep->quietFrames == 0) {
+		// Params must stay the same from now on
+		for (uint32_t i = 0; i < sleep->paramCount; i++)
+			sleep->params[i] = module->params[i].value;
+	}
+	else if (EngineSleep_paramsChanged(sleep, module)) {
+		sleep->quietFrames = 0;
+		return;
+	}
+
+	if (++sleep->quietFrames < (sleep->sleepModule ? 1 : SLEEP_FRAMES))
+		return;
+
+	sleep->asleep = true;
+	for (Output& output : module->outputs)
+		std::memset(output.voltages, 0, sizeof(output.voltages));
+}
+
+
+/** Starts loading the memory a step uses on every frame, while the previous one is processed.
+Modules and their ports are allocated by plugins, so unlike the schedule they can't be laid out in processing order.
+*/
+static inline void EngineModuleStep_prefetch(const EngineModuleStep& step) {
+	__builtin_prefetch(step.module);
+	__builtin_prefetch(step.moduleInternal);
+	__builtin_prefetch(step.inputs);
+	__builtin_prefetch(step.outputs);
+}
+
+
+static inline float* EngineOffload_voltages(EngineOffload* offload, int half, size_t port, int frame) {
+	return offload->voltages[half] + (port * OFFLOAD_MAX_FRAMES + frame) * PORT_MAX_CHANNELS;
+}
+
+
+static inline uint8_t& EngineOffload_channels(EngineOffload* offload, int half, size_t port, int frame) {
+	return offload->channels[half][port * OFFLOAD_MAX_FRAMES + frame];
+}
+
+
+/** Records the inputs of an offloaded module for the current frame, and plays back the outputs the worker made for it.
+Only waits when the worker is behind, which means it is busier than the rest of the patch.
+*/
+static void EngineOffload_step(EngineOffload* const offload) {
+	EngineSchedule* const schedule = offload->schedule;
+	const int frame = schedule->offloadFrame;
+	const int half = schedule->offloadHalf;
+
+	for (size_t i = 0; i < offload->inputs.size(); i++) {
+		const Input& input = offload->inputs[i];
+		std::memcpy(EngineOffload_voltages(offload, half, i, frame), input.voltages, sizeof(input.voltages));
+		EngineOffload_channels(offload, half, i, frame) = input.channels;
+	}
+
+	const size_t inputCount = offload->inputs.size();
+	if (frame < schedule->offloadJobFrames) {
+		for (uint32_t spins = 1; schedule->offloadProgress.load(std::memory_order_acquire) <= frame; spins++) {
+#if defined ARCH_X64
+			__builtin_ia32_pause();
+#endif
+			if (spins % 1024 == 0)
+				std::this_thread::yield();
+		}
+		for (size_t i = 0; i < offload->outputs.size(); i++) {
+			Output& output = offload->outputs[i];
+			std::memcpy(output.voltages, EngineOffload_voltages(offload, half ^ 1, inputCount + i, frame), sizeof(output.voltages));
+			output.channels = EngineOffload_channels(offload, half ^ 1, inputCount + i, frame);
+		}
+	}
+	else {
+		// This period is longer than the previous one, or the module was just offloaded
+		for (Output& output : offload->outputs)
+			std::memset(output.voltages, 0, sizeof(output.voltages));
+	}
+}
+
+
+static inline void EngineModuleStep_process(const EngineModuleStep& step, const Module::ProcessArgs& args, float* const traceDurations) {
+	if (step.offload) {
+		EngineOffload_step(step.offload);
+		return;
+	}
+	float* const traceDuration = traceDurations ? traceDurations + step.traceIndex : nullptr;
+	if (step.sleep)
+		Module__doProcessSleep(step.module, step.sleep, args, traceDuration);
+	else
+		Module__doProcess(step.module, args, traceDuration);
+}
+
+
+static void Module__doProcessBlock(BlockModule* const module, const BlockProcessArgs& args, float* const traceDuration) {
+#ifndef HEADLESS
+	// This global setting can change while the function is running, so use a local variable.
+	bool meterEnabled = settings::cpuMeter;
+#else
+	const bool meterEnabled = false;
+#endif
+
+	// Start CPU timer
+	double startTime;
+	if (meterEnabled || traceDuration) {
+		startTime = system::getTime();
+	}
+
+	// Step module
+	module->processBlock(args);
+
+	// Stop CPU timer
+	if (meterEnabled || traceDuration) {
+		double endTime = system::getTime();
+		// Subtract call time of getTime() itself, since we only want to measure processBlock() time.
+		double endTime2 = system::getTime();
+		float duration = (endTime - startTime) - (endTime2 - endTime);
+
+#ifndef HEADLESS
+		// Count the frames that process() would have been measured on
+		const int64_t samples = (args.frame + args.frames + METER_DIVIDER - 1) / METER_DIVIDER - (args.frame + METER_DIVIDER - 1) / METER_DIVIDER;
+		if (meterEnabled && samples > 0)
+			Module__addMeterSamples(module->internal, duration / args.frames, samples, args.sampleTime);
+#endif
+		if (traceDuration)
+			*traceDuration += duration;
+	}
+}
+
+
+/** Processes block modules for the next `frames` frames, before stepping them.
+*/
+static void Engine_processBlockModules(Engine* that, EngineSchedule* schedule, int frames) {
+	Engine::Internal* internal = that->internal;
+
+	BlockProcessArgs args;
+	args.sampleRate = internal->sampleRate;
+	args.sampleTime = internal->sampleTime;
+	args.frame = internal->frame;
+	args.frames = frames;
+
+	float* const traceDurations = internal->traceBlock ? schedule->traceDurations.data() : nullptr;
+
+	for (EngineBlockModule& blockModule : schedule->blockModules) {
+		args.inputs = blockModule.inputs.data();
+		args.outputs = blockModule.outputs.data();
+
+		if (blockModule.terminalModule) {
+			const double startTime = traceDurations ? system::getTime() : 0.0;
+			blockModule.terminalModule->processTerminalInputBlock(args);
+			if (traceDurations)
+				traceDurations[blockModule.traceIndex] += system::getTime() - startTime;
+			continue;
+		}
+
+		// Sources were processed earlier in this loop, so their channel count is up to date
+		Module* const module = blockModule.module;
+		for (size_t i = 0; i < blockModule.sources.size(); i++) {
+			if (Output* const source = blockModule.sources[i])
+				module->inputs[i].channels = source->channels;
+		}
+		Module__doProcessBlock(blockModule.blockModule, args, traceDurations ? traceDurations + blockModule.traceIndex : nullptr);
+	}
+}
+
+
+/** Sends one frame of block module outputs through their cables, so per-frame modules see them like any other output.
+*/
+static void Engine_stepBlockModuleOutputs(Engine* that, const EngineSchedule* schedule, int chunkFrame) {
+	for (const EngineBlockModule& blockModule : schedule->blockModules) {
+		Module* const module = blockModule.module;
+		for (size_t i = 0; i < blockModule.outputs.size(); i++) {
+			Output& output = module->outputs[i];
+			std::memcpy(output.voltages, blockModule.outputs[i] + chunkFrame * PORT_MAX_CHANNELS, sizeof(output.voltages));
+		}
+		Engine_stepCables(schedule->cableSteps.data(), blockModule.cablesBegin, blockModule.cablesEnd);
+	}
+}
+
+
+/** Collects one frame of the inputs of block terminal modules, given to them after the last frame of the chunk.
+*/
+static void Engine_collectBlockTerminalInputs(EngineSchedule* schedule, int chunkFrame) {
+	for (EngineBlockModule& blockModule : schedule->blockModules) {
+		// Terminal modules come first
+		if (!blockModule.terminalModule)
+			break;
+		Module* const module = blockModule.module;
+		for (size_t i = 0; i < module->inputs.size(); i++) {
+			const Input& input = module->inputs[i];
+			std::memcpy(blockModule.inputBuffer + (i * BLOCK_MAX_FRAMES + chunkFrame) * PORT_MAX_CHANNELS, input.voltages, sizeof(input.voltages));
+		}
+	}
+}
+
+
+/** Hands the collected inputs of the last `frames` frames to block terminal modules.
+*/
+static void Engine_processBlockTerminalOutputs(Engine* that, EngineSchedule* schedule, int frames) {
+	Engine::Internal* internal = that->internal;
+
+	BlockProcessArgs args;
+	args.sampleRate = internal->sampleRate;
+	args.sampleTime = internal->sampleTime;
+	args.frame = internal->frame - frames;
+	args.frames = frames;
+
+	float* const traceDurations = internal->traceBlock ? schedule->traceDurations.data() : nullptr;
+
+	for (EngineBlockModule& blockModule : schedule->blockModules) {
+		// Terminal modules come first
+		if (!blockModule.terminalModule)
+			break;
+		args.inputs = blockModule.inputs.data();
+		args.outputs = blockModule.outputs.data();
+		const double startTime = traceDurations ? system::getTime() : 0.0;
+		blockModule.terminalModule->processTerminalOutputBlock(args);
+		if (traceDurations)
+			traceDurations[blockModule.traceIndex] += system::getTime() - startTime;
+	}
+}
+
+
+/** Random stream of the offload worker, after those of the audio thread and workers. */
+static constexpr const uint64_t OFFLOAD_RANDOM_STREAM = MAX_THREAD_COUNT + 1;
+/** First random stream of modules created by patch loader threads, one per module. */
+static constexpr const uint64_t LOADER_RANDOM_STREAM = OFFLOAD_RANDOM_STREAM + 1;
+
+
+/** Reseeds the random generator of the calling engine thread once Engine_setRandomSeed() was called, each thread with its own stream.
+`generation` is the one the thread was last seeded with.
+*/
+static void Engine_seedRandom(Engine::Internal* internal, uint32_t& generation, uint64_t stream) {
+	const uint32_t current = internal->randomSeedGeneration.load(std::memory_order_acquire);
+	if (generation == current)
+		return;
+	generation = current;
+	random::local().seed(internal->randomSeed.load(std::memory_order_relaxed), stream);
+}
+
+
+/** Steps this thread's slice of every level, synchronizing with the other threads after each level.
+*/
+static void Engine_stepWorker(Engine* that, EngineSchedule* schedule, int threadId) {
+	Engine::Internal* internal = that->internal;
+	const int threadCount = internal->threadCount;
+
+	// Build ProcessArgs
+	Module::ProcessArgs processArgs;
+	processArgs.sampleRate = internal->sampleRate;
+	processArgs.sampleTime = internal->sampleTime;
+	processArgs.frame = internal->frame;
+
+	const EngineCableStep* const cableSteps = schedule->levelCableSteps.data();
+	float* const traceDurations = internal->traceBlock ? schedule->traceDurations.data() : nullptr;
+	// The schedule can be deleted as soon as the last level is done, so don't read it afterwards
+	const int levelCount = schedule->levelCount;
+
+	for (int level = 0; level < levelCount; level++) {
+		const int slice = level * threadCount + threadId;
+		const uint32_t end = schedule->levelSlices[slice + 1];
+		for (uint32_t i = schedule->levelSlices[slice]; i < end; i++) {
+			const EngineModuleStep& levelModule = schedule->levelModules[i];
+			if (i + 1 < end)
+				EngineModuleStep_prefetch(schedule->levelModules[i + 1]);
+			EngineModuleStep_process(levelModule, processArgs, traceDurations);
+			Engine_stepCables(cableSteps, levelModule.cablesBegin, levelModule.cablesEnd);
+		}
+		internal->workerBarrier.wait();
+	}
+}
+
+
+/** Processes the period given to the offload worker, frame by frame so the audio thread can play back each one as soon as it's done.
+Runs on the offload worker.
+*/
+static void Engine_processOffloads(Engine* that, EngineSchedule* schedule) {
+	Engine::Internal* internal = that->internal;
+
+	Module::ProcessArgs processArgs;
+	processArgs.sampleRate = internal->sampleRate;
+	processArgs.sampleTime = internal->sampleTime;
+
+	const int half = schedule->offloadHalf ^ 1;
+	const int frames = schedule->offloadJobFrames;
+
+	for (int frame = 0; frame < frames; frame++) {
+		processArgs.frame = schedule->offloadJobStart + frame;
+
+		for (EngineOffload& offload : schedule->offloads) {
+			Module* const module = offload.module;
+			for (size_t i = 0; i < module->inputs.size(); i++) {
+				Input& input = module->inputs[i];
+				std::memcpy(input.voltages, EngineOffload_voltages(&offload, half, i, frame), sizeof(input.voltages));
+				input.channels = EngineOffload_channels(&offload, half, i, frame);
+			}
+
+			Module__doProcess(module, processArgs, schedule->offloadJobTraced ? &offload.traceDuration : nullptr);
+
+			const size_t inputCount = module->inputs.size();
+			for (size_t i = 0; i < module->outputs.size(); i++) {
+				const Output& output = module->outputs[i];
+				std::memcpy(EngineOffload_voltages(&offload, half, inputCount + i, frame), output.voltages, sizeof(output.voltages));
+				EngineOffload_channels(&offload, half, inputCount + i, frame) = output.channels;
+			}
+		}
+
+		schedule->offloadProgress.store(frame + 1, std::memory_order_release);
+	}
+}
+
+
+/** Waits until the offload worker is done with its job.
+*/
+static void Engine_waitForOffloads(Engine* that) {
+	Engine::Internal* internal = that->internal;
+
+	for (uint32_t spins = 1; internal->offloadSchedule.load(std::memory_order_acquire); spins++) {
+#if defined ARCH_X64
+		__builtin_ia32_pause();
+#endif
+		if (spins % 1024 == 0)
+			std::this_thread::yield();
+	}
+}
+
+
+/** Ends the current period of offloaded modules, and gives the inputs recorded during it to the offload worker.
+*/
+static void Engine_handOffOffloads(Engine* that, EngineSchedule* schedule) {
+	Engine::Internal* internal = that->internal;
+
+	// Normally done already, since all its outputs were played back
+	Engine_waitForOffloads(that);
+
+	// The worker's time counts in the block it ends in
+	if (internal->traceBlock) {
+		for (EngineOffload& offload : schedule->offloads) {
+			schedule->traceDurations[offload.traceIndex] += offload.traceDuration;
+			offload.traceDuration = 0.f;
+		}
+	}
+
+	schedule->offloadHalf ^= 1;
+	schedule->offloadJobFrames = schedule->offloadFrame;
+	schedule->offloadJobStart = internal->frame - schedule->offloadFrame;
+	schedule->offloadJobTraced = internal->traceBlock;
+	schedule->offloadProgress.store(0, std::memory_order_relaxed);
+	schedule->offloadFrame = 0;
+
+	internal->offloadLatency.store(schedule->offloadJobFrames, std::memory_order_relaxed);
+	internal->offloadPlaySchedule.store(schedule);
+	internal->offloadSchedule.store(schedule, std::memory_order_release);
+	{
+		std::lock_guard<std::mutex> lock(internal->offloadMutex);
+		internal->offloadJob = schedule;
+	}
+	internal->offloadCv.notify_one();
+}
+
+
+/** Moves offloaded modules over to a new schedule, before anything else of the block happens.
+Waits for the worker, since the new schedule might process its modules inline.
+The outputs of the last job are copied for the modules that stay offloaded, so they don't drop a period.
+*/
+static void Engine_switchOffloads(Engine* that, EngineSchedule* schedule, EngineSchedule* oldSchedule) {
+	Engine::Internal* internal = that->internal;
+
+	Engine_waitForOffloads(that);
+
+	const int frames = oldSchedule->offloadJobFrames;
+	for (EngineOffload& offload : schedule->offloads) {
+		for (EngineOffload& oldOffload : oldSchedule->offloads) {
+			if (oldOffload.module != offload.module)
+				continue;
+			const size_t inputCount = offload.inputs.size();
+			for (size_t i = 0; i < offload.outputs.size(); i++) {
+				std::memcpy(EngineOffload_voltages(&offload, schedule->offloadHalf ^ 1, inputCount + i, 0),
+					EngineOffload_voltages(&oldOffload, oldSchedule->offloadHalf ^ 1, inputCount + i, 0),
+					sizeof(float) * PORT_MAX_CHANNELS * frames);
+				std::memcpy(&EngineOffload_channels(&offload, schedule->offloadHalf ^ 1, inputCount + i, 0),
+					&EngineOffload_channels(&oldOffload, oldSchedule->offloadHalf ^ 1, inputCount + i, 0),
+					frames);
+			}
+		}
+	}
+	schedule->offloadJobFrames = frames;
+	schedule->offloadProgress.store(frames, std::memory_order_relaxed);
+
+	internal->offloadPlaySchedule.store(schedule->offloads.empty() ? nullptr : schedule);
+}
+
+
+/** Returns the active ramp of a param, or NULL if it is not smoothed.
+`state` receives the state the ramp was found in.
+With `writing`, ramps being retargeted are found too. Only use it with `smoothClaiming` held, when no ramp is being started and the fields of WRITING ramps are valid.
+*/
+static EngineSmoothRamp* Engine_findSmoothRamp(Engine::Internal* internal, Module* module, int paramId, uint64_t& state, bool writing = false) {
+	for (EngineSmoothRamp& ramp : internal->smoothRamps) {
+		state = ramp.state.load(std::memory_order_acquire);
+		const uint64_t stateId = state & EngineSmoothRamp::STATE_MASK;
+		if (stateId != EngineSmoothRamp::ACTIVE && !(writing && stateId == EngineSmoothRamp::WRITING))
+			continue;
+		if (ramp.module.load(std::memory_order_relaxed) == module && ramp.paramId.load(std::memory_order_relaxed) == paramId)
+			return &ramp;
+	}
+	return nullptr;
+}
+
+
+/** Sets the value of a ramp found ACTIVE in `state`, fails if it changed since.
+*/
+static bool Engine_retargetSmoothRamp(EngineSmoothRamp* ramp, uint64_t state, float value) {
+	if (!ramp->state.compare_exchange_strong(state, (state & ~uint64_t(EngineSmoothRamp::STATE_MASK)) | EngineSmoothRamp::WRITING, std::memory_order_acquire))
+		return false;
+	ramp->value.store(value, std::memory_order_relaxed);
+	ramp->state.store(EngineSmoothRamp::next(state, EngineSmoothRamp::ACTIVE), std::memory_order_release);
+	return true;
+}
+
+
+/** Ends a ramp found in `state`, fails if it changed since.
+*/
+static bool Engine_endSmoothRamp(Engine::Internal* internal, EngineSmoothRamp* ramp, uint64_t state) {
+	if (!ramp->state.compare_exchange_strong(state, EngineSmoothRamp::next(state, EngineSmoothRamp::FREE), std::memory_order_acq_rel))
+		return false;
+	internal->smoothCount.fetch_sub(1, std::memory_order_relaxed);
+	return true;
+}
+
+
+/** Stops smoothing the params of a module, leaving them where they are.
+A `paramId` of -1 stops all of them.
+With `wait`, ramps being written are waited for, so none of the module is left once it returns. Never wait on the audio thread.
+Otherwise they are skipped, as if they were written after this call.
+*/
+static void Engine_cancelSmoothRamps(Engine::Internal* internal, Module* module, int paramId = -1, bool wait = false) {
+	for (EngineSmoothRamp& ramp : internal->smoothRamps) {
+		uint64_t state = ramp.state.load(std::memory_order_acquire);
+		while ((state & EngineSmoothRamp::STATE_MASK) != EngineSmoothRamp::FREE) {
+			if ((state & EngineSmoothRamp::STATE_MASK) == EngineSmoothRamp::ACTIVE) {
+				if (ramp.module.load(std::memory_order_relaxed) != module)
+					break;
+				if (paramId >= 0 && ramp.paramId.load(std::memory_order_relaxed) != paramId)
+					break;
+				if (Engine_endSmoothRamp(internal, &ramp, state))
+					break;
+			}
+			else if (!wait) {
+				break;
+			}
+			else {
+				std::this_thread::yield();
+			}
+			// Changed by another thread, look again
+			state = ramp.state.load(std::memory_order_acquire);
+		}
+	}
+}
+
+
+/** Moves every smoothed param one frame closer to its value, and ends the ramps of params that settled.
+*/
+static void Engine_stepSmoothRamps(Engine* that) {
+	Engine::Internal* internal = that->internal;
+	const bool remote = internal->remoteDetails != nullptr && internal->remoteDetails->connected;
+	// No need to look further once all claimed ramps are found
+	int remaining = internal->smoothCount.load(std::memory_order_relaxed);
+
+	for (EngineSmoothRamp& ramp : internal->smoothRamps) {
+		const uint64_t state = ramp.state.load(std::memory_order_acquire);
+		// Ramps being written to are picked up on the next frame
+		if ((state & EngineSmoothRamp::STATE_MASK) != EngineSmoothRamp::ACTIVE)
+			continue;
+
+		Module* const smoothModule = ramp.module.load(std::memory_order_relaxed);
+		const int smoothParamId = ramp.paramId.load(std::memory_order_relaxed);
+		const float smoothValue = ramp.value.load(std::memory_order_relaxed);
+		Param* smoothParam = &smoothModule->params[smoothParamId];
+		float value = smoothParam->value;
+		float newValue;
+		if (remote) {
+			newValue = value;
+			sendParamChangeToRemote(internal->remoteDetails, smoothModule->id, smoothParamId, value);
+		} else {
+			// Use decay rate of roughly 1 graphics frame
+			const float smoothLambda = 60.f;
+			newValue = value + (smoothValue - value) * smoothLambda * internal->sampleTime;
+		}
+		if (d_isEqual(value, newValue)) {
+			// Snap to actual smooth value if the value doesn't change enough (due to the granularity of floats)
+			smoothParam->setValue(smoothValue);
+			// Keeps going if it was retargeted in the meantime
+			Engine_endSmoothRamp(internal, &ramp, state);
+		}
+		else {
+			smoothParam->setValue(newValue);
+		}
+
+		if (--remaining <= 0)
+			break;
+	}
+}
+
+
+/** Steps a single frame, `chunkFrame` frames after the last call to Engine_processBlockModules()
+*/
+static void Engine_stepFrame(Engine* that, EngineSchedule* schedule, int chunkFrame) {
+	Engine::Internal* internal = that->internal;
+	const EngineCableStep* const cableSteps = schedule->cableSteps.data();
+	float* const traceDurations = internal->traceBlock ? schedule->traceDurations.data() : nullptr;
+
+	// Param smoothing
+	if (internal->smoothCount.load(std::memory_order_relaxed) > 0) {
+		const double smoothStartTime = traceDurations ? system::getTime() : 0.0;
+		Engine_stepSmoothRamps(that);
+		if (traceDurations)
+			internal->traceSmoothing += system::getTime() - smoothStartTime;
+	}
+
+	// Flip messages of the expanders that have some
+	for (Module::Expander* expander : schedule->messageExpanders) {
+		if (expander->messageFlipRequested) {
+			std::swap(expander->producerMessage, expander->consumerMessage);
+			expander->messageFlipRequested = false;
+		}
+	}
+
+	// Build ProcessArgs
+	Module::ProcessArgs processArgs;
+	processArgs.sampleRate = internal->sampleRate;
+	processArgs.sampleTime = internal->sampleTime;
+	processArgs.frame = internal->frame;
+
+	// Block modules were already processed for this frame
+	if (!schedule->blockModules.empty())
+		Engine_stepBlockModuleOutputs(that, schedule, chunkFrame);
+
+	// Process terminal inputs first
+	for (const EngineModuleStep& step : schedule->terminalModuleSteps) {
+		TerminalModule__doProcess(static_cast<TerminalModule*>(step.module), processArgs, true, traceDurations ? traceDurations + step.traceIndex : nullptr);
+		Engine_stepCables(cableSteps, step.cablesBegin, step.cablesEnd);
+	}
+
+	if (schedule->levelCount > 0) {
+		// Step modules level by level along with workers
+		internal->engineBarrier.wait();
+		Engine_stepWorker(that, schedule, 0);
+		// Feedback cables are only read on the next frame, same as in the serial engine
+		Engine_stepCables(schedule->feedbackCableSteps.data(), 0, schedule->feedbackCableSteps.size());
+	}
+	else {
+		// Step each module and cables
+		const EngineModuleStep* const moduleSteps = schedule->moduleSteps.data();
+		const size_t moduleStepCount = schedule->moduleSteps.size();
+		for (size_t i = 0; i < moduleStepCount; i++) {
+			const EngineModuleStep& step = moduleSteps[i];
+			if (i + 1 < moduleStepCount)
+				EngineModuleStep_prefetch(moduleSteps[i + 1]);
+			EngineModuleStep_process(step, processArgs, traceDurations);
+			Engine_stepCables(cableSteps, step.cablesBegin, step.cablesEnd);
+		}
+	}
+
+	// Process terminal outputs last
+	for (const EngineModuleStep& step : schedule->terminalModuleSteps) {
+		TerminalModule__doProcess(static_cast<TerminalModule*>(step.module), processArgs, false, traceDurations ? traceDurations + step.traceIndex : nullptr);
+	}
+	if (!schedule->blockModules.empty())
+		Engine_collectBlockTerminalInputs(schedule, chunkFrame);
+	if (!schedule->offloads.empty())
+		schedule->offloadFrame++;
+
+	++internal->frame;
+}
+
+
+static void Port_setDisconnected(Port* that) {
+	that->channels = 0;
+	for (int c = 0; c < PORT_MAX_CHANNELS; c++) {
+		that->voltages[c] = 0.f;
+	}
+}
+
+
+static void Port_setConnected(Port* that) {
+	if (that->channels > 0)
+		return;
+	that->channels = 1;
+}
+
+
+/** Applies the port changes published so far, see Engine_queuePortChange().
+Requires holding `portChangesBusy`. Only sets a few fields per change, so it's quick and never allocates.
+Offloaded modules get their port states from what the worker recorded, so this doesn't wait for it.
+*/
+static void Engine_applyPortChanges(Engine::Internal* internal) {
+	const uint32_t written = internal->portChangesWritten.load(std::memory_order_acquire);
+	uint32_t read = internal->portChangesRead.load(std::memory_order_relaxed);
+	for (; read != written; read++) {
+		const EnginePortChange& change = internal->portChanges[read % PORT_CHANGE_CAPACITY];
+		switch (change.type) {
+			case EnginePortChange::CONNECT:
+				Port_setConnected(change.port);
+				break;
+			case EnginePortChange::DISCONNECT:
+				Port_setDisconnected(change.port);
+				break;
+			case EnginePortChange::CLEAR_OUTPUTS:
+				// This zeros all voltages, but the channel is set to 1 if connected
+				for (Output& output : change.module->outputs)
+					output.setChannels(0);
+				break;
+		}
+	}
+	internal->portChangesRead.store(read, std::memory_order_release);
+}
+
+
+/** Applies the published port changes unless a block is being stepped, the audio thread applies them when it ends otherwise.
+Returns false in that case.
+*/
+static bool Engine_tryApplyPortChanges(Engine::Internal* internal) {
+	if (internal->portChangesBusy.exchange(true))
+		return false;
+	Engine_applyPortChanges(internal);
+	internal->portChangesBusy.store(false);
+	return true;
+}
+
+
+/** Waits until the audio thread or the caller applied every published port change, at most until the current block ends.
+Call without holding `mutex`, since modules might use engine methods that lock it while being processed.
+*/
+static void Engine_flushPortChanges(Engine::Internal* internal) {
+	while (internal->portChangesRead.load(std::memory_order_acquire) != internal->portChangesWritten.load(std::memory_order_acquire)) {
+		if (!Engine_tryApplyPortChanges(internal))
+			std::this_thread::yield();
+	}
+}
+
+
+/** Waits until there is room for `count` more port changes, for an edit about to queue them.
+Call without holding `mutex`, like Engine_flushPortChanges().
+*/
+static void Engine_reservePortChanges(Engine::Internal* internal, uint32_t count) {
+	while (internal->portChangesWritten.load(std::memory_order_acquire) - internal->portChangesRead.load(std::memory_order_acquire) > PORT_CHANGE_CAPACITY - count) {
+		if (!Engine_tryApplyPortChanges(internal))
+			std::this_thread::yield();
+	}
+}
+
+
+/** Queues a change to the state of a port, or clears the outputs of `module`.
+Modules keep being processed while the patch is edited, so their ports only change between two blocks.
+The change waits for Engine_publishPortChanges(), which must follow once the schedule that goes with it is published.
+Requires the write lock.
+*/
+static void Engine_queuePortChange(Engine* that, EnginePortChange::Type type, Port* port, Module* module = nullptr) {
+	Engine::Internal* internal = that->internal;
+	// Only full if another thread edited the patch since Engine_reservePortChanges().
+	// Published changes can still be applied, since the audio thread never locks `mutex`.
+	while (internal->portChangesQueued - internal->portChangesRead.load(std::memory_order_acquire) >= PORT_CHANGE_CAPACITY) {
+		if (!Engine_tryApplyPortChanges(internal))
+			std::this_thread::yield();
+	}
+	EnginePortChange& change = internal->portChanges[internal->portChangesQueued % PORT_CHANGE_CAPACITY];
+	change.type = type;
+	change.port = port;
+	change.module = module;
+	internal->portChangesQueued++;
+}
+
+
+/** Lets the audio thread apply the queued port changes, or applies them right away if no block is being stepped.
+Called after publishing the schedule they go with, so a block never steps an older schedule than the ports it sees.
+Requires the write lock.
+*/
+static void Engine_publishPortChanges(Engine* that) {
+	Engine::Internal* internal = that->internal;
+	if (internal->portChangesQueued == internal->portChangesWritten.load(std::memory_order_relaxed))
+		return;
+	internal->portChangesWritten.store(internal->portChangesQueued);
+	Engine_tryApplyPortChanges(internal);
+}
+
+
+/** Orders the modules topologically, keeping each feedback loop together.
+This is Tarjan's strongly connected components algorithm without recursion, so it is linear in modules plus cables and never runs out of stack.
+Loops are entered at their module with the lowest ID and then follow their cables, so only the cables closing them go backwards.
+Like the depth-first ordering it replaces, modules that are not connected end up in reverse order of their current one.
+If `loops` is given, each loop of several modules, or of a module patched into itself, is added to it in that order.
+*/
+static void Engine_sortModules(Engine* that, std::vector<Module*>& orderedModules, std::vector<std::vector<Module*>>* loops) {
+	Engine::Internal* internal = that->internal;
+	const std::vector<Module*>& modules = internal->modules;
+	const uint32_t modulesLen = modules.size();
+	static constexpr const uint32_t UNVISITED = UINT32_MAX;
+
+	// Cables between regular modules as adjacency lists, terminal modules are processed before and after all others
+	std::unordered_map<Module*, uint32_t> indexes;
+	indexes.reserve(modulesLen);
+	for (uint32_t i = 0; i < modulesLen; i++)
+		indexes[modules[i]] = i;
+	std::vector<uint32_t> edgesBegin(modulesLen + 1);
+	std::vector<uint32_t> edges;
+	edges.reserve(internal->cables.size());
+	for (uint32_t i = 0; i < modulesLen; i++) {
+		edgesBegin[i] = edges.size();
+		for (Output& output : modules[i]->outputs) {
+			for (Cable* cable : output.cables) {
+				auto it = indexes.find(cable->inputModule);
+				if (it != indexes.end())
+					edges.push_back(it->second);
+			}
+		}
+	}
+	edgesBegin[modulesLen] = edges.size();
+
+	// Components come out with the ones fed by others first
+	std::vector<uint32_t> visitOrder(modulesLen, UNVISITED);
+	std::vector<uint32_t> lowLinks(modulesLen);
+	std::vector<uint32_t> components(modulesLen, UNVISITED);
+	std::vector<uint32_t> componentModules;
+	std::vector<uint32_t> componentsBegin;
+	std::vector<uint32_t> tarjanStack;
+	// Module and next cable to follow, instead of recursing
+	std::vector<std::pair<uint32_t, uint32_t>> callStack;
+	componentModules.reserve(modulesLen);
+	uint32_t visitCount = 0;
+
+	for (uint32_t root = 0; root < modulesLen; root++) {
+		if (visitOrder[root] != UNVISITED)
+			continue;
+		visitOrder[root] = lowLinks[root] = visitCount++;
+		tarjanStack.push_back(root);
+		callStack.push_back({root, edgesBegin[root]});
+
+		while (!callStack.empty()) {
+			const uint32_t v = callStack.back().first;
+			uint32_t& edge = callStack.back().second;
+			if (edge < edgesBegin[v + 1]) {
+				const uint32_t w = edges[edge++];
+				if (visitOrder[w] == UNVISITED) {
+					visitOrder[w] = lowLinks[w] = visitCount++;
+					tarjanStack.push_back(w);
+					callStack.push_back({w, edgesBegin[w]});
+				}
+				else if (components[w] == UNVISITED) {
+					// Still on the Tarjan stack
+					lowLinks[v] = std::min(lowLinks[v], visitOrder[w]);
+				}
+				continue;
+			}
+
+			callStack.pop_back();
+			if (!callStack.empty()) {
+				const uint32_t u = callStack.back().first;
+				lowLinks[u] = std::min(lowLinks[u], lowLinks[v]);
+			}
+			if (lowLinks[v] != visitOrder[v])
+				continue;
+
+			componentsBegin.push_back(componentModules.size());
+			uint32_t w;
+			do {
+				w = tarjanStack.back();
+				tarjanStack.pop_back();
+				components[w] = componentsBegin.size() - 1;
+				componentModules.push_back(w);
+			} while (w != v);
+		}
+	}
+	componentsBegin.push_back(componentModules.size());
+
+	// Place components in reverse, ordering the modules of each loop with a depth-first search within it
+	orderedModules.clear();
+	orderedModules.reserve(modulesLen);
+	std::vector<bool> placed(modulesLen, false);
+	std::vector<uint32_t> loopModules;
+	for (uint32_t c = componentsBegin.size() - 1; c-- > 0;) {
+		const uint32_t begin = componentsBegin[c];
+		const uint32_t end = componentsBegin[c + 1];
+
+		uint32_t first = componentModules[begin];
+		bool isLoop = end - begin > 1;
+		for (uint32_t k = begin; k < end; k++) {
+			const uint32_t i = componentModules[k];
+			if (modules[i]->id < modules[first]->id)
+				first = i;
+		}
+		if (!isLoop) {
+			for (uint32_t e = edgesBegin[first]; e < edgesBegin[first + 1]; e++)
+				isLoop = isLoop || edges[e] == first;
+		}
+		if (end - begin == 1) {
+			orderedModules.push_back(modules[first]);
+			if (isLoop && loops)
+				loops->push_back({modules[first]});
+			continue;
+		}
+
+		// Reverse post-order, so every cable but the ones closing the loop goes forward
+		loopModules.clear();
+		placed[first] = true;
+		callStack.push_back({first, edgesBegin[first]});
+		while (!callStack.empty()) {
+			const uint32_t v = callStack.back().first;
+			uint32_t& edge = callStack.back().second;
+			if (edge < edgesBegin[v + 1]) {
+				const uint32_t w = edges[edge++];
+				if (components[w] == c && !placed[w]) {
+					placed[w] = true;
+					callStack.push_back({w, edgesBegin[w]});
+				}
+				continue;
+			}
+			callStack.pop_back();
+			loopModules.push_back(v);
+		}
+
+		const size_t loopBegin = orderedModules.size();
+		for (auto it = loopModules.rbegin(); it != loopModules.rend(); ++it)
+			orderedModules.push_back(modules[*it]);
+		if (loops)
+			loops->emplace_back(orderedModules.begin() + loopBegin, orderedModules.end());
+	}
+}
+
+#if DEBUG_ORDERED_MODULES
+static void Engine_debugOrderedModules(std::vector<Module*>& modules) {
+	printf("\n--- Ordered modules ---\n");
+	for (unsigned int i = 0; i < modules.size(); i++)
+		printf("%d) %s - %ld\n", i, modules[i]->model->getFullName().c_str(), modules[i]->id);
+}
+#endif
+
+static void Engine_updateSchedule(Engine* that);
+
+/** Updates the position of every module in `modules`, starting at index `start`.
+*/
+static void Engine_indexModules(Engine* that, size_t start) {
+	Engine::Internal* internal = that->internal;
+	if (start == 0)
+		internal->moduleIndexes.clear();
+	for (size_t i = start; i < internal->modules.size(); i++)
+		internal->moduleIndexes[internal->modules[i]] = i;
+}
+
+/** Order the modules so that they always read the most recent sample from their inputs
+*/
+static void Engine_orderModules(Engine* that) {
+	Engine::Internal* internal = that->internal;
+
+	std::vector<Module*> orderedModules;
+	std::vector<std::vector<Module*>> loops;
+	Engine_sortModules(that, orderedModules, &loops);
+	internal->modules.swap(orderedModules);
+
+	for (const std::vector<Module*>& loop : loops) {
+		std::string names;
+		for (Module* module : loop)
+			names += string::f("%s%s (%lld)", names.empty() ? "" : " -> ", module->model->getFullName().c_str(), (long long) module->id);
+		INFO("Feedback loop: %s", names.c_str());
+	}
+
+#if DEBUG_ORDERED_MODULES
+	Engine_debugOrderedModules(internal->modules);
+#endif
+
+	Engine_indexModules(that, 0);
+
+	// Remember which cables ended up going backwards, so they can be reordered once their loop is broken
+	internal->backwardCables.clear();
+	for (Cable* cable : internal->cables) {
+		auto outputIt = internal->moduleIndexes.find(cable->outputModule);
+		auto inputIt = internal->moduleIndexes.find(cable->inputModule);
+		if (outputIt != internal->moduleIndexes.end() && inputIt != internal->moduleIndexes.end() && outputIt->second >= inputIt->second)
+			internal->backwardCables.insert(cable);
+	}
+
+	Engine_updateSchedule(that);
+}
+
+
+/** Groups the ordered modules into topological levels for the multi-threaded engine.
+A module's level is one past the highest level of the modules feeding it, so modules within the same level never read from each other and can run in parallel.
+Cables going backwards in the module order are feedback, and are stepped after all levels so they keep the one-frame delay of the serial engine.
+This makes the output identical to the serial engine, regardless of how modules are spread across threads.
+*/
+static void Engine_updateLevels(Engine* that, EngineSchedule* schedule) {
+	Engine::Internal* internal = that->internal;
+
+	const int threadCount = internal->threadCount;
+	if (threadCount <= 1)
+		return;
+
+	const size_t modulesLen = internal->modules.size();
+	const std::unordered_map<Module*, size_t>& moduleIndexes = internal->moduleIndexes;
+
+	// Block modules are processed before all levels
+	std::vector<bool> blockModules(modulesLen, false);
+	for (const EngineBlockModule& blockModule : schedule->blockModules) {
+		auto it = moduleIndexes.find(blockModule.module);
+		if (it != moduleIndexes.end())
+			blockModules[it->second] = true;
+	}
+
+	// Modules are already ordered, so all forward sources of a module are visited before it
+	std::vector<int> levels(modulesLen, 0);
+	// Cables going to a module of a later level, or to a terminal module
+	std::vector<std::vector<EngineCableStep>> moduleCableSteps(modulesLen);
+	int levelCount = 0;
+
+	for (size_t i = 0; i < modulesLen; i++) {
+		if (blockModules[i])
+			continue;
+		levelCount = std::max(levelCount, 1);
+		Module* const module = internal->modules[i];
+
+		for (Output& output : module->outputs) {
+			for (Cable* cable : output.cables) {
+				const EngineCableStep step = EngineSchedule_makeCableStep(schedule, &output, cable);
+				auto it = moduleIndexes.find(cable->inputModule);
+				// Terminal modules are processed after all levels
+				if (it == moduleIndexes.end()) {
+					moduleCableSteps[i].push_back(step);
+					continue;
+				}
+				const size_t j = it->second;
+				if (j > i) {
+					levels[j] = std::max(levels[j], levels[i] + 1);
+					levelCount = std::max(levelCount, levels[j] + 1);
+					moduleCableSteps[i].push_back(step);
+				}
+				else {
+					schedule->feedbackCableSteps.push_back(step);
+				}
+			}
+		}
+	}
+
+	// Bucket modules by level, keeping the engine order within each level
+	std::vector<std::vector<size_t>> buckets(levelCount);
+	for (size_t i = 0; i < modulesLen; i++) {
+		if (!blockModules[i])
+			buckets[levels[i]].push_back(i);
+	}
+
+	schedule->levelModules.reserve(modulesLen);
+	schedule->levelSlices.reserve(levelCount * threadCount + 1);
+	for (const std::vector<size_t>& bucket : buckets) {
+		const size_t bucketLen = bucket.size();
+		// Split each level evenly across threads
+		for (int t = 0; t < threadCount; t++) {
+			schedule->levelSlices.push_back(schedule->levelModules.size());
+			const size_t start = bucketLen * t / threadCount;
+			const size_t end = bucketLen * (t + 1) / threadCount;
+			for (size_t k = start; k < end; k++) {
+				const size_t i = bucket[k];
+				const uint32_t cablesBegin = schedule->levelCableSteps.size();
+				schedule->levelCableSteps.insert(schedule->levelCableSteps.end(), moduleCableSteps[i].begin(), moduleCableSteps[i].end());
+				Module* const module = internal->modules[i];
+				schedule->levelModules.push_back(EngineSchedule_makeModuleStep(schedule, module, cablesBegin, schedule->levelCableSteps.size(), true));
+			}
+		}
+	}
+	schedule->levelSlices.push_back(schedule->levelModules.size());
+	schedule->levelCount = levelCount;
+}
+
+
+/** Finds the modules that can process whole blocks, and gives them buffers for their ports.
+A BlockModule qualifies when it is not bypassed and every connected input comes from a module that qualified before it, or from a BlockTerminalModule.
+Going through modules in engine order means feedback loops never qualify.
+All other modules are added to `frameModules` and `frameTerminalModules`, in engine order.
+*/
+static void Engine_updateBlockModules(Engine* that, EngineSchedule* schedule, std::vector<Module*>& frameModules, std::vector<TerminalModule*>& frameTerminalModules) {
+	Engine::Internal* internal = that->internal;
+
+	std::vector<EngineBlockModule> blockModules;
+	std::unordered_map<const Module*, size_t> blockModuleIndexes;
+
+	for (TerminalModule* terminalModule : internal->terminalModules) {
+		BlockTerminalModule* const blockTerminalModule = dynamic_cast<BlockTerminalModule*>(terminalModule);
+		if (!blockTerminalModule) {
+			frameTerminalModules.push_back(terminalModule);
+			continue;
 		}
-	} else {
-		terminalModule->processTerminalOutput(args);
+		blockModuleIndexes[terminalModule] = blockModules.size();
+		blockModules.emplace_back();
+		blockModules.back().module = terminalModule;
+		blockModules.back().traceIndex = EngineSchedule_getModuleIndex(schedule, terminalModule->id);
+		blockModules.back().terminalModule = blockTerminalModule;
 	}
 
-#ifndef HEADLESS
-	// Iterate ports to step plug lights
-	if (args.frame % PORT_DIVIDER == 0) {
-		float portTime = args.sampleTime * PORT_DIVIDER;
-		for (Input& input : terminalModule->inputs) {
-			Port_step(&input, portTime);
+	for (Module* module : internal->modules) {
+		const bool offloaded = internal->offloadModules.find(module) != internal->offloadModules.end();
+		BlockModule* const blockModule = module->isBypassed() || offloaded ? nullptr : dynamic_cast<BlockModule*>(module);
+		bool qualifies = blockModule != nullptr;
+		for (size_t i = 0; qualifies && i < module->inputs.size(); i++) {
+			auto it = internal->inputCables.find(&module->inputs[i]);
+			if (it != internal->inputCables.end())
+				qualifies = blockModuleIndexes.find(it->second->outputModule) != blockModuleIndexes.end();
 		}
-		for (Output& output : terminalModule->outputs) {
-			Port_step(&output, portTime);
+		if (!qualifies) {
+			frameModules.push_back(module);
+			continue;
 		}
+		blockModuleIndexes[module] = blockModules.size();
+		blockModules.emplace_back();
+		blockModules.back().module = module;
+		blockModules.back().traceIndex = EngineSchedule_getModuleIndex(schedule, module->id);
+		blockModules.back().blockModule = blockModule;
 	}
-#endif
-}
 
+	// Allocate all buffers in one go, in processing order, before pointing inputs at the outputs of other modules
+	const size_t portSize = BLOCK_MAX_FRAMES * PORT_MAX_CHANNELS;
+	size_t blockPorts = 0;
+	for (const EngineBlockModule& blockModule : blockModules) {
+		blockPorts += blockModule.module->outputs.size();
+		// Inputs of terminal modules are collected frame by frame
+		if (blockModule.terminalModule)
+			blockPorts += blockModule.module->inputs.size();
+	}
+	schedule->blockVoltages.resize(blockPorts * portSize);
+	float* voltages = schedule->blockVoltages.data();
+	for (EngineBlockModule& blockModule : blockModules) {
+		Module* const module = blockModule.module;
+		for (size_t i = 0; i < module->outputs.size(); i++, voltages += portSize)
+			blockModule.outputs.push_back(voltages);
+		if (blockModule.terminalModule) {
+			blockModule.inputBuffer = voltages;
+			for (size_t i = 0; i < module->inputs.size(); i++, voltages += portSize)
+				blockModule.inputs.push_back(voltages);
+		}
+	}
 
-static void Module__doProcess(Module* const module, const Module::ProcessArgs& args) {
-	Module::Internal* const internal = module->internal;
+	for (EngineBlockModule& blockModule : blockModules) {
+		if (blockModule.terminalModule)
+			continue;
+		Module* const module = blockModule.module;
+		for (size_t i = 0; i < module->inputs.size(); i++) {
+			auto it = internal->inputCables.find(&module->inputs[i]);
+			if (it == internal->inputCables.end()) {
+				blockModule.inputs.push_back(zeroBlockVoltages);
+				blockModule.sources.push_back(nullptr);
+				continue;
+			}
+			const Cable* const cable = it->second;
+			const EngineBlockModule& source = blockModules[blockModuleIndexes[cable->outputModule]];
+			blockModule.inputs.push_back(source.outputs[cable->outputId]);
+			blockModule.sources.push_back(&cable->outputModule->outputs[cable->outputId]);
+		}
+	}
 
-#ifndef HEADLESS
-	// This global setting can change while the function is running, so use a local variable.
-	bool meterEnabled = settings::cpuMeter && (args.frame % METER_DIVIDER == 0);
+	schedule->blockModules = std::move(blockModules);
+}
 
-	// Start CPU timer
-	double startTime;
-	if (meterEnabled) {
-		startTime = system::getTime();
-	}
-#endif
 
-	// Step module
-	if (!internal->bypassed)
-		module->process(args);
-	else
-		module->processBypass(args);
+static void Engine_appendCableSteps(EngineSchedule* schedule, Module* module) {
+	for (Output& output : module->outputs) {
+		for (Cable* cable : output.cables)
+			schedule->cableSteps.push_back(EngineSchedule_makeCableStep(schedule, &output, cable));
+	}
+}
 
-#ifndef HEADLESS
-	// Stop CPU timer
-	if (meterEnabled) {
-		double endTime = system::getTime();
-		// Subtract call time of getTime() itself, since we only want to measure process() time.
-		double endTime2 = system::getTime();
-		float duration = (endTime - startTime) - (endTime2 - endTime);
 
-		internal->meterSamples++;
-		internal->meterDurationTotal += duration;
+/** Gives offloaded modules their own ports and buffers, before any step can point to them.
+*/
+static void Engine_updateOffloads(Engine* that, EngineSchedule* schedule, const std::vector<Module*>& frameModules) {
+	Engine::Internal* internal = that->internal;
 
-		// Seconds we've been measuring
-		float meterTime = internal->meterSamples * METER_DIVIDER * args.sampleTime;
+	if (internal->offloadModules.empty())
+		return;
 
-		if (meterTime >= METER_TIME) {
-			// Push time to buffer
-			if (internal->meterSamples > 0) {
-				internal->meterIndex++;
-				internal->meterIndex %= METER_BUFFER_LEN;
-				internal->meterBuffer[internal->meterIndex] = internal->meterDurationTotal / internal->meterSamples;
-			}
-			// Reset total
-			internal->meterSamples = 0;
-			internal->meterDurationTotal = 0.f;
-		}
+	size_t offloadCount = 0;
+	size_t offloadPorts = 0;
+	for (Module* module : frameModules) {
+		if (internal->offloadModules.find(module) == internal->offloadModules.end())
+			continue;
+		offloadCount++;
+		offloadPorts += module->inputs.size() + module->outputs.size();
 	}
 
-	// Iterate ports to step plug lights
-	if (args.frame % PORT_DIVIDER == 0) {
-		float portTime = args.sampleTime * PORT_DIVIDER;
-		for (Input& input : module->inputs) {
-			Port_step(&input, portTime);
-		}
-		for (Output& output : module->outputs) {
-			Port_step(&output, portTime);
+	schedule->offloads.reserve(offloadCount);
+	schedule->offloadVoltages.resize(2 * offloadPorts * OFFLOAD_MAX_FRAMES * PORT_MAX_CHANNELS);
+	schedule->offloadChannels.resize(2 * offloadPorts * OFFLOAD_MAX_FRAMES);
+	float* voltages = schedule->offloadVoltages.data();
+	uint8_t* channels = schedule->offloadChannels.data();
+
+	for (Module* module : frameModules) {
+		if (internal->offloadModules.find(module) == internal->offloadModules.end())
+			continue;
+		schedule->offloads.emplace_back();
+		EngineOffload& offload = schedule->offloads.back();
+		offload.module = module;
+		offload.schedule = schedule;
+		offload.inputs.resize(module->inputs.size());
+		offload.outputs.resize(module->outputs.size());
+		// Keep outputs connected until the first period is played back
+		for (size_t i = 0; i < module->outputs.size(); i++)
+			offload.outputs[i].channels = module->outputs[i].channels;
+		const size_t ports = module->inputs.size() + module->outputs.size();
+		for (int half = 0; half < 2; half++) {
+			offload.voltages[half] = voltages;
+			offload.channels[half] = channels;
+			voltages += ports * OFFLOAD_MAX_FRAMES * PORT_MAX_CHANNELS;
+			channels += ports * OFFLOAD_MAX_FRAMES;
 		}
+		offload.traceIndex = EngineSchedule_getModuleIndex(schedule, module->id);
 	}
-#endif
 }
 
 
-/** Steps a single frame
+/** Builds the propagation schedule, a flat list of cables laid out in the order they are stepped during a frame.
+This way the audio thread never walks `Output::cables`.
 */
-static void Engine_stepFrame(Engine* that) {
+static void Engine_updateModuleSteps(Engine* that, EngineSchedule* schedule) {
 	Engine::Internal* internal = that->internal;
 
-	// Param smoothing
-	Module* smoothModule = internal->smoothModule;
-	if (smoothModule) {
-		int smoothParamId = internal->smoothParamId;
-		float smoothValue = internal->smoothValue;
-		Param* smoothParam = &smoothModule->params[smoothParamId];
-		float value = smoothParam->value;
-		float newValue;
-		if (internal->remoteDetails != nullptr && internal->remoteDetails->connected) {
-			newValue = value;
-			sendParamChangeToRemote(internal->remoteDetails, smoothModule->id, smoothParamId, value);
-		} else {
-			// Use decay rate of roughly 1 graphics frame
-			const float smoothLambda = 60.f;
-			newValue = value + (smoothValue - value) * smoothLambda * internal->sampleTime;
-		}
-		if (d_isEqual(value, newValue)) {
-			// Snap to actual smooth value if the value doesn't change enough (due to the granularity of floats)
-			smoothParam->setValue(smoothValue);
-			internal->smoothModule = NULL;
-			internal->smoothParamId = 0;
-		}
-		else {
-			smoothParam->setValue(newValue);
-		}
-	}
+	std::vector<Module*> frameModules;
+	std::vector<TerminalModule*> frameTerminalModules;
+	Engine_updateBlockModules(that, schedule, frameModules, frameTerminalModules);
+	Engine_updateOffloads(that, schedule, frameModules);
 
-	// Flip messages for each module
-	for (Module* module : internal->modules) {
-		if (module->leftExpander.messageFlipRequested) {
-			std::swap(module->leftExpander.producerMessage, module->leftExpander.consumerMessage);
-			module->leftExpander.messageFlipRequested = false;
-		}
-		if (module->rightExpander.messageFlipRequested) {
-			std::swap(module->rightExpander.producerMessage, module->rightExpander.consumerMessage);
-			module->rightExpander.messageFlipRequested = false;
-		}
+	std::vector<EngineCableStep>& cableSteps = schedule->cableSteps;
+	cableSteps.reserve(internal->cables.size());
+
+	// Outputs of block modules are stepped first
+	for (EngineBlockModule& blockModule : schedule->blockModules) {
+		blockModule.cablesBegin = cableSteps.size();
+		Engine_appendCableSteps(schedule, blockModule.module);
+		blockModule.cablesEnd = cableSteps.size();
 	}
 
-	// Build ProcessArgs
-	Module::ProcessArgs processArgs;
-	processArgs.sampleRate = internal->sampleRate;
-	processArgs.sampleTime = internal->sampleTime;
-	processArgs.frame = internal->frame;
+	// Then terminal inputs
+	for (TerminalModule* terminalModule : frameTerminalModules) {
+		const uint32_t cablesBegin = cableSteps.size();
+		Engine_appendCableSteps(schedule, terminalModule);
+		schedule->terminalModuleSteps.push_back(EngineSchedule_makeModuleStep(schedule, terminalModule, cablesBegin, cableSteps.size(), false));
+	}
 
-	// Process terminal inputs first
-	for (TerminalModule* terminalModule : internal->terminalModules) {
-		TerminalModule__doProcess(terminalModule, processArgs, true);
+	// Then each module right after it is processed
+	schedule->moduleSteps.reserve(frameModules.size());
+	for (Module* module : frameModules) {
+		const uint32_t cablesBegin = cableSteps.size();
+		Engine_appendCableSteps(schedule, module);
+		schedule->moduleSteps.push_back(EngineSchedule_makeModuleStep(schedule, module, cablesBegin, cableSteps.size(), true));
 	}
+}
 
-	// Step each module and cables
-	for (Module* module : internal->modules) {
-		Module__doProcess(module, processArgs);
-		for (Output& output : module->outputs) {
-			for (Cable* cable : output.cables)
-				Cable_step(cable);
+
+/** Deletes the retired schedules that the audio thread is not using.
+*/
+static void Engine_reclaimSchedules(Engine* that) {
+	Engine::Internal* internal = that->internal;
+
+	const EngineSchedule* const activeSchedule = internal->activeSchedule.load();
+	// Also read when switching to the next schedule
+	const EngineSchedule* const offloadPlaySchedule = internal->offloadPlaySchedule.load();
+	for (auto it = internal->retiredSchedules.begin(); it != internal->retiredSchedules.end();) {
+		if (*it == activeSchedule || *it == offloadPlaySchedule) {
+			++it;
+			continue;
 		}
+		delete *it;
+		it = internal->retiredSchedules.erase(it);
 	}
+}
 
-	// Process terminal outputs last
-	for (TerminalModule* terminalModule : internal->terminalModules) {
-		TerminalModule__doProcess(terminalModule, processArgs, false);
-	}
 
-	++internal->frame;
+/** Makes `schedule` the one used from the next block on.
+The audio thread announces the schedule it uses in `activeSchedule` before using it, and checks that it is still the latest one afterwards.
+So once replaced, a schedule is only in use while `activeSchedule` points to it, which is what Engine_reclaimSchedules() relies on.
+*/
+static void Engine_publishSchedule(Engine* that, EngineSchedule* schedule) {
+	Engine::Internal* internal = that->internal;
+
+	EngineSchedule* const oldSchedule = internal->schedule.exchange(schedule);
+	if (oldSchedule)
+		internal->retiredSchedules.push_back(oldSchedule);
+	Engine_reclaimSchedules(that);
 }
 
 
-static void Port_setDisconnected(Port* that) {
-	that->channels = 0;
-	for (int c = 0; c < PORT_MAX_CHANNELS; c++) {
-		that->voltages[c] = 0.f;
+/** Waits until the audio thread and the offload worker are done with every schedule published before the latest one, at most one block.
+Call without holding `mutex`, since modules might use engine methods that lock it while being processed.
+*/
+static void Engine_waitForSchedule(Engine* that) {
+	Engine::Internal* internal = that->internal;
+
+	while (true) {
+		const EngineSchedule* const latestSchedule = internal->schedule.load();
+		const EngineSchedule* const activeSchedule = internal->activeSchedule.load();
+		const EngineSchedule* const offloadSchedule = internal->offloadSchedule.load();
+		if ((!activeSchedule || activeSchedule == latestSchedule) && (!offloadSchedule || offloadSchedule == latestSchedule))
+			return;
+		std::this_thread::yield();
 	}
 }
 
 
-static void Port_setConnected(Port* that) {
-	if (that->channels > 0)
+/** Rebuilds how modules are processed after modules, cables or bypass states change, and publishes it for the audio thread.
+*/
+static void Engine_updateSchedule(Engine* that) {
+	Engine::Internal* internal = that->internal;
+
+	// Rebuilt when the batch ends, nothing is processed until then
+	if (internal->topologyBatch > 0) {
+		internal->topologyDirty = true;
+		if (!internal->batchScheduled) {
+			Engine_publishSchedule(that, new EngineSchedule);
+			internal->batchScheduled = true;
+		}
 		return;
-	that->channels = 1;
+	}
+
+	EngineSchedule* const schedule = new EngineSchedule;
+	schedule->modules = internal->modules;
+	schedule->messageExpanders.reserve(schedule->modules.size() * 2);
+	schedule->modulesCache = internal->modulesCache;
+	schedule->moduleIds.reserve(internal->modulesCache.size());
+	internal->modulesCache.forEach([&](int64_t moduleId, Module* module) {
+		schedule->moduleIds.push_back(std::make_pair(moduleId, module));
+	});
+	std::sort(schedule->moduleIds.begin(), schedule->moduleIds.end(), [](const std::pair<int64_t, Module*>& a, const std::pair<int64_t, Module*>& b) {
+		return a.first < b.first;
+	});
+	schedule->traceDurations.resize(schedule->moduleIds.size());
+	// Sleep states are placed while building steps, reserve them so they don't move
+	schedule->sleepIndexes.resize(schedule->moduleIds.size(), SLEEP_DISABLED);
+	size_t sleepCount = 0;
+	size_t sleepParamCount = 0;
+	for (size_t i = 0; i < schedule->moduleIds.size(); i++) {
+		Module* const module = schedule->moduleIds[i].second;
+		if (internal->sleepModules.find(module) == internal->sleepModules.end())
+			continue;
+		schedule->sleepIndexes[i] = SLEEP_UNPLACED;
+		sleepCount++;
+		sleepParamCount += module->params.size();
+	}
+	schedule->sleeps.reserve(sleepCount);
+	schedule->sleepParams.reserve(sleepParamCount);
+	Engine_updateModuleSteps(that, schedule);
+	Engine_updateLevels(that, schedule);
+	Engine_publishSchedule(that, schedule);
 }
 
 
-template<typename T>
-using IdentityDictionary = std::unordered_map<T, T>;
+/** Stops the current worker threads and starts `threadCount - 1` new ones.
+Must be called while stepBlock() is not running, typically with `processMutex` write-locked.
+*/
+static void Engine_relaunchWorkers(Engine* that, int threadCount) {
+	Engine::Internal* internal = that->internal;
 
-template<typename T>
-inline bool dictContains(IdentityDictionary<T>& dict, T key) {
-	return dict.find(key) != dict.end();
-}
+	if (!internal->workers.empty()) {
+		// Stop engine workers
+		for (EngineWorker& worker : internal->workers)
+			worker.requestStop();
+		internal->engineBarrier.wait();
+		// Join and destroy engine workers
+		for (EngineWorker& worker : internal->workers)
+			worker.join();
+		internal->workers.clear();
+	}
 
-template<typename T>
-inline void dictAdd(IdentityDictionary<T>& dict, T key) {
-	dict[key] = key;
-}
+	// Configure engine
+	internal->threadCount = threadCount;
+	internal->context = contextGet();
+
+	// Set barrier counts
+	internal->engineBarrier.setThreads(threadCount);
+	internal->workerBarrier.setThreads(threadCount);
+
+	if (threadCount > 1) {
+		// Create and start engine workers
+		internal->workers.resize(threadCount - 1);
+		for (int id = 1; id < threadCount; id++) {
+			EngineWorker& worker = internal->workers[id - 1];
+			worker.id = id;
+			worker.engine = that;
+			worker.start();
+		}
+	}
 
-static void Engine_storeTerminalModulesIDs(std::vector<TerminalModule*> terminalModules, IdentityDictionary<int64_t>& terminalModulesIDs) {
-	for (TerminalModule* terminalModule : terminalModules)
-		dictAdd(terminalModulesIDs, terminalModule->id);
+	Engine_updateSchedule(that);
 }
 
-static void Engine_orderModule(Module* module, IdentityDictionary<Module*>& touchedModules, std::vector<Module*>& orderedModules, IdentityDictionary<int64_t>& terminalModulesIDs) {
-	if (!dictContains(touchedModules, module) && !dictContains(terminalModulesIDs, module->id)) { // Ignore feedback loops and terminal modules
-		dictAdd(touchedModules, module);
+
+/** Moves modules so that `cable` goes forward in the module order, touching only the modules placed between both ends of the cable.
+This is the Pearce-Kelly dynamic topological sort, applied to the cables that already go forward.
+Returns false if the cable closes a feedback loop, in which case the order is left untouched.
+*/
+static bool Engine_orderCable(Engine* that, Cable* cable) {
+	Engine::Internal* internal = that->internal;
+	std::unordered_map<Module*, size_t>& moduleIndexes = internal->moduleIndexes;
+
+	auto outputIt = moduleIndexes.find(cable->outputModule);
+	auto inputIt = moduleIndexes.find(cable->inputModule);
+	// Terminal modules are processed before and after all other modules
+	if (outputIt == moduleIndexes.end() || inputIt == moduleIndexes.end())
+		return true;
+	const size_t lower = inputIt->second;
+	const size_t upper = outputIt->second;
+	if (lower > upper)
+		return true;
+	if (lower == upper)
+		return false;
+
+	// Modules reachable from the cable's input module, without going past its output module
+	std::vector<Module*> forward;
+	std::unordered_set<Module*> visited;
+	std::vector<Module*> stack;
+	stack.push_back(cable->inputModule);
+	visited.insert(cable->inputModule);
+	while (!stack.empty()) {
+		Module* const module = stack.back();
+		stack.pop_back();
+		forward.push_back(module);
+		const size_t index = moduleIndexes[module];
 		for (Output& output : module->outputs) {
-			for (Cable* cable : output.cables) {
-				Module* receiver = cable->inputModule; // The input to the cable is the receiving module
-				Engine_orderModule(receiver, touchedModules, orderedModules, terminalModulesIDs);
+			for (Cable* cable2 : output.cables) {
+				auto it = moduleIndexes.find(cable2->inputModule);
+				// Feedback cables don't constrain the order
+				if (it == moduleIndexes.end() || it->second <= index || it->second > upper)
+					continue;
+				if (it->second == upper)
+					return false;
+				if (visited.insert(cable2->inputModule).second)
+					stack.push_back(cable2->inputModule);
 			}
 		}
-		orderedModules.push_back(module);
 	}
-}
 
-static void Engine_assignOrderedModules(std::vector<Module*>& modules, std::vector<Module*>& orderedModules) {
-	std::reverse(orderedModules.begin(), orderedModules.end()); // These are stored bottom up
-	if (orderedModules.size() == modules.size()) {
-		for (unsigned int i = 0; i < orderedModules.size(); i++)
-			modules[i] = orderedModules[i];
+	// Modules reaching the cable's output module, without going before its input module
+	std::vector<Module*> backward;
+	stack.push_back(cable->outputModule);
+	visited.insert(cable->outputModule);
+	while (!stack.empty()) {
+		Module* const module = stack.back();
+		stack.pop_back();
+		backward.push_back(module);
+		const size_t index = moduleIndexes[module];
+		for (Input& input : module->inputs) {
+			auto cableIt = internal->inputCables.find(&input);
+			if (cableIt == internal->inputCables.end())
+				continue;
+			Module* const source = cableIt->second->outputModule;
+			auto it = moduleIndexes.find(source);
+			if (it == moduleIndexes.end() || it->second >= index || it->second < lower)
+				continue;
+			if (visited.insert(source).second)
+				stack.push_back(source);
+		}
+	}
+
+	// Reuse the positions of both sets, placing the backward set first
+	auto byIndex = [&moduleIndexes](Module* a, Module* b) {
+		return moduleIndexes[a] < moduleIndexes[b];
+	};
+	std::sort(forward.begin(), forward.end(), byIndex);
+	std::sort(backward.begin(), backward.end(), byIndex);
+
+	std::vector<size_t> positions;
+	positions.reserve(forward.size() + backward.size());
+	for (Module* module : backward)
+		positions.push_back(moduleIndexes[module]);
+	for (Module* module : forward)
+		positions.push_back(moduleIndexes[module]);
+	std::sort(positions.begin(), positions.end());
+
+	size_t k = 0;
+	for (Module* module : backward) {
+		internal->modules[positions[k]] = module;
+		moduleIndexes[module] = positions[k++];
 	}
+	for (Module* module : forward) {
+		internal->modules[positions[k]] = module;
+		moduleIndexes[module] = positions[k++];
+	}
+
+	// Feedback cables between moved modules might go forward now
+	for (auto it = internal->backwardCables.begin(); it != internal->backwardCables.end();) {
+		if (moduleIndexes[(*it)->outputModule] < moduleIndexes[(*it)->inputModule])
+			it = internal->backwardCables.erase(it);
+		else
+			++it;
+	}
+
+	return true;
 }
 
-#if DEBUG_ORDERED_MODULES
-static void Engine_debugOrderedModules(std::vector<Module*>& modules) {
-	printf("\n--- Ordered modules ---\n");
-	for (unsigned int i = 0; i < modules.size(); i++)
-		printf("%d) %s - %ld\n", i, modules[i]->model->getFullName().c_str(), modules[i]->id);
+
+/** Dispatches a PortChangeEvent to a module.
+*/
+static void Engine_dispatchPortChange(Module* module, Port::Type type, int portId, bool connecting) {
+	Module::PortChangeEvent e;
+	e.connecting = connecting;
+	e.type = type;
+	e.portId = portId;
+	module->onPortChange(e);
 }
-#endif
 
-/** Order the modules so that they always read the most recent sample from their inputs
+
+/** Connects the ports of a newly added cable and updates the module order for it.
+The ports are connected between two blocks, along with the first schedule that steps the cable.
+Port events are dispatched on the calling thread, while the modules may be processed.
 */
-static void Engine_orderModules(Engine* that) {
+static void Engine_connectCable(Engine* that, Cable* cable, bool outputWasConnected) {
 	Engine::Internal* internal = that->internal;
 
-	IdentityDictionary<int64_t> terminalModulesIDs;
-	Engine_storeTerminalModulesIDs(internal->terminalModules, terminalModulesIDs);
+	Engine_queuePortChange(that, EnginePortChange::CONNECT, &cable->inputModule->inputs[cable->inputId]);
+	Engine_queuePortChange(that, EnginePortChange::CONNECT, &cable->outputModule->outputs[cable->outputId]);
 
-	IdentityDictionary<Module*> touchedModules;
-	std::vector<Module*> orderedModules; 
-	orderedModules.reserve(internal->modules.size());
-	for (Module* module : internal->modules)
-		Engine_orderModule(module, touchedModules, orderedModules, terminalModulesIDs);
+	if (internal->topologyBatch > 0) {
+		internal->topologyDirty = true;
+	}
+	else if (!Engine_orderCable(that, cable)) {
+		internal->backwardCables.insert(cable);
+	}
 
-	Engine_assignOrderedModules(internal->modules, orderedModules);
+	Engine_updateSchedule(that);
+	Engine_publishPortChanges(that);
 
-#if DEBUG_ORDERED_MODULES
-	Engine_debugOrderedModules(internal->modules);
-#endif
+	// Dispatch input port event
+	Engine_dispatchPortChange(cable->inputModule, Port::INPUT, cable->inputId, true);
+	// Dispatch output port event if its state went from disconnected to connected.
+	if (!outputWasConnected)
+		Engine_dispatchPortChange(cable->outputModule, Port::OUTPUT, cable->outputId, true);
 }
 
 
-static void Engine_updateConnected(Engine* that) {
-	// Find disconnected ports
-	std::set<Input*> disconnectedInputs;
-	std::set<Output*> disconnectedOutputs;
-	for (Module* module : that->internal->modules) {
-		for (Input& input : module->inputs) {
-			disconnectedInputs.insert(&input);
-		}
-		for (Output& output : module->outputs) {
-			disconnectedOutputs.insert(&output);
-		}
+/** Disconnects the ports of a removed cable and updates the module order for it.
+The ports are disconnected between two blocks, along with the first schedule that doesn't step the cable anymore.
+Port events are dispatched on the calling thread, while the modules may be processed.
+*/
+static void Engine_disconnectCable(Engine* that, Cable* cable) {
+	Engine::Internal* internal = that->internal;
+
+	Engine_queuePortChange(that, EnginePortChange::DISCONNECT, &cable->inputModule->inputs[cable->inputId]);
+	// It's best to not trust `cable->outputModule->outputs[cable->outputId]->isConnected()`
+	const bool outputDisconnected = cable->outputModule->outputs[cable->outputId].cables.empty();
+	if (outputDisconnected)
+		Engine_queuePortChange(that, EnginePortChange::DISCONNECT, &cable->outputModule->outputs[cable->outputId]);
+
+	internal->backwardCables.erase(cable);
+
+	if (internal->topologyBatch > 0) {
+		internal->topologyDirty = true;
 	}
-	for (TerminalModule* terminalModule : that->internal->terminalModules) {
-		for (Input& input : terminalModule->inputs) {
-			disconnectedInputs.insert(&input);
-		}
-		for (Output& output : terminalModule->outputs) {
-			disconnectedOutputs.insert(&output);
+	else if (!internal->backwardCables.empty()) {
+		// Removing a cable might break a feedback loop, so try to order the remaining feedback cables again
+		std::vector<Cable*> backwardCables(internal->backwardCables.begin(), internal->backwardCables.end());
+		for (Cable* cable2 : backwardCables) {
+			if (internal->backwardCables.find(cable2) != internal->backwardCables.end() && Engine_orderCable(that, cable2))
+				internal->backwardCables.erase(cable2);
 		}
 	}
-	for (Cable* cable : that->internal->cables) {
-		// Connect input
-		Input& input = cable->inputModule->inputs[cable->inputId];
-		auto inputIt = disconnectedInputs.find(&input);
-		if (inputIt != disconnectedInputs.end())
-			disconnectedInputs.erase(inputIt);
-		Port_setConnected(&input);
-		// Connect output
-		Output& output = cable->outputModule->outputs[cable->outputId];
-		auto outputIt = disconnectedOutputs.find(&output);
-		if (outputIt != disconnectedOutputs.end())
-			disconnectedOutputs.erase(outputIt);
-		Port_setConnected(&output);
-	}
-	// Disconnect ports that have no cable
-	for (Input* input : disconnectedInputs) {
-		Port_setDisconnected(input);
-	}
-	for (Output* output : disconnectedOutputs) {
-		Port_setDisconnected(output);
-		DISTRHO_SAFE_ASSERT(output->cables.empty());
-	}
-	// Order the modules according to their connections
+
+	Engine_updateSchedule(that);
+	Engine_publishPortChanges(that);
+
+	// Dispatch input port event
+	Engine_dispatchPortChange(cable->inputModule, Port::INPUT, cable->inputId, false);
+	// Dispatch output port event if its state went from connected to disconnected.
+	if (outputDisconnected)
+		Engine_dispatchPortChange(cable->outputModule, Port::OUTPUT, cable->outputId, false);
+}
+
+
+static void Engine_endTopologyBatch_NoLock(Engine* that) {
+	Engine::Internal* internal = that->internal;
+	DISTRHO_SAFE_ASSERT_RETURN(internal->topologyBatch > 0,);
+
+	if (--internal->topologyBatch != 0)
+		return;
+
+	internal->batchScheduled = false;
+	if (!internal->topologyDirty)
+		return;
+
+	internal->topologyDirty = false;
 	Engine_orderModules(that);
 }
 
@@ -481,20 +2481,77 @@ static void Engine_refreshParamHandleCache(Engine* that) {
 	// Add active ParamHandles to cache
 	for (ParamHandle* paramHandle : that->internal->paramHandles) {
 		if (paramHandle->moduleId >= 0) {
-			that->internal->paramHandlesCache[std::make_tuple(paramHandle->moduleId, paramHandle->paramId)] = paramHandle;
+			that->internal->paramHandlesCache.set(std::make_tuple(paramHandle->moduleId, paramHandle->paramId), paramHandle);
 		}
 	}
 }
 
 
+void Engine_setTracing(Engine* engine, bool tracing);
+bool Engine_saveTrace(Engine* engine, const std::string& path, double seconds);
+void Engine_discardStagedPatch(Engine* engine, json_t* rootJ);
+
+
+/** Records the trace events of a block that started at `startTime`, once all its modules are processed.
+Modules are processed frame by frame, so the time spent on each one is summed over the block and shown from its start.
+*/
+static void Engine_traceBlock(Engine* that, EngineSchedule* schedule, double startTime, int frames) {
+	Engine::Internal* internal = that->internal;
+	EngineTrace& trace = internal->trace;
+
+	for (size_t i = 0; i < schedule->traceDurations.size(); i++) {
+		float& duration = schedule->traceDurations[i];
+		if (duration <= 0.f)
+			continue;
+		trace.push(EngineTraceEvent::MODULE, internal->blockTime, duration, schedule->moduleIds[i].first);
+		duration = 0.f;
+	}
+
+	if (internal->traceSmoothing > 0.f) {
+		trace.push(EngineTraceEvent::SMOOTHING, internal->blockTime, internal->traceSmoothing);
+		internal->traceSmoothing = 0.f;
+	}
+
+	trace.push(EngineTraceEvent::BLOCK, startTime, system::getTime() - startTime, frames);
+}
+
+
 Engine::Engine() {
 	internal = new Internal;
+	internal->schedule = new EngineSchedule;
+
+	// Record from the start, for problems that happen before the menu can be reached
+	if (const char* const traceEnv = std::getenv("CARDINAL_ENGINE_TRACE")) {
+		internal->traceSecondsOnExit = std::atof(traceEnv);
+		if (internal->traceSecondsOnExit > 0.0)
+			Engine_setTracing(this, true);
+	}
 }
 
 
 Engine::~Engine() {
+	// Save the trace while module names are still known
+	if (internal->traceSecondsOnExit > 0.0) {
+		const std::string tracePath = asset::user("engine-trace.json");
+		if (Engine_saveTrace(this, tracePath, internal->traceSecondsOnExit))
+			INFO("Saved engine trace to %s", tracePath.c_str());
+	}
+
 	// Clear modules, cables, etc
 	clear();
+	Engine_discardStagedPatch(this, NULL);
+
+	// Shut down workers
+	Engine_relaunchWorkers(this, 1);
+	if (internal->offloadThread.joinable()) {
+		{
+			std::lock_guard<std::mutex> lock(internal->offloadMutex);
+			internal->offloadRunning = false;
+		}
+		internal->offloadCv.notify_one();
+		internal->offloadThread.join();
+	}
+	internal->offloadPlaySchedule = nullptr;
 
 	// Make sure there are no cables or modules in the rack on destruction.
 	// If this happens, a module must have failed to remove itself before the RackWidget was destroyed.
@@ -507,17 +2564,25 @@ Engine::~Engine() {
 	DISTRHO_SAFE_ASSERT(internal->cablesCache.empty());
 	DISTRHO_SAFE_ASSERT(internal->paramHandlesCache.empty());
 
+	Engine_reclaimSchedules(this);
+	DISTRHO_SAFE_ASSERT(internal->retiredSchedules.empty());
+	delete internal->schedule.load();
+
 	delete internal;
 }
 
 
 void Engine::clear() {
+	std::lock_guard<SharedMutex> processLock(internal->processMutex);
+	Engine_waitForOffloads(this);
 	std::lock_guard<SharedMutex> lock(internal->mutex);
 	clear_NoLock();
 }
 
 
 void Engine::clear_NoLock() {
+	// Nothing is left to order afterwards
+	internal->topologyBatch++;
 	// Copy lists because we'll be removing while iterating
 	std::set<ParamHandle*> paramHandles = internal->paramHandles;
 	for (ParamHandle* paramHandle : paramHandles) {
@@ -539,34 +2604,109 @@ void Engine::clear_NoLock() {
 		removeModule_NoLock(terminalModule);
 		delete terminalModule;
 	}
+	Engine_endTopologyBatch_NoLock(this);
 }
 
 
 void Engine::stepBlock(int frames) {
-#ifndef HEADLESS
 	// Start timer before locking
 	double startTime = system::getTime();
-#endif
 
-	SharedLock<SharedMutex> lock(internal->mutex);
+	SharedLock<SharedMutex> lock(internal->processMutex);
+	// Port changes are applied between blocks, only a writer applying some can hold this
+	for (uint32_t spins = 1; internal->portChangesBusy.exchange(true, std::memory_order_acquire); spins++) {
+#if defined ARCH_X64
+		__builtin_ia32_pause();
+#endif
+		if (spins % 1024 == 0)
+			std::this_thread::yield();
+	}
+	// Before picking the schedule, which is published before the changes that go with it
+	Engine_applyPortChanges(internal);
 	// Configure thread
 	random::init();
+	Engine_seedRandom(internal, internal->audioRandomSeedGeneration, 1);
+
+	// The whole block is either traced or not
+	const bool tracing = internal->trace.enabled.load(std::memory_order_acquire);
+	internal->traceBlock = tracing;
+	if (tracing)
+		internal->trace.push(EngineTraceEvent::LOCK_WAIT, startTime, system::getTime() - startTime);
+
+	// Use the latest schedule for the whole block.
+	// Announce it first, and make sure it wasn't replaced in the meantime, so that it can't be deleted while in use.
+	EngineSchedule* schedule;
+	do {
+		schedule = internal->schedule.load();
+		internal->activeSchedule.store(schedule);
+	} while (schedule != internal->schedule.load());
+
+	// Offloaded modules of the previous schedule must be done before the new one plays them back
+	EngineSchedule* const offloadPlaySchedule = internal->offloadPlaySchedule.load(std::memory_order_relaxed);
+	if (offloadPlaySchedule && offloadPlaySchedule != schedule)
+		Engine_switchOffloads(this, schedule, offloadPlaySchedule);
 
 	internal->blockFrame = internal->frame;
 	internal->blockTime = system::getTime();
 	internal->blockFrames = frames;
 
-	// Update expander pointers
-	for (Module* module : internal->modules) {
-		Engine_updateExpander_NoLock(this, module, false);
-		Engine_updateExpander_NoLock(this, module, true);
+	// Update expander pointers, and find the ones that exchange messages.
+	// Buffers set up in the middle of a block start flipping on the next one.
+	schedule->messageExpanders.clear();
+	for (Module* module : schedule->modules) {
+		Engine_updateExpander(schedule, module, false);
+		Engine_updateExpander(schedule, module, true);
+		if (module->leftExpander.producerMessage || module->leftExpander.consumerMessage)
+			schedule->messageExpanders.push_back(&module->leftExpander);
+		if (module->rightExpander.producerMessage || module->rightExpander.consumerMessage)
+			schedule->messageExpanders.push_back(&module->rightExpander);
 	}
 
-	// Step individual frames
-	for (int i = 0; i < frames; i++) {
-		Engine_stepFrame(this);
+	// Step individual frames, in chunks that block modules process all at once
+	const bool hasBlockModules = !schedule->blockModules.empty();
+	const bool hasOffloads = !schedule->offloads.empty();
+	if (!hasOffloads && internal->offloadLatency.load(std::memory_order_relaxed) != 0)
+		internal->offloadLatency.store(0, std::memory_order_relaxed);
+	for (int i = 0; i < frames;) {
+		const int chunkFrames = std::min(frames - i, BLOCK_MAX_FRAMES);
+
+		if (hasBlockModules)
+			Engine_processBlockModules(this, schedule, chunkFrames);
+
+		for (int k = 0; k < chunkFrames; k++) {
+			Engine_stepFrame(this, schedule, k);
+		}
+
+		if (hasBlockModules)
+			Engine_processBlockTerminalOutputs(this, schedule, chunkFrames);
+
+		i += chunkFrames;
+
+		// Offloaded modules lag behind by one block, or by OFFLOAD_MAX_FRAMES for longer blocks
+		if (hasOffloads && (i == frames || schedule->offloadFrame == OFFLOAD_MAX_FRAMES))
+			Engine_handOffOffloads(this, schedule);
 	}
 
+	// Let workers sleep until the next block
+	yieldWorkers();
+
+	int sleepingCount = 0;
+	for (const EngineSleep& sleep : schedule->sleeps)
+		sleepingCount += sleep.asleep;
+	internal->sleepingCount.store(sleepingCount, std::memory_order_relaxed);
+
+	if (tracing)
+		Engine_traceBlock(this, schedule, startTime, frames);
+
+	internal->activeSchedule.store(nullptr);
+
+	// Apply the changes published during the block, in case no other block follows.
+	// Changes published while releasing are seen either here or by their writer.
+	Engine_applyPortChanges(internal);
+	internal->portChangesBusy.store(false);
+	if (internal->portChangesRead.load() != internal->portChangesWritten.load())
+		Engine_tryApplyPortChanges(internal);
+
 	internal->block++;
 
 #ifndef HEADLESS
@@ -612,6 +2752,8 @@ float Engine::getSampleRate() {
 void Engine::setSampleRate(float sampleRate) {
 	if (sampleRate == internal->sampleRate)
 		return;
+	std::lock_guard<SharedMutex> processLock(internal->processMutex);
+	Engine_waitForOffloads(this);
 	std::lock_guard<SharedMutex> lock(internal->mutex);
 
 	internal->sampleRate = sampleRate;
@@ -639,6 +2781,7 @@ float Engine::getSampleTime() {
 
 
 void Engine::yieldWorkers() {
+	internal->engineBarrier.yield();
 }
 
 
@@ -734,7 +2877,10 @@ static TerminalModule* asTerminalModule(Module* const module) {
 }
 
 
-void Engine::addModule(Module* module) {
+/** Adds a module, skipping its SampleRateChangeEvent if `sampleRateReady`, as for staged patches.
+*/
+static void Engine_addModule(Engine* that, Module* module, bool sampleRateReady) {
+	Engine::Internal* internal = that->internal;
 	std::lock_guard<SharedMutex> lock(internal->mutex);
 	DISTRHO_SAFE_ASSERT_RETURN(module != nullptr,);
 	// Check that the module is not already added
@@ -743,58 +2889,61 @@ void Engine::addModule(Module* module) {
 	auto tit = std::find(internal->terminalModules.begin(), internal->terminalModules.end(), module);
 	DISTRHO_SAFE_ASSERT_RETURN(tit == internal->terminalModules.end(),);
 	// Set ID if unset or collides with an existing ID
-	while (module->id < 0 || internal->modulesCache.find(module->id) != internal->modulesCache.end()) {
+	while (module->id < 0 || internal->modulesCache.get(module->id)) {
 		// Randomly generate ID
 		module->id = random::u64() % (1ull << 53);
 	}
 	// Add module
 	if (TerminalModule* const terminalModule = asTerminalModule(module))
 		internal->terminalModules.push_back(terminalModule);
-	else
+	else {
+		internal->moduleIndexes[module] = internal->modules.size();
 		internal->modules.push_back(module);
-	internal->modulesCache[module->id] = module;
+		if (dynamic_cast<SleepModule*>(module))
+			internal->sleepModules.insert(module);
+	}
+	internal->modulesCache.set(module->id, module);
 	// Dispatch AddEvent
 	Module::AddEvent eAdd;
 	module->onAdd(eAdd);
 	// Dispatch SampleRateChangeEvent
-	Module::SampleRateChangeEvent eSrc;
-	eSrc.sampleRate = internal->sampleRate;
-	eSrc.sampleTime = internal->sampleTime;
-	module->onSampleRateChange(eSrc);
+	if (!sampleRateReady) {
+		Module::SampleRateChangeEvent eSrc;
+		eSrc.sampleRate = internal->sampleRate;
+		eSrc.sampleTime = internal->sampleTime;
+		module->onSampleRateChange(eSrc);
+	}
 	// Update ParamHandles' module pointers
 	for (ParamHandle* paramHandle : internal->paramHandles) {
 		if (paramHandle->moduleId == module->id)
 			paramHandle->module = module;
 	}
+	// The audio thread only sees the module from here on
+	Engine_updateSchedule(that);
 #if DEBUG_ORDERED_MODULES
 	printf("New module: %s - %ld\n", module->model->getFullName().c_str(), module->id);
 #endif
 }
 
 
-void Engine::removeModule(Module* module) {
-	std::lock_guard<SharedMutex> lock(internal->mutex);
-	removeModule_NoLock(module);
+void Engine::addModule(Module* module) {
+	Engine_addModule(this, module, false);
 }
 
 
-static void removeModule_NoLock_common(Engine::Internal* internal, Module* module) {
+static bool removeModule_NoLock_common(Engine::Internal* internal, Module* module) {
 	// Remove from widgets cache
 	CardinalPluginModelHelper* const helper = dynamic_cast<CardinalPluginModelHelper*>(module->model);
-	DISTRHO_SAFE_ASSERT_RETURN(helper != nullptr,);
+	DISTRHO_SAFE_ASSERT_RETURN(helper != nullptr, false);
 	helper->removeCachedModuleWidget(module);
-	// Dispatch RemoveEvent
-	Module::RemoveEvent eRemove;
-	module->onRemove(eRemove);
 	// Update ParamHandles' module pointers
 	for (ParamHandle* paramHandle : internal->paramHandles) {
 		if (paramHandle->moduleId == module->id)
 			paramHandle->module = NULL;
 	}
-	// If a param is being smoothed on this module, stop smoothing it immediately
-	if (module == internal->smoothModule) {
-		internal->smoothModule = NULL;
-	}
+	// If a param is being smoothed on this module, stop smoothing it immediately.
+	// The audio thread is kept away, so this can wait for other threads writing ramps.
+	Engine_cancelSmoothRamps(internal, module, -1, true);
 	// Check that all cables are disconnected
 	for (Cable* cable : internal->cables) {
 		DISTRHO_SAFE_ASSERT(cable->inputModule != module);
@@ -818,24 +2967,72 @@ static void removeModule_NoLock_common(Engine::Internal* internal, Module* modul
 	module->rightExpander.module = NULL;
 	// Remove module
 	internal->modulesCache.erase(module->id);
+	internal->sleepModules.erase(module);
+	internal->offloadModules.erase(module);
+	return true;
 }
 
 
-void Engine::removeModule_NoLock(Module* module) {
-	DISTRHO_SAFE_ASSERT_RETURN(module,);
+/** Takes a module out of the engine and publishes a schedule without it.
+The audio thread might still be processing it until Engine_waitForSchedule() returns.
+*/
+static bool Engine_detachModule(Engine* that, Module* module) {
+	Engine::Internal* internal = that->internal;
+	DISTRHO_SAFE_ASSERT_RETURN(module, false);
 	// Check that the module actually exists
 	if (TerminalModule* const terminalModule = asTerminalModule(module)) {
 		auto tit = std::find(internal->terminalModules.begin(), internal->terminalModules.end(), terminalModule);
-		DISTRHO_SAFE_ASSERT_RETURN(tit != internal->terminalModules.end(),);
-		removeModule_NoLock_common(internal, module);
+		DISTRHO_SAFE_ASSERT_RETURN(tit != internal->terminalModules.end(), false);
+		if (!removeModule_NoLock_common(internal, module))
+			return false;
 		internal->terminalModules.erase(tit);
 	}
 	else {
 		auto it = std::find(internal->modules.begin(), internal->modules.end(), module);
-		DISTRHO_SAFE_ASSERT_RETURN(it != internal->modules.end(),);
-		removeModule_NoLock_common(internal, module);
+		DISTRHO_SAFE_ASSERT_RETURN(it != internal->modules.end(), false);
+		if (!removeModule_NoLock_common(internal, module))
+			return false;
+		const size_t index = it - internal->modules.begin();
 		internal->modules.erase(it);
+		internal->moduleIndexes.erase(module);
+		// Removing a module keeps the order valid, only the following positions shift
+		if (internal->topologyBatch > 0)
+			internal->topologyDirty = true;
+		else
+			Engine_indexModules(that, index);
 	}
+	Engine_updateSchedule(that);
+	return true;
+}
+
+
+void Engine::removeModule(Module* module) {
+	std::unique_lock<SharedMutex> lock(internal->mutex);
+	if (!Engine_detachModule(this, module))
+		return;
+	// Don't hold the lock while the audio thread finishes its block.
+	// Changes still queued for its ports must be applied before it goes away.
+	lock.unlock();
+	Engine_waitForSchedule(this);
+	Engine_flushPortChanges(internal);
+	lock.lock();
+	Engine_reclaimSchedules(this);
+	// Dispatch RemoveEvent
+	Module::RemoveEvent eRemove;
+	module->onRemove(eRemove);
+}
+
+
+void Engine::removeModule_NoLock(Module* module) {
+	if (!Engine_detachModule(this, module))
+		return;
+	// Returns right away if `processMutex` is held, as in clear()
+	Engine_waitForSchedule(this);
+	Engine_flushPortChanges(internal);
+	Engine_reclaimSchedules(this);
+	// Dispatch RemoveEvent
+	Module::RemoveEvent eRemove;
+	module->onRemove(eRemove);
 }
 
 
@@ -855,14 +3052,13 @@ Module* Engine::getModule(int64_t moduleId) {
 
 
 Module* Engine::getModule_NoLock(int64_t moduleId) {
-	auto it = internal->modulesCache.find(moduleId);
-	if (it == internal->modulesCache.end())
-		return NULL;
-	return it->second;
+	return internal->modulesCache.get(moduleId);
 }
 
 
 void Engine::resetModule(Module* module) {
+	std::lock_guard<SharedMutex> processLock(internal->processMutex);
+	Engine_waitForOffloads(this);
 	std::lock_guard<SharedMutex> lock(internal->mutex);
 	DISTRHO_SAFE_ASSERT_RETURN(module,);
 
@@ -872,6 +3068,8 @@ void Engine::resetModule(Module* module) {
 
 
 void Engine::randomizeModule(Module* module) {
+	std::lock_guard<SharedMutex> processLock(internal->processMutex);
+	Engine_waitForOffloads(this);
 	std::lock_guard<SharedMutex> lock(internal->mutex);
 	DISTRHO_SAFE_ASSERT_RETURN(module,);
 
@@ -885,15 +3083,16 @@ void Engine::bypassModule(Module* module, bool bypassed) {
 	if (module->isBypassed() == bypassed)
 		return;
 
+	Engine_reservePortChanges(internal, 1);
 	std::lock_guard<SharedMutex> lock(internal->mutex);
 
-	// Clear outputs and set to 1 channel
-	for (Output& output : module->outputs) {
-		// This zeros all voltages, but the channel is set to 1 if connected
-		output.setChannels(0);
-	}
-	// Set bypassed state
+	// Set bypassed state, the module switches between process() and processBypass() on its next frame
 	module->setBypassed(bypassed);
+	// Clear outputs and set to 1 channel, between two blocks
+	Engine_queuePortChange(this, EnginePortChange::CLEAR_OUTPUTS, nullptr, module);
+	// Bypassed block modules are processed frame by frame
+	Engine_updateSchedule(this);
+	Engine_publishPortChanges(this);
 	if (bypassed) {
 		// Dispatch BypassEvent
 		Module::BypassEvent eBypass;
@@ -907,15 +3106,46 @@ void Engine::bypassModule(Module* module, bool bypassed) {
 }
 
 
+/** Allows or prevents a module from sleeping, see Engine_setModuleCanSleep().
+Requires the write lock.
+*/
+static void Engine_updateModuleCanSleep(Engine* that, Module* module, bool canSleep) {
+	Engine::Internal* internal = that->internal;
+	if (internal->moduleIndexes.find(module) == internal->moduleIndexes.end())
+		return;
+	const bool wasAllowed = internal->sleepModules.find(module) != internal->sleepModules.end();
+	if (canSleep == wasAllowed)
+		return;
+	if (canSleep)
+		internal->sleepModules.insert(module);
+	else
+		internal->sleepModules.erase(module);
+	Engine_updateSchedule(that);
+}
+
+
 json_t* Engine::moduleToJson(Module* module) {
 	SharedLock<SharedMutex> lock(internal->mutex);
-	return module->toJson();
+	json_t* moduleJ = module->toJson();
+	// canSleep, only stored when it differs from the module's default, like in toJson()
+	const bool canSleep = internal->sleepModules.find(module) != internal->sleepModules.end();
+	if (canSleep != (dynamic_cast<SleepModule*>(module) != nullptr))
+		json_object_set_new(moduleJ, "canSleep", json_boolean(canSleep));
+	return moduleJ;
 }
 
 
 void Engine::moduleFromJson(Module* module, json_t* rootJ) {
+	std::unique_lock<SharedMutex> processLock(internal->processMutex);
+	Engine_waitForOffloads(this);
 	std::lock_guard<SharedMutex> lock(internal->mutex);
 	module->fromJson(rootJ);
+	// The module is loaded, the audio thread can go on while the schedule is rebuilt
+	processLock.unlock();
+	// canSleep, falls back to the module's default when not stored
+	json_t* const canSleepJ = json_object_get(rootJ, "canSleep");
+	const bool canSleep = canSleepJ ? json_boolean_value(canSleepJ) : dynamic_cast<SleepModule*>(module) != nullptr;
+	Engine_updateModuleCanSleep(this, module, canSleep);
 }
 
 
@@ -971,53 +3201,36 @@ std::vector<int64_t> Engine::getCableIds() {
 
 
 void Engine::addCable(Cable* cable) {
+	Engine_reservePortChanges(internal, 2);
 	std::lock_guard<SharedMutex> lock(internal->mutex);
 	DISTRHO_SAFE_ASSERT_RETURN(cable,);
 	// Check cable properties
 	DISTRHO_SAFE_ASSERT_RETURN(cable->inputModule,);
 	DISTRHO_SAFE_ASSERT_RETURN(cable->outputModule,);
-	bool outputWasConnected = false;
-	for (Cable* cable2 : internal->cables) {
-		// Check that the cable is not already added
-		DISTRHO_SAFE_ASSERT_RETURN(cable2 != cable,);
-		// Check that the input is not already used by another cable
-		DISTRHO_SAFE_ASSERT_RETURN(!(cable2->inputModule == cable->inputModule && cable2->inputId == cable->inputId),);
-		// Get connected status of output, to decide whether we need to call a PortChangeEvent.
-		// It's best to not trust `cable->outputModule->outputs[cable->outputId]->isConnected()`
-		if (cable2->outputModule == cable->outputModule && cable2->outputId == cable->outputId)
-			outputWasConnected = true;
-	}
+	Input& input = cable->inputModule->inputs[cable->inputId];
+	Output& output = cable->outputModule->outputs[cable->outputId];
+	// Check that the cable is not already added, and that the input is not already used by another cable
+	DISTRHO_SAFE_ASSERT_RETURN(internal->inputCables.find(&input) == internal->inputCables.end(),);
+	// Get connected status of output, to decide whether we need to call a PortChangeEvent.
+	// It's best to not trust `cable->outputModule->outputs[cable->outputId]->isConnected()`
+	const bool outputWasConnected = !output.cables.empty();
 	// Set ID if unset or collides with an existing ID
-	while (cable->id < 0 || internal->cablesCache.find(cable->id) != internal->cablesCache.end()) {
+	while (cable->id < 0 || internal->cablesCache.get(cable->id)) {
 		// Randomly generate ID
 		cable->id = random::u64() % (1ull << 53);
 	}
 	// Add the cable
 	internal->cables.push_back(cable);
-	internal->cablesCache[cable->id] = cable;
+	internal->cablesCache.set(cable->id, cable);
+	internal->inputCables[&input] = cable;
 	// Add the cable's zero-latency shortcut
-	cable->outputModule->outputs[cable->outputId].cables.push_back(cable);
-	Engine_updateConnected(this);
-	// Dispatch input port event
-	{
-		Module::PortChangeEvent e;
-		e.connecting = true;
-		e.type = Port::INPUT;
-		e.portId = cable->inputId;
-		cable->inputModule->onPortChange(e);
-	}
-	// Dispatch output port event if its state went from disconnected to connected.
-	if (!outputWasConnected) {
-		Module::PortChangeEvent e;
-		e.connecting = true;
-		e.type = Port::OUTPUT;
-		e.portId = cable->outputId;
-		cable->outputModule->onPortChange(e);
-	}
+	output.cables.push_back(cable);
+	Engine_connectCable(this, cable, outputWasConnected);
 }
 
 
 void Engine::removeCable(Cable* cable) {
+	Engine_reservePortChanges(internal, 2);
 	std::lock_guard<SharedMutex> lock(internal->mutex);
 	removeCable_NoLock(cable);
 }
@@ -1029,34 +3242,14 @@ void Engine::removeCable_NoLock(Cable* cable) {
 	auto it = std::find(internal->cables.begin(), internal->cables.end(), cable);
 	DISTRHO_SAFE_ASSERT_RETURN(it != internal->cables.end(),);
 	// Remove the cable's zero-latency shortcut
-	cable->outputModule->outputs[cable->outputId].cables.remove(cable);
+	Output& output = cable->outputModule->outputs[cable->outputId];
+	output.cables.remove(cable);
 	// Remove the cable
 	internal->cablesCache.erase(cable->id);
+	internal->inputCables.erase(&cable->inputModule->inputs[cable->inputId]);
 	internal->cables.erase(it);
-	Engine_updateConnected(this);
-	bool outputIsConnected = false;
-	for (Cable* cable2 : internal->cables) {
-		// Get connected status of output, to decide whether we need to call a PortChangeEvent.
-		// It's best to not trust `cable->outputModule->outputs[cable->outputId]->isConnected()`
-		if (cable2->outputModule == cable->outputModule && cable2->outputId == cable->outputId)
-			outputIsConnected = true;
-	}
-	// Dispatch input port event
-	{
-		Module::PortChangeEvent e;
-		e.connecting = false;
-		e.type = Port::INPUT;
-		e.portId = cable->inputId;
-		cable->inputModule->onPortChange(e);
-	}
-	// Dispatch output port event if its state went from connected to disconnected.
-	if (!outputIsConnected) {
-		Module::PortChangeEvent e;
-		e.connecting = false;
-		e.type = Port::OUTPUT;
-		e.portId = cable->outputId;
-		cable->outputModule->onPortChange(e);
-	}
+	// The cable itself is not part of any schedule, so it can be deleted right away
+	Engine_disconnectCable(this, cable);
 }
 
 
@@ -1070,19 +3263,13 @@ bool Engine::hasCable(Cable* cable) {
 
 Cable* Engine::getCable(int64_t cableId) {
 	SharedLock<SharedMutex> lock(internal->mutex);
-	auto it = internal->cablesCache.find(cableId);
-	if (it == internal->cablesCache.end())
-		return NULL;
-	return it->second;
+	return internal->cablesCache.get(cableId);
 }
 
 
 void Engine::setParamValue(Module* module, int paramId, float value) {
 	// If param is being smoothed, cancel smoothing.
-	if (internal->smoothModule == module && internal->smoothParamId == paramId) {
-		internal->smoothModule = NULL;
-		internal->smoothParamId = 0;
-	}
+	Engine_cancelSmoothRamps(internal, module, paramId);
 	if (internal->remoteDetails != nullptr && internal->remoteDetails->connected) {
 		sendParamChangeToRemote(internal->remoteDetails, module->id, paramId, value);
 	}
@@ -1095,26 +3282,68 @@ float Engine::getParamValue(Module* module, int paramId) {
 }
 
 
+/** Can be called from any thread, including from modules on the audio thread, such as MIDI mappers.
+*/
 void Engine::setParamSmoothValue(Module* module, int paramId, float value) {
-	// If another param is being smoothed, jump value
-	if (internal->smoothModule && !(internal->smoothModule == module && internal->smoothParamId == paramId)) {
-		internal->smoothModule->params[internal->smoothParamId].setValue(internal->smoothValue);
+	uint64_t state;
+
+	// Retarget the param if it is already moving
+	if (EngineSmoothRamp* ramp = Engine_findSmoothRamp(internal, module, paramId, state)) {
+		if (Engine_retargetSmoothRamp(ramp, state, value))
+			return;
+	}
+
+	// Another thread is starting a ramp, maybe for this param. Don't wait for it, this can be the audio thread.
+	if (internal->smoothClaiming.exchange(true, std::memory_order_acquire)) {
+		module->params[paramId].setValue(value);
+		return;
+	}
+	DEFER({
+		internal->smoothClaiming.store(false, std::memory_order_release);
+	});
+
+	// Look again, now that ramps can only be retargeted or ended
+	while (EngineSmoothRamp* ramp = Engine_findSmoothRamp(internal, module, paramId, state, true)) {
+		if ((state & EngineSmoothRamp::STATE_MASK) == EngineSmoothRamp::WRITING) {
+			// Retargeted by another thread at the same time, either value may win.
+			// It can't be reused for another param while `smoothClaiming` is held.
+			ramp->value.store(value, std::memory_order_relaxed);
+			return;
+		}
+		if (Engine_retargetSmoothRamp(ramp, state, value))
+			return;
+	}
+
+	// Otherwise claim a free ramp
+	for (EngineSmoothRamp& ramp : internal->smoothRamps) {
+		state = ramp.state.load(std::memory_order_relaxed);
+		if ((state & EngineSmoothRamp::STATE_MASK) != EngineSmoothRamp::FREE)
+			continue;
+		if (!ramp.state.compare_exchange_strong(state, state | EngineSmoothRamp::WRITING, std::memory_order_acquire))
+			continue;
+		ramp.module.store(module, std::memory_order_relaxed);
+		ramp.paramId.store(paramId, std::memory_order_relaxed);
+		ramp.value.store(value, std::memory_order_relaxed);
+		internal->smoothCount.fetch_add(1, std::memory_order_relaxed);
+		ramp.state.store(EngineSmoothRamp::next(state, EngineSmoothRamp::ACTIVE), std::memory_order_release);
+		return;
 	}
-	internal->smoothParamId = paramId;
-	internal->smoothValue = value;
-	// Set this last so the above values are valid as soon as it is set
-	internal->smoothModule = module;
+
+	// Too many params are moving, jump value
+	module->params[paramId].setValue(value);
 }
 
 
 float Engine::getParamSmoothValue(Module* module, int paramId) {
-	if (internal->smoothModule == module && internal->smoothParamId == paramId)
-		return internal->smoothValue;
+	uint64_t state;
+	if (EngineSmoothRamp* ramp = Engine_findSmoothRamp(internal, module, paramId, state))
+		return ramp->value.load(std::memory_order_relaxed);
 	return module->params[paramId].getValue();
 }
 
 
 void Engine::addParamHandle(ParamHandle* paramHandle) {
+	std::lock_guard<SharedMutex> processLock(internal->processMutex);
 	std::lock_guard<SharedMutex> lock(internal->mutex);
 	// New ParamHandles must be blank.
 	// This means we don't have to refresh the cache.
@@ -1131,6 +3360,7 @@ void Engine::addParamHandle(ParamHandle* paramHandle) {
 
 
 void Engine::removeParamHandle(ParamHandle* paramHandle) {
+	std::lock_guard<SharedMutex> processLock(internal->processMutex);
 	std::lock_guard<SharedMutex> lock(internal->mutex);
 	removeParamHandle_NoLock(paramHandle);
 }
@@ -1155,10 +3385,7 @@ ParamHandle* Engine::getParamHandle(int64_t moduleId, int paramId) {
 
 
 ParamHandle* Engine::getParamHandle_NoLock(int64_t moduleId, int paramId) {
-	auto it = internal->paramHandlesCache.find(std::make_tuple(moduleId, paramId));
-	if (it == internal->paramHandlesCache.end())
-		return NULL;
-	return it->second;
+	return internal->paramHandlesCache.get(std::make_tuple(moduleId, paramId));
 }
 
 
@@ -1168,6 +3395,7 @@ ParamHandle* Engine::getParamHandle(Module* module, int paramId) {
 
 
 void Engine::updateParamHandle(ParamHandle* paramHandle, int64_t moduleId, int paramId, bool overwrite) {
+	std::lock_guard<SharedMutex> processLock(internal->processMutex);
 	std::lock_guard<SharedMutex> lock(internal->mutex);
 	updateParamHandle_NoLock(paramHandle, moduleId, paramId, overwrite);
 }
@@ -1210,6 +3438,14 @@ void Engine::updateParamHandle_NoLock(ParamHandle* paramHandle, int64_t moduleId
 }
 
 
+void Engine_setThreadCount(Engine* engine, int threadCount);
+void Engine_setBlockSize(Engine* engine, int blockSize);
+void Engine_setModuleCanSleep(Engine* engine, Module* module, bool canSleep);
+void Engine_setModuleOffloaded(Engine* engine, Module* module, bool offloaded);
+void Engine_beginTopologyBatch(Engine* engine);
+void Engine_endTopologyBatch(Engine* engine);
+
+
 json_t* Engine::toJson() {
 	SharedLock<SharedMutex> lock(internal->mutex);
 	json_t* rootJ = json_object();
@@ -1218,6 +3454,13 @@ json_t* Engine::toJson() {
 	json_t* modulesJ = json_array();
 	for (Module* module : internal->modules) {
 		json_t* moduleJ = module->toJson();
+		// canSleep, only stored when it differs from the module's default
+		const bool canSleep = internal->sleepModules.find(module) != internal->sleepModules.end();
+		if (canSleep != (dynamic_cast<SleepModule*>(module) != nullptr))
+			json_object_set_new(moduleJ, "canSleep", json_boolean(canSleep));
+		// offload, only stored when set
+		if (internal->offloadModules.find(module) != internal->offloadModules.end())
+			json_object_set_new(moduleJ, "offload", json_boolean(true));
 		json_array_append_new(modulesJ, moduleJ);
 	}
 	for (TerminalModule* terminalModule : internal->terminalModules) {
@@ -1234,19 +3477,119 @@ json_t* Engine::toJson() {
 	}
 	json_object_set_new(rootJ, "cables", cablesJ);
 
+	// threadCount, only stored when the patch opted into multi-threading
+	if (internal->threadCount > 1)
+		json_object_set_new(rootJ, "threadCount", json_integer(internal->threadCount));
+
+	// blockSize, only stored when the patch uses fixed size blocks
+	const int blockSize = internal->blockSize.load(std::memory_order_relaxed);
+	if (blockSize > 0)
+		json_object_set_new(rootJ, "blockSize", json_integer(blockSize));
+
 	return rootJ;
 }
 
 
-void Engine::fromJson(json_t* rootJ) {
-	// Don't write-lock the entire method because most of it doesn't need it.
+/** A module of a patch being loaded by Engine::fromJson() */
+struct EngineLoadingModule {
+	json_t* moduleJ;
+	size_t moduleIndex;
+	CardinalPluginModelHelper* helper;
+	Module* module = NULL;
+	/** Message of the exception thrown by Module::fromJson(), if any */
+	std::string error;
+};
 
-	// Write-locks
-	clear();
-	// modules
-	json_t* modulesJ = json_object_get(rootJ, "modules");
-	if (!modulesJ)
-		return;
+
+/** Calls `f(i)` for each `i` in [0, count), spread over as many threads as there are cores, including the calling one.
+Returns once all calls are done.
+If calls throw, the others still run, and the first exception is rethrown on the calling thread.
+*/
+template <typename F>
+static void Engine_parallelFor(Engine* that, size_t count, const F& f) {
+	// Which thread gets which call varies, so a seed set with Engine_setRandomSeed() is applied per call
+	const bool seeded = that->internal->randomSeedGeneration.load(std::memory_order_acquire) != 0;
+	const uint64_t seed = that->internal->randomSeed.load(std::memory_order_relaxed);
+	std::atomic<size_t> next{0};
+	std::mutex exceptionMutex;
+	std::exception_ptr exception;
+	const auto work = [&]() {
+		for (size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < count;) {
+			if (seeded)
+				random::local().seed(seed, LOADER_RANDOM_STREAM + i);
+			try {
+				f(i);
+			}
+			catch (...) {
+				std::lock_guard<std::mutex> lock(exceptionMutex);
+				if (!exception)
+					exception = std::current_exception();
+			}
+		}
+	};
+
+	// Modules expect the context of their engine, and may use random values
+	Context* const context = contextGet();
+	const size_t threadCount = std::min<size_t>(count, std::max(1u, std::thread::hardware_concurrency()));
+	std::vector<std::thread> threads;
+	threads.reserve(threadCount);
+	for (size_t i = 1; i < threadCount; i++) {
+		threads.emplace_back([&]() {
+			contextSet(context);
+			system::setThreadName("Patch loader");
+			random::init();
+			work();
+		});
+	}
+	work();
+	for (std::thread& thread : threads)
+		thread.join();
+	if (exception)
+		std::rethrow_exception(exception);
+}
+
+
+/** Calls `f(loadingModule)` for each module of a patch being loaded.
+Modules of models that opted into CardinalPluginModelHelper::parallelLoading go through Engine_parallelFor(),
+the others are called one at a time on the calling thread first, in patch order.
+`f` reports errors in EngineLoadingModule::error rather than throwing.
+*/
+template <typename F>
+static void Engine_forEachLoadingModule(Engine* that, std::vector<EngineLoadingModule>& loadingModules, const F& f) {
+	std::vector<EngineLoadingModule*> parallelModules;
+	for (EngineLoadingModule& loadingModule : loadingModules) {
+		if (loadingModule.helper->parallelLoading)
+			parallelModules.push_back(&loadingModule);
+		else
+			f(loadingModule);
+	}
+	Engine_parallelFor(that, parallelModules.size(), [&](size_t i) {
+		f(*parallelModules[i]);
+	});
+}
+
+
+/** Runs `f`, storing what it throws in `loadingModule.error`.
+*/
+template <typename F>
+static void EngineLoadingModule_try(EngineLoadingModule& loadingModule, const F& f) {
+	try {
+		f();
+	}
+	catch (std::exception& e) {
+		loadingModule.error = e.what();
+	}
+	catch (...) {
+		loadingModule.error = "Unknown exception";
+	}
+}
+
+
+/** Creates and deserializes the modules of a patch, without adding them to the engine.
+Failed modules are left NULL, or with their error set.
+*/
+static void Engine_loadModules(Engine* that, json_t* modulesJ, std::vector<EngineLoadingModule>& loadingModules) {
+	loadingModules.reserve(json_array_size(modulesJ));
 	size_t moduleIndex;
 	json_t* moduleJ;
 	json_array_foreach(modulesJ, moduleIndex, moduleJ) {
@@ -1261,33 +3604,133 @@ void Engine::fromJson(json_t* rootJ) {
 			continue;
 		}
 
-		// Create module
-		Module* const module = model->createModule();
-		DISTRHO_SAFE_ASSERT_CONTINUE(module != nullptr);
-
-		// Create the widget too, needed by a few modules
 		CardinalPluginModelHelper* const helper = dynamic_cast<CardinalPluginModelHelper*>(model);
 		DISTRHO_SAFE_ASSERT_CONTINUE(helper != nullptr);
 
-		app::ModuleWidget* const moduleWidget = helper->createModuleWidgetFromEngineLoad(module);
-		DISTRHO_SAFE_ASSERT_CONTINUE(moduleWidget != nullptr);
+		EngineLoadingModule loadingModule;
+		loadingModule.moduleJ = moduleJ;
+		loadingModule.moduleIndex = moduleIndex;
+		loadingModule.helper = helper;
+		loadingModules.push_back(loadingModule);
+	}
+
+	// Create modules
+	Engine_forEachLoadingModule(that, loadingModules, [](EngineLoadingModule& loadingModule) {
+		EngineLoadingModule_try(loadingModule, [&]() {
+			loadingModule.module = loadingModule.helper->createModule();
+		});
+	});
+
+	// Create the widgets too, needed by a few modules.
+	// Widgets are registered in their model and load resources through the window, so they are created one at a time.
+	for (EngineLoadingModule& loadingModule : loadingModules) {
+		if (!loadingModule.module)
+			continue;
 
-		try {
-			// This doesn't need a lock because the Module is not added to the Engine yet.
-			module->fromJson(moduleJ);
+		if (loadingModule.helper->createModuleWidgetFromEngineLoad(loadingModule.module) == nullptr) {
+			delete loadingModule.module;
+			loadingModule.module = NULL;
+		}
+	}
+
+	// Deserialize modules, which is where samples and models are loaded from disk.
+	// This doesn't need a lock because the Modules are not added to the Engine yet.
+	Engine_forEachLoadingModule(that, loadingModules, [](EngineLoadingModule& loadingModule) {
+		if (!loadingModule.module)
+			return;
+		EngineLoadingModule_try(loadingModule, [&]() {
+			loadingModule.module->fromJson(loadingModule.moduleJ);
+		});
+	});
+}
+
+
+/** Modules of a patch built ahead of Engine::fromJson() */
+struct EngineStagedPatch {
+	json_t* rootJ;
+	/** Sample rate the modules were prepared for */
+	float sampleRate;
+	std::vector<EngineLoadingModule> loadingModules;
+};
+
+
+void Engine::fromJson(json_t* rootJ) {
+	// Don't write-lock the entire method because most of it doesn't need it.
+
+	// Write-locks
+	clear();
+	// threadCount, patches without it run serially
+	json_t* threadCountJ = json_object_get(rootJ, "threadCount");
+	Engine_setThreadCount(this, threadCountJ ? json_integer_value(threadCountJ) : 1);
+	// blockSize, patches without it follow the host buffer size
+	json_t* blockSizeJ = json_object_get(rootJ, "blockSize");
+	Engine_setBlockSize(this, blockSizeJ ? json_integer_value(blockSizeJ) : 0);
+	// Order modules once after everything is added, instead of on every cable
+	Engine_beginTopologyBatch(this);
+	DEFER({
+		Engine_endTopologyBatch(this);
+	});
+	// modules, built already if this patch was staged
+	std::vector<EngineLoadingModule> loadingModules;
+	bool sampleRateReady = false;
+	{
+		std::lock_guard<std::mutex> lock(internal->stagedPatchesMutex);
+		for (EngineStagedPatch*& stagedPatch : internal->stagedPatches) {
+			if (stagedPatch->rootJ != rootJ)
+				continue;
+			loadingModules.swap(stagedPatch->loadingModules);
+			sampleRateReady = stagedPatch->sampleRate == internal->sampleRate;
+			json_decref(stagedPatch->rootJ);
+			delete stagedPatch;
+			stagedPatch = internal->stagedPatches.back();
+			internal->stagedPatches.pop_back();
+			break;
+		}
+	}
+	json_t* modulesJ = json_object_get(rootJ, "modules");
+	if (!modulesJ)
+		return;
+	if (loadingModules.empty())
+		Engine_loadModules(this, modulesJ, loadingModules);
+
+	// Add modules in patch order
+	for (EngineLoadingModule& loadingModule : loadingModules) {
+		Module* const module = loadingModule.module;
+
+		if (!loadingModule.error.empty()) {
+			WARN("Cannot load module: %s", loadingModule.error.c_str());
+			// APP->patch->log(loadingModule.error);
+			if (module) {
+				loadingModule.helper->removeCachedModuleWidget(module);
+				delete module;
+			}
+			continue;
+		}
+
+		if (!module)
+			continue;
 
+		try {
 			// Before 1.0, the module ID was the index in the "modules" array
 			if (module->id < 0) {
-				module->id = moduleIndex;
+				module->id = loadingModule.moduleIndex;
 			}
 
 			// Write-locks
-			addModule(module);
+			Engine_addModule(this, module, sampleRateReady);
+
+			// canSleep
+			if (json_t* const canSleepJ = json_object_get(loadingModule.moduleJ, "canSleep"))
+				Engine_setModuleCanSleep(this, module, json_boolean_value(canSleepJ));
+
+			// offload
+			if (json_boolean_value(json_object_get(loadingModule.moduleJ, "offload")))
+				Engine_setModuleOffloaded(this, module, true);
 		}
 		catch (Exception& e) {
 			WARN("Cannot load module: %s", e.what());
 			// APP->patch->log(e.what());
-			helper->removeCachedModuleWidget(module);
+			loadingModule.helper->removeCachedModuleWidget(module);
 			delete module;
 			continue;
 		}
@@ -1327,19 +3770,474 @@ void Engine::fromJson(json_t* rootJ) {
 }
 
 
+void EngineWorker::run() {
+	// Configure thread
+	contextSet(engine->internal->context);
+	system::setThreadName(string::f("Worker %d", id));
+	const DISTRHO_NAMESPACE::ScopedDenormalDisable sdd;
+	random::init();
+
+	while (true) {
+		engine->internal->engineBarrier.wait();
+		if (!running)
+			return;
+		Engine_seedRandom(engine->internal, randomSeedGeneration, id + 1);
+		// Set by the audio thread before waking workers up
+		Engine_stepWorker(engine, engine->internal->activeSchedule.load(std::memory_order_relaxed), id);
+	}
+}
+
+
+/** Runs the jobs handed off by Engine_handOffOffloads() until the engine is destroyed.
+*/
+static void Engine_runOffloadWorker(Engine* that, Context* context) {
+	Engine::Internal* internal = that->internal;
+
+	contextSet(context);
+	system::setThreadName("Offload worker");
+	const DISTRHO_NAMESPACE::ScopedDenormalDisable sdd;
+	random::init();
+	uint32_t randomSeedGeneration = 0;
+
+	while (true) {
+		EngineSchedule* schedule;
+		{
+			std::unique_lock<std::mutex> lock(internal->offloadMutex);
+			internal->offloadCv.wait(lock, [internal] {
+				return internal->offloadJob || !internal->offloadRunning;
+			});
+			if (!internal->offloadRunning)
+				return;
+			schedule = internal->offloadJob;
+			internal->offloadJob = nullptr;
+		}
+		Engine_seedRandom(internal, randomSeedGeneration, OFFLOAD_RANDOM_STREAM);
+		Engine_processOffloads(that, schedule);
+		internal->offloadSchedule.store(nullptr, std::memory_order_release);
+	}
+}
+
+
 void Engine::startFallbackThread() {
 }
 
 
+/** Seeds the random generators of the audio thread, workers and patch loaders, each with its own stream.
+Makes renders repeatable, as long as modules only draw random numbers from Rack's generator.
+Threads reseed at their next block, so call it before loading the patch.
+*/
+void Engine_setRandomSeed(Engine* const engine, uint64_t seed) {
+	engine->internal->randomSeed.store(seed, std::memory_order_relaxed);
+	engine->internal->randomSeedGeneration.fetch_add(1, std::memory_order_release);
+}
+
+
 void Engine_setAboutToClose(Engine* const engine) {
 	engine->internal->aboutToClose = true;
 }
 
 
+int Engine_getThreadCount(Engine* const engine) {
+	return engine->internal->threadCount;
+}
+
+
+void Engine_setThreadCount(Engine* const engine, int threadCount) {
+	threadCount = std::max(1, std::min(threadCount, MAX_THREAD_COUNT));
+	std::lock_guard<SharedMutex> processLock(engine->internal->processMutex);
+	std::lock_guard<SharedMutex> lock(engine->internal->mutex);
+	if (threadCount == engine->internal->threadCount)
+		return;
+	Engine_relaunchWorkers(engine, threadCount);
+}
+
+
+int Engine_getBlockSize(Engine* const engine) {
+	return engine->internal->blockSize.load(std::memory_order_relaxed);
+}
+
+
+/** Sets the frames of the blocks that host buffers are split into, or 0 to process whole host buffers.
+Fixed blocks give a steady cost per block and a bounded working set, regardless of the host buffer size.
+*/
+void Engine_setBlockSize(Engine* const engine, int blockSize) {
+	if (blockSize > 0)
+		blockSize = std::max(MIN_BLOCK_SIZE, std::min(blockSize, MAX_BLOCK_SIZE));
+	else
+		blockSize = 0;
+	engine->internal->blockSize.store(blockSize, std::memory_order_relaxed);
+}
+
+
+/** Returns the feedback loops of the patch as module IDs, each starting at its lowest ID and following its cables.
+*/
+std::vector<std::vector<int64_t>> Engine_getFeedbackLoops(Engine* const engine) {
+	SharedLock<SharedMutex> lock(engine->internal->mutex);
+	std::vector<Module*> orderedModules;
+	std::vector<std::vector<Module*>> loops;
+	Engine_sortModules(engine, orderedModules, &loops);
+
+	std::vector<std::vector<int64_t>> loopIds;
+	for (const std::vector<Module*>& loop : loops) {
+		loopIds.emplace_back();
+		for (Module* module : loop)
+			loopIds.back().push_back(module->id);
+	}
+	return loopIds;
+}
+
+
+/** Defers module ordering until the matching Engine_endTopologyBatch(), for adding or removing many modules and cables at once.
+Batches can be nested. Once the patch changes within a batch, nothing is processed until the outermost batch ends.
+*/
+void Engine_beginTopologyBatch(Engine* const engine) {
+	std::lock_guard<SharedMutex> lock(engine->internal->mutex);
+	engine->internal->topologyBatch++;
+}
+
+
+void Engine_endTopologyBatch(Engine* const engine) {
+	std::lock_guard<SharedMutex> lock(engine->internal->mutex);
+	Engine_endTopologyBatch_NoLock(engine);
+}
+
+
 void Engine_setRemoteDetails(Engine* const engine, remoteUtils::RemoteDetails* const remoteDetails) {
 	engine->internal->remoteDetails = remoteDetails;
 }
 
 
+bool Engine_canModuleSleep(Engine* const engine, Module* const module) {
+	SharedLock<SharedMutex> lock(engine->internal->mutex);
+	return engine->internal->sleepModules.find(module) != engine->internal->sleepModules.end();
+}
+
+
+/** Allows or prevents a module from sleeping while it is silent, see SleepModule.
+Terminal modules are ignored, they never sleep.
+*/
+void Engine_setModuleCanSleep(Engine* const engine, Module* const module, bool canSleep) {
+	std::lock_guard<SharedMutex> lock(engine->internal->mutex);
+	Engine_updateModuleCanSleep(engine, module, canSleep);
+}
+
+
+bool Engine_isModuleOffloaded(Engine* const engine, Module* const module) {
+	SharedLock<SharedMutex> lock(engine->internal->mutex);
+	return engine->internal->offloadModules.find(module) != engine->internal->offloadModules.end();
+}
+
+
+/** Moves a module to the offload worker, or back to the audio thread.
+An offloaded module is processed in parallel with the rest of the patch, one block behind it.
+Its outputs are therefore delayed by one block, see Engine_getOffloadLatency(), which suits heavy modules on branches that tolerate it.
+Its expanders keep being flipped by the audio thread, so modules exchanging expander messages should not be offloaded.
+Terminal modules are ignored, they exchange data with the host.
+*/
+void Engine_setModuleOffloaded(Engine* const engine, Module* const module, bool offloaded) {
+	Engine::Internal* internal = engine->internal;
+	std::lock_guard<SharedMutex> lock(internal->mutex);
+	if (internal->moduleIndexes.find(module) == internal->moduleIndexes.end())
+		return;
+	if (offloaded) {
+		if (!internal->offloadThread.joinable()) {
+			internal->offloadRunning = true;
+			internal->offloadThread = std::thread(Engine_runOffloadWorker, engine, contextGet());
+		}
+		internal->offloadModules.insert(module);
+	}
+	else {
+		internal->offloadModules.erase(module);
+	}
+	Engine_updateSchedule(engine);
+}
+
+
+/** Returns the number of frames by which offloaded modules lag behind, the length of the last block.
+0 while no module is processed on the worker thread.
+*/
+int Engine_getOffloadLatency(Engine* const engine) {
+	return engine->internal->offloadLatency.load(std::memory_order_relaxed);
+}
+
+
+/** Deletes the patch staged for `rootJ`, if Engine::fromJson() didn't take it.
+Deletes all staged patches if `rootJ` is NULL.
+*/
+void Engine_discardStagedPatch(Engine* const engine, json_t* rootJ) {
+	std::vector<EngineStagedPatch*> stagedPatches;
+	{
+		std::lock_guard<std::mutex> lock(engine->internal->stagedPatchesMutex);
+		std::vector<EngineStagedPatch*>& allStagedPatches = engine->internal->stagedPatches;
+		for (size_t i = 0; i < allStagedPatches.size();) {
+			if (rootJ && allStagedPatches[i]->rootJ != rootJ) {
+				i++;
+				continue;
+			}
+			stagedPatches.push_back(allStagedPatches[i]);
+			allStagedPatches[i] = allStagedPatches.back();
+			allStagedPatches.pop_back();
+		}
+	}
+
+	for (EngineStagedPatch* stagedPatch : stagedPatches) {
+		for (EngineLoadingModule& loadingModule : stagedPatch->loadingModules) {
+			if (!loadingModule.module)
+				continue;
+			loadingModule.helper->removeCachedModuleWidget(loadingModule.module);
+			delete loadingModule.module;
+		}
+		json_decref(stagedPatch->rootJ);
+		delete stagedPatch;
+	}
+}
+
+
+/** Returns whether a patch is staged for `rootJ`.
+*/
+bool Engine_isPatchStaged(Engine* const engine, json_t* rootJ) {
+	std::lock_guard<std::mutex> lock(engine->internal->stagedPatchesMutex);
+	for (EngineStagedPatch* stagedPatch : engine->internal->stagedPatches) {
+		if (stagedPatch->rootJ == rootJ)
+			return true;
+	}
+	return false;
+}
+
+
+/** Builds the modules of a patch while the current one keeps playing.
+They are created, deserialized and prepared for the current sample rate, but not added.
+A following Engine::fromJson() with the same `rootJ` then only has to swap them in, which is quick.
+Several patches can be staged at once, each one is kept until taken by Engine::fromJson() or discarded.
+Must be called from the thread that loads patches.
+*/
+void Engine_stagePatch(Engine* const engine, json_t* rootJ) {
+	Engine_discardStagedPatch(engine, rootJ);
+
+	json_t* modulesJ = json_object_get(rootJ, "modules");
+	if (!modulesJ)
+		return;
+
+	EngineStagedPatch* const stagedPatch = new EngineStagedPatch;
+	stagedPatch->rootJ = json_incref(rootJ);
+	stagedPatch->sampleRate = engine->internal->sampleRate;
+	Engine_loadModules(engine, modulesJ, stagedPatch->loadingModules);
+
+	// Dispatch SampleRateChangeEvent now, instead of when adding them
+	Module::SampleRateChangeEvent eSrc;
+	eSrc.sampleRate = engine->internal->sampleRate;
+	eSrc.sampleTime = engine->internal->sampleTime;
+	Engine_forEachLoadingModule(engine, stagedPatch->loadingModules, [&](EngineLoadingModule& loadingModule) {
+		if (!loadingModule.module || !loadingModule.error.empty())
+			return;
+		EngineLoadingModule_try(loadingModule, [&]() {
+			loadingModule.module->onSampleRateChange(eSrc);
+		});
+	});
+
+	std::lock_guard<std::mutex> lock(engine->internal->stagedPatchesMutex);
+	engine->internal->stagedPatches.push_back(stagedPatch);
+}
+
+
+/** Looks up a module in the latest schedule, the way the audio thread finds expanders.
+Only meant for benchmarks, the schedule must not be replaced meanwhile.
+*/
+Module* Engine_getScheduledModule(Engine* const engine, int64_t moduleId) {
+	return engine->internal->schedule.load(std::memory_order_acquire)->modulesCache.get(moduleId);
+}
+
+
+int Engine_getSleepingModuleCount(Engine* const engine) {
+	return engine->internal->sleepingCount.load(std::memory_order_relaxed);
+}
+
+
+#ifndef HEADLESS
+/** Updates the plug lights of every port from its current voltage, called by the UI once per frame.
+The audio thread doesn't touch them, so the cost of plug lights doesn't depend on the patch, and is gone while the UI is closed.
+*/
+void Engine_stepPlugLights(Engine* const engine, float deltaTime) {
+	// Fast attack and slow decay at UI rates, long frames would overshoot the decay
+	deltaTime = std::min(deltaTime, 1.f / 60.f);
+	SharedLock<SharedMutex> lock(engine->internal->mutex);
+	for (Module* module : engine->internal->modules) {
+		for (Input& input : module->inputs)
+			Port_step(&input, deltaTime);
+		for (Output& output : module->outputs)
+			Port_step(&output, deltaTime);
+	}
+	for (TerminalModule* terminalModule : engine->internal->terminalModules) {
+		for (Input& input : terminalModule->inputs)
+			Port_step(&input, deltaTime);
+		for (Output& output : terminalModule->outputs)
+			Port_step(&output, deltaTime);
+	}
+}
+#endif
+
+
+bool Engine_isTracing(Engine* const engine) {
+	return engine->internal->trace.enabled;
+}
+
+
+/** Starts or stops recording the engine trace.
+It records every block, along with the time spent on each module, waiting for the engine lock and smoothing params.
+Only costs a few clock reads per module and frame while enabled.
+*/
+void Engine_setTracing(Engine* const engine, bool tracing) {
+	EngineTrace& trace = engine->internal->trace;
+	// The audio thread only uses the buffer once enabled, and it is never resized afterwards
+	if (tracing && trace.events.empty())
+		trace.events.resize(TRACE_CAPACITY);
+	trace.enabled.store(tracing, std::memory_order_release);
+}
+
+
+/** Saves the last `seconds` of the engine trace in the Chrome trace event format, for chrome://tracing or Perfetto.
+The engine gets one track and each module gets its own.
+*/
+bool Engine_saveTrace(Engine* const engine, const std::string& path, double seconds) {
+	Engine::Internal* internal = engine->internal;
+	EngineTrace& trace = internal->trace;
+	if (trace.events.empty())
+		return false;
+
+	// Copy the ring buffer while the audio thread keeps writing to it, dropping what it overwrote in the meantime
+	const uint64_t count = trace.count.load(std::memory_order_acquire);
+	const std::vector<EngineTraceEvent> events(trace.events);
+	const uint64_t newCount = trace.count.load(std::memory_order_acquire);
+	const uint64_t begin = newCount > TRACE_CAPACITY ? newCount - TRACE_CAPACITY : 0;
+
+	double endTime = -INFINITY;
+	for (uint64_t i = begin; i < count; i++) {
+		const EngineTraceEvent& event = events[i % TRACE_CAPACITY];
+		endTime = std::max(endTime, event.time + event.duration);
+	}
+	const double minTime = endTime - seconds;
+	double originTime = INFINITY;
+	std::map<int64_t, int> moduleTracks;
+	for (uint64_t i = begin; i < count; i++) {
+		const EngineTraceEvent& event = events[i % TRACE_CAPACITY];
+		if (event.time + event.duration < minTime)
+			continue;
+		originTime = std::min(originTime, event.time);
+		if (event.type == EngineTraceEvent::MODULE)
+			moduleTracks.emplace(event.value, 0);
+	}
+
+	json_t* eventsJ = json_array();
+	auto addTrack = [eventsJ](int tid, const std::string& name) {
+		json_t* nameJ = json_object();
+		json_object_set_new(nameJ, "name", json_string("thread_name"));
+		json_object_set_new(nameJ, "ph", json_string("M"));
+		json_object_set_new(nameJ, "pid", json_integer(1));
+		json_object_set_new(nameJ, "tid", json_integer(tid));
+		json_t* argsJ = json_object();
+		json_object_set_new(argsJ, "name", json_string(name.c_str()));
+		json_object_set_new(nameJ, "args", argsJ);
+		json_array_append_new(eventsJ, nameJ);
+
+		json_t* sortJ = json_object();
+		json_object_set_new(sortJ, "name", json_string("thread_sort_index"));
+		json_object_set_new(sortJ, "ph", json_string("M"));
+		json_object_set_new(sortJ, "pid", json_integer(1));
+		json_object_set_new(sortJ, "tid", json_integer(tid));
+		argsJ = json_object();
+		json_object_set_new(argsJ, "sort_index", json_integer(tid));
+		json_object_set_new(sortJ, "args", argsJ);
+		json_array_append_new(eventsJ, sortJ);
+	};
+
+	// Name tracks after modules, removed ones are only known by ID
+	addTrack(0, "Engine");
+	std::vector<std::string> moduleNames(moduleTracks.size() + 1);
+	{
+		SharedLock<SharedMutex> lock(internal->mutex);
+		int tid = 1;
+		for (auto& pair : moduleTracks) {
+			pair.second = tid;
+			Module* const module = engine->getModule_NoLock(pair.first);
+			moduleNames[tid] = module ? module->model->getFullName() : "Removed module";
+			addTrack(tid, string::f("%s (%lld)", moduleNames[tid].c_str(), (long long) pair.first));
+			tid++;
+		}
+	}
+
+	for (uint64_t i = begin; i < count; i++) {
+		const EngineTraceEvent& event = events[i % TRACE_CAPACITY];
+		if (event.time + event.duration < minTime)
+			continue;
+
+		int tid = 0;
+		const char* name = "";
+		switch (event.type) {
+			case EngineTraceEvent::BLOCK: name = "Block"; break;
+			case EngineTraceEvent::LOCK_WAIT: name = "Lock wait"; break;
+			case EngineTraceEvent::SMOOTHING: name = "Param smoothing"; break;
+			case EngineTraceEvent::MODULE:
+				tid = moduleTracks[event.value];
+				name = moduleNames[tid].c_str();
+				break;
+		}
+
+		json_t* eventJ = json_object();
+		json_object_set_new(eventJ, "name", json_string(name));
+		json_object_set_new(eventJ, "ph", json_string("X"));
+		// In microseconds
+		json_object_set_new(eventJ, "ts", json_real((event.time - originTime) * 1e6));
+		json_object_set_new(eventJ, "dur", json_real(event.duration * 1e6));
+		json_object_set_new(eventJ, "pid", json_integer(1));
+		json_object_set_new(eventJ, "tid", json_integer(tid));
+		if (event.type == EngineTraceEvent::BLOCK) {
+			json_t* argsJ = json_object();
+			json_object_set_new(argsJ, "frames", json_integer(event.value));
+			json_object_set_new(eventJ, "args", argsJ);
+		}
+		json_array_append_new(eventsJ, eventJ);
+	}
+
+	json_t* rootJ = json_object();
+	json_object_set_new(rootJ, "traceEvents", eventsJ);
+	json_object_set_new(rootJ, "displayTimeUnit", json_string("ms"));
+	DEFER({
+		json_decref(rootJ);
+	});
+
+	FILE* file = std::fopen(path.c_str(), "w");
+	if (!file) {
+		WARN("Could not save engine trace to %s", path.c_str());
+		return false;
+	}
+	json_dumpf(rootJ, file, JSON_COMPACT);
+	std::fclose(file);
+	return true;
+}
+
+
+/** Adds the time spent on each module by ID to `moduleTimes`, from trace event `position` onwards, and moves `position` past the latest event.
+Returns the time spent in blocks over the same events.
+Events overwritten by the audio thread in the meantime are skipped, so call it at least once every few thousand blocks.
+*/
+double Engine_accumulateTrace(Engine* const engine, uint64_t& position, std::map<int64_t, double>& moduleTimes) {
+	EngineTrace& trace = engine->internal->trace;
+	if (trace.events.empty())
+		return 0.0;
+
+	const uint64_t count = trace.count.load(std::memory_order_acquire);
+	position = std::max(position, count > TRACE_CAPACITY ? count - TRACE_CAPACITY : 0);
+	double blockTime = 0.0;
+	for (; position < count; position++) {
+		const EngineTraceEvent& event = trace.events[position % TRACE_CAPACITY];
+		if (event.type == EngineTraceEvent::MODULE)
+			moduleTimes[event.value] += event.duration;
+		else if (event.type == EngineTraceEvent::BLOCK)
+			blockTime += event.duration;
+	}
+	return blockTime;
+}
+
+
 } // namespace engine
 } // namespace rack
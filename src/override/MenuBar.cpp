@@ -71,7 +71,15 @@ namespace asset {
 std::string patchesPath();
 }
 namespace engine {
+int Engine_getThreadCount(Engine*);
+void Engine_setThreadCount(Engine*, int);
+int Engine_getBlockSize(Engine*);
+void Engine_setBlockSize(Engine*, int);
 void Engine_setRemoteDetails(Engine*, remoteUtils::RemoteDetails*);
+int Engine_getSleepingModuleCount(Engine*);
+bool Engine_isTracing(Engine*);
+void Engine_setTracing(Engine*, bool);
+bool Engine_saveTrace(Engine*, const std::string&, double);
 }
 
 namespace app {
@@ -268,6 +276,41 @@ struct FileButton : MenuButton {
 			patchUtils::saveTemplateDialog();
 		}));
 
+#if DISTRHO_PLUGIN_WANT_PROGRAMS
+		// Remote instances have no DSP side to keep a bank in
+		if (static_cast<CardinalPluginContext*>(APP)->plugin != nullptr) {
+			menu->addChild(createSubmenuItem("Patch bank", "", [](ui::Menu* menu) {
+				CardinalPluginContext* const pcontext = static_cast<CardinalPluginContext*>(APP);
+				CardinalBasePlugin* const plugin = static_cast<CardinalBasePlugin*>(pcontext->plugin);
+
+				for (uint32_t i = 0; i < kPatchBankSize; ++i) {
+					std::string name;
+					size_t memoryUsage = 0;
+					const bool used = plugin->getBankProgram(i, name, memoryUsage);
+
+					// memory taken by the preloaded modules, so users know what a full bank costs
+					const std::string label = string::f("%u: %s", i + 1, used ? name.c_str() : "(empty)");
+					const std::string rightText = used ? string::f("%.1f MiB", memoryUsage / (1024.0 * 1024.0)) : "";
+
+					menu->addChild(createSubmenuItem(label, rightText, [=](ui::Menu* menu) {
+						menu->addChild(createMenuItem("Select", "", [=]() {
+							pcontext->pendingProgram = static_cast<int32_t>(i);
+						}, !used));
+
+						menu->addChild(createMenuItem("Store current patch", "", [=]() {
+							const std::string patchName = APP->patch->path.empty() ? "Untitled" : system::getStem(APP->patch->path);
+							plugin->storeBankProgram(i, patchName.c_str());
+						}));
+
+						menu->addChild(createMenuItem("Clear", "", [=]() {
+							plugin->clearBankProgram(i);
+						}, !used));
+					}));
+				}
+			}));
+		}
+#endif
+
 #ifdef DISTRHO_OS_WASM
 		menu->addChild(new ui::MenuSeparator);
 
@@ -744,6 +787,67 @@ struct EngineButton : MenuButton {
 			settings::cpuMeter ^= true;
 		}));
 
+		// Stored per patch, host buffers are processed as a whole unless the patch opts in
+		const int blockSize = Engine_getBlockSize(APP->engine);
+		menu->addChild(createSubmenuItem("Block size", blockSize != 0 ? string::f("%d", blockSize) : "Host", [=](ui::Menu* menu) {
+			menu->addChild(createCheckMenuItem("Host buffer size", "",
+				[=]() {return blockSize == 0;},
+				[=]() {Engine_setBlockSize(APP->engine, 0);}
+			));
+			for (int i = 16; i <= 512; i *= 2) {
+				menu->addChild(createCheckMenuItem(string::f("%d", i), "",
+					[=]() {return blockSize == i;},
+					[=]() {Engine_setBlockSize(APP->engine, i);}
+				));
+			}
+		}));
+
+		// Event budget of MIDI sent to the host, for diagnosing dense SysEx or clock output
+		if (const CardinalMidiOutput* const midiOutput = static_cast<CardinalPluginContext*>(APP)->midiOutput) {
+			menu->addChild(createMenuLabel(string::f("MIDI output: peak %u/%u events, %u dropped",
+				midiOutput->peakEventCount, kMidiOutputEventCount, midiOutput->droppedEventCount)));
+		}
+		if (const uint32_t midiInputDropped = static_cast<CardinalPluginContext*>(APP)->midiInputDroppedEventCount)
+			menu->addChild(createMenuLabel(string::f("MIDI input: %u events dropped", midiInputDropped)));
+
+#ifndef DISTRHO_OS_WASM
+		// Stored per patch, the engine runs serially unless the patch opts in
+		const int threadCount = Engine_getThreadCount(APP->engine);
+		menu->addChild(createSubmenuItem("Threads", string::f("%d", threadCount), [=](ui::Menu* menu) {
+			const int cores = std::min(std::max(1, system::getLogicalCoreCount()), 16);
+			for (int i = 1; i <= cores; i++) {
+				std::string rightText;
+				if (i == 1)
+					rightText += "(lowest jitter)";
+				menu->addChild(createCheckMenuItem(string::f("%d", i), rightText,
+					[=]() {return threadCount == i;},
+					[=]() {Engine_setThreadCount(APP->engine, i);}
+				));
+			}
+		}));
+
+		const bool tracing = Engine_isTracing(APP->engine);
+		menu->addChild(createSubmenuItem("Trace", tracing ? "Recording" : "", [=](ui::Menu* menu) {
+			menu->addChild(createCheckMenuItem("Record", "",
+				[=]() {return tracing;},
+				[=]() {Engine_setTracing(APP->engine, !tracing);}
+			));
+			menu->addChild(createMenuItem("Save last 10 seconds...", "", []() {
+				const std::string traceDir = asset::user("");
+				async_dialog_filebrowser(true, "engine-trace.json", traceDir.c_str(), "Save engine trace", [](char* pathC) {
+					if (!pathC) {
+						// No path selected
+						return;
+					}
+					DEFER({std::free(pathC);});
+
+					if (!Engine_saveTrace(APP->engine, pathC, 10.0))
+						async_dialog_message("Error, could not save engine trace!");
+				});
+			}, !tracing));
+		}));
+#endif
+
 #ifdef HAVE_LIBLO
 		if (isStandalone()) {
 			CardinalPluginContext* const context = static_cast<CardinalPluginContext*>(APP);
@@ -906,6 +1010,9 @@ struct InfoLabel : ui::Label {
 			double meterAverage = APP->engine->getMeterAverage();
 			double meterMax = APP->engine->getMeterMax();
 			text = string::f("%.1f fps  %.1f%% avg  %.1f%% max", fps, meterAverage * 100, meterMax * 100);
+			const int sleepingCount = Engine_getSleepingModuleCount(APP->engine);
+			if (sleepingCount > 0)
+				text += string::f("  %d asleep", sleepingCount);
 #else
 			text = string::f("%.1f fps", fps);
 #endif
@@ -33,6 +33,7 @@
 #include <app/ModuleWidget.hpp>
 #include <app/Scene.hpp>
 #include <engine/Engine.hpp>
+#include <engine/TerminalModule.hpp>
 #include <plugin/Plugin.hpp>
 #include <app/SvgPanel.hpp>
 #include <ui/MenuSeparator.hpp>
@@ -47,6 +48,14 @@
 
 
 namespace rack {
+namespace engine {
+bool Engine_canModuleSleep(Engine*, Module*);
+void Engine_setModuleCanSleep(Engine*, Module*, bool);
+bool Engine_isModuleOffloaded(Engine*, Module*);
+void Engine_setModuleOffloaded(Engine*, Module*, bool);
+int Engine_getOffloadLatency(Engine*);
+}
+
 namespace app {
 
 
@@ -1109,6 +1118,31 @@ void ModuleWidget::createContextMenu() {
 		weakThis->bypassAction(!bypassed);
 	}));
 
+	// Sleep, terminal modules talk to the host and never sleep
+	if (module && !dynamic_cast<engine::TerminalModule*>(module)) {
+		const bool canSleep = engine::Engine_canModuleSleep(APP->engine, module);
+		menu->addChild(createCheckMenuItem("Sleep while silent", "",
+			[=]() {return canSleep;},
+			[=]() {
+				if (!weakThis || !weakThis->module)
+					return;
+				engine::Engine_setModuleCanSleep(APP->engine, weakThis->module, !canSleep);
+			}
+		));
+
+		// Offload, shows how late its outputs are
+		const bool offloaded = engine::Engine_isModuleOffloaded(APP->engine, module);
+		const int latency = offloaded ? engine::Engine_getOffloadLatency(APP->engine) : 0;
+		menu->addChild(createCheckMenuItem("Process on worker thread", latency > 0 ? string::f("%d samples late", latency) : "",
+			[=]() {return offloaded;},
+			[=]() {
+				if (!weakThis || !weakThis->module)
+					return;
+				engine::Engine_setModuleOffloaded(APP->engine, weakThis->module, !offloaded);
+			}
+		));
+	}
+
 	// Duplicate
 	menu->addChild(createMenuItem("Duplicate", RACK_MOD_CTRL_NAME "+D", [=]() {
 		if (!weakThis)
@@ -63,6 +63,9 @@
 #endif
 
 namespace rack {
+namespace engine {
+void Engine_stepPlugLights(Engine*, float deltaTime);
+}
 namespace window {
 
 
@@ -665,6 +668,10 @@ void Window::step() {
 		// Resize scene
 		APP->scene->box.size = math::Vec(fbWidth, fbHeight).div(pixelRatio);
 
+		// Plug lights are computed here instead of on the audio thread
+		if (std::isfinite(internal->lastFrameDuration))
+			engine::Engine_stepPlugLights(APP->engine, internal->lastFrameDuration);
+
 		// Step scene
 		APP->scene->step();
 		// t2 = system::getTime();